@@ -17,6 +17,7 @@
 #include "pic32.h"
 #include "serial.h"
 #include "console.h"
+#include "crc16.h"
 
 #define FRAME_SOH           0x01
 #define FRAME_EOT           0x04
@@ -45,27 +46,6 @@ typedef struct {
 #define MICROCHIP_VID           0x04d8
 #define BOOTLOADER_PID          0x003c  /* Microchip AN1388 Bootloader */
 
-/*
- * Calculate checksum.
- */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
-{
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
-}
-
 static inline unsigned add_byte(unsigned char c,
     unsigned char *buf, unsigned indx)
 {
@@ -101,12 +81,12 @@ static void an1388_command(an1388_adapter_t *a, unsigned char cmd,
     buf[n++] = FRAME_SOH;
 
     n = add_byte(cmd, buf, n);
-    crc = calculate_crc(0, &cmd, 1);
+    crc = crc16(0, &cmd, 1);
 
     if (data_len > 0) {
         for (i=0; i<data_len; ++i)
             n = add_byte(data[i], buf, n);
-        crc = calculate_crc(crc, data, data_len);
+        crc = crc16(crc, data, data_len);
     }
     n = add_byte(crc, buf, n);
     n = add_byte(crc >> 8, buf, n);
@@ -170,7 +150,7 @@ static void an1388_command(an1388_adapter_t *a, unsigned char cmd,
                 a->reply_len = 0;
                 if (c > 2) {
                     unsigned crc = a->reply[c-2] | (a->reply[c-1] << 8);
-                    if (crc == calculate_crc(0, a->reply, c-2)) {
+                    if (crc == crc16(0, a->reply, c-2)) {
                         a->reply_len = c - 2;
                     }
                 }
@@ -256,7 +236,7 @@ static void an1388_verify_data(adapter_t *adapter,
     }
     flash_crc = a->reply[1] | a->reply[2] << 8;
 
-    data_crc = calculate_crc(0, (unsigned char*) data, nbytes);
+    data_crc = crc16(0, (unsigned char*) data, nbytes);
     if (flash_crc != data_crc) {
         fprintf(stderr, "uart: checksum failed at %08x: sum=%04x, expected=%04x\n",
             addr, flash_crc, data_crc);
@@ -396,6 +376,7 @@ adapter_t *adapter_open_an1388_uart(const char *port, int baud_rate)
         a->adapter.user_start + a->adapter.user_nbytes - 1);
 
     a->adapter.block_override = 0;
+    a->adapter.name = "AN1388 UART";
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     /* User functions. */
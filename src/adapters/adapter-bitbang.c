@@ -20,6 +20,9 @@
 #include "pic32.h"
 #include "serial.h"
 #include "console.h"
+#include "report.h"
+#include "crc16.h"
+#include "jtag-encode.h"
 
 typedef struct {
     adapter_t adapter;              /* Common part */
@@ -56,27 +59,6 @@ static int CFG3 = 1;    // 0 = uncompressed stream (use only 'd','e','f','g'
 static int CFG4 = 1;    // decompression method in serial read (normally set to match CFG3)
 static int MAXW = 440;  // maximum continuous write before sync: 900 + 50 < 1024, 440 + 30 < 512
 
-/*
- * Calculate checksum.
- */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
-{
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
-}
-
 /*
  * Sends a command ('8')to the programmer telling it to insert
  * a 10mS delay in the datastream being sent to the target. This
@@ -144,24 +126,13 @@ static void bitbang_send(bitbang_adapter_t *a,
     unsigned tdi_nbits, unsigned long long tdi, int read_flag)
 {
     //
-    // TMS is a command of 0 to 14 bits length, sent LSB first. TDI = 0 throughout.
-    //
-    // if nTDI<>0 then send TMS = 1-0-0 (TDI = 0).
-    //
-    // Next we send out the TDI bits (up to 64, LSB first), with TMS=0 for n-1 bits;
-    // the last TDI bit should be accompanied with TMS = 1.
-    //
-    // if nTDI<>0 then send TMS = 1-0 (TDI = 0).
-    //
-    // NOTE: if read_flag == 1, then read TDO on last TMS bit and each of n-1 TDI bits.
-    //       if read_flag == 2, only read TDO on the last TMS bit (to just get PrAcc)
+    // See bitbang_encode() for the format of the command string.
     //
 
     unsigned char buffer[110];  // @@@@@@@@@@ BUFFERED WRITES VERSION @@@@@@@@@@
-    int index = 0;              // index of next slot to use in buffer
-    int pairs = 0;              // count of number of TDI/TMS pairs
-    int count = 0;              // count of the number of symbols used
-    int i, n;
+    int index;                  // index of next slot to use in buffer
+    bitbang_count_t c;
+    int n;
     unsigned char ch;
 
     if (a->BitsToRead != 0)
@@ -169,81 +140,13 @@ static void bitbang_send(bitbang_adapter_t *a,
     if (read_flag && (tdi_nbits == 0))
         fprintf(stderr, "WARNING - request to read 0 bits (in send)\n");
 
-    for (i = tms_nbits; i > 0; i--) {           // for each of the n bits...
-        ch = (tms & 1) + 'd';                   // d, e, f, g
-        buffer [index++] = ch;                  // append to buffer
-        tms >>= 1;                              // shift TMS right one bit
-    }
-    count += tms_nbits;
-    pairs += tms_nbits;
-
-    if (DBG1 && (tms_nbits != 0))
-        buffer[index++] = '.';                  // spacer, ignored by programmer
-
-    if (tdi_nbits != 0) {                       // 1-0-0 if nTDI <> 0
-        if (CFG3) {                             // use compression: edd -> a, edD -> A
-            buffer[index++] = (read_flag ? 'A' : 'a');
-            count++;
-        }
-        else {                                  // compression flag turned off
-            ch = 1 + 'd';
-            buffer[index++] = ch;
-            ch = 0 + 'd';
-            buffer[index++] = ch;
-            ch = 0 + (read_flag ? 'D' : 'd');
-            buffer[index++] = ch;
-            count += 3;
-        }
-        pairs += 3;
-        if (DBG1)
-            buffer[index++] = '.';              // spacer, ignored by programmer
-    }
-
     long long Xtdi = tdi;
-    a->CharToRead = (read_flag == 2 ? 1 : 0);
+    index = bitbang_encode(buffer, tms_nbits, tms, tdi_nbits, tdi,
+        read_flag, CFG3, DBG1, &c);
+    a->CharToRead = (read_flag == 2 ? 1 : 0) + c.chars_to_read;
     a->BitsToRead = (read_flag == 2 ? 1 : 0);
-
-    i = tdi_nbits;
-    if (CFG3) {                                 // while we can, package up lots of 4 TDI bits
-        for (; i > 4; i -= 4) {                 // make sure the last bit is NOT packaged
-            ch = (read_flag == 1 ? 'I' : 'i') + (tdi & 0xF);
-            buffer[index++] = ch;
-            tdi >>= 4;
-            count++;
-            if (read_flag == 1) a->CharToRead++;
-        }
-    }
-    for (; i > 0; i--) {                        // (send all/remaining bits as singles)
-        ch = ((tdi & 1) << 1) + (i == 1) +      // TMS=0 for n-1 bits, then 1 on last bit
-             ((read_flag == 1 && i != 1) ?      // 0 = no read, 1 = normal read, 2 = oPrAcc read
-              'D' : 'd');                       // UC = read, LC = none, no read on last bit
-        buffer[index++] = ch;                   // append to buffer
-        tdi >>= 1;                              // shift TDI right one bit
-        count++;
-        if (read_flag == 1) a->CharToRead++;
-    }
-    pairs += tdi_nbits;
     if (read_flag == 1) a->BitsToRead = tdi_nbits;
 
-
-    if (tdi_nbits != 0) {                       // 1-0 if nTDI <> 0
-        if (DBG1)
-            buffer[index++] = '.';              // spacer, ignored by programmer
-
-        if (CFG3) {
-            buffer[index++] ='z';               // use compression: ed -> z
-            count++;
-        }
-        else {                                  // compression flag turned off
-            ch = 1 + 'd';
-            buffer[index++] = ch;
-            ch = 0 + 'd';
-            buffer[index++] = ch;
-            count += 2;
-        }
-        pairs += 2;
-    }
-
     //
     // Control handshaking for ICSP programmers
     //
@@ -293,8 +196,8 @@ static void bitbang_send(bitbang_adapter_t *a,
     buffer[index] = 0;          // append trailing zero so can print as a string
 
     a->RunningWriteCount += index;               // number of characters being written
-    a->TotalBitPairsSent += pairs;               // number of TDI/TMS pairs encoded
-    a->TotalCodeChrsSent += count;               // number of symbols used to send pairs
+    a->TotalBitPairsSent += c.pairs;             // number of TDI/TMS pairs encoded
+    a->TotalCodeChrsSent += c.count;             // number of symbols used to send pairs
 
     if (DBG1) {
         unsigned L4 = Xtdi >> 48;
@@ -487,6 +390,7 @@ static void serial_execution(bitbang_adapter_t *a)
     if (a->serial_execution_mode)
         return;
     a->serial_execution_mode = 1;
+    report_begin(PHASE_SERIAL_EXEC);
 
     /* Enter serial execution. */
     if (debug_level > 0)
@@ -517,6 +421,7 @@ static void serial_execution(bitbang_adapter_t *a)
         bitbang_send(a, 0, 0, 8, MCHP_FLASH_ENABLE, 0); /* Xfer data. */        // 11.
 
     bitbang_send(a, 1, 1, 5, TAP_SW_ETAP, 0);       /* Send command. */         // 12.
+    report_end(PHASE_SERIAL_EXEC);
 }
 
 //
@@ -859,6 +764,73 @@ static void bitbang_erase_chip(adapter_t *adapter)
     fflush(stdout);
 }
 
+/*
+ * Erase a page of flash memory.
+ */
+static void bitbang_erase_page(adapter_t *adapter, unsigned addr)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    if (DBG2)
+        fprintf(stderr, "erase_page\n");
+
+    if (debug_level > 0)
+        fprintf(stderr, "erase page at %08x\n", addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "slow page erase not implemented yet\n");
+        exit(-1);
+    }
+
+    /* Use PE to erase flash memory. */
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0); /* Send command. */
+    xfer_fastdata(a, PE_PAGE_ERASE << 16 | 1);
+    xfer_fastdata(a, addr);                     /* Send address. */
+
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PAGE_ERASE << 16)) {
+        fprintf(stderr, "\nfailed to erase page at %08x, reply = %08x\n",
+                                                 addr,       response);
+        exit(-1);
+    }
+}
+
+/*
+ * Check that flash memory is erased.
+ * Return 1 when blank.
+ */
+static int bitbang_blank_check(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    if (DBG2)
+        fprintf(stderr, "blank_check\n");
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "slow blank check not implemented yet\n");
+        exit(-1);
+    }
+
+    /* Use PE to check flash memory. */
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0); /* Send command. */
+    xfer_fastdata(a, PE_BLANK_CHECK << 16);
+    xfer_fastdata(a, addr);                     /* Send address. */
+    xfer_fastdata(a, nbytes);                   /* Send length. */
+
+    unsigned response = get_pe_response(a);
+    if ((response >> 16) != PE_BLANK_CHECK) {
+        fprintf(stderr, "\nfailed to blank check %d bytes at %08x, reply = %08x\n",
+                                                    nbytes,   addr,       response);
+        exit(-1);
+    }
+    if (debug_level > 0)
+        fprintf(stderr, "blank check %d bytes at %08x: %s\n",
+            nbytes, addr, (response & 0xffff) ? "not blank" : "blank");
+    return (response & 0xffff) == 0;
+}
+
 /*
  * Write a word to flash memory. (only seems to be used to write the four configuration words)
  *
@@ -948,18 +920,12 @@ static void bitbang_program_row(adapter_t *adapter, unsigned addr,
 }
 
 /*
- * Verify a block of memory.
+ * Get checksum of a block of memory.
  */
-static void bitbang_verify_data(adapter_t *adapter,
-    unsigned addr, unsigned nwords, unsigned *data)
+static unsigned bitbang_get_crc(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
-    unsigned data_crc, flash_crc;
-
-    if (DBG2)
-        fprintf(stderr, "verify_data\n");
-    if (DBG3)
-        fprintf(stderr, "\nverifying %u words at %08x ", nwords, addr);
 
     if (! a->use_executive) {
         /* Without PE. */
@@ -971,18 +937,34 @@ static void bitbang_verify_data(adapter_t *adapter,
     bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
     xfer_fastdata(a, PE_GET_CRC << 16);
     xfer_fastdata(a, addr);                      /* Send address. */
-    xfer_fastdata(a, nwords * 4);                /* Send length. */
+    xfer_fastdata(a, nbytes);                    /* Send length. */
 
     unsigned response = get_pe_response(a);
     if (response != (PE_GET_CRC << 16)) {
         fprintf(stderr, "\nfailed to verify %d words at %08x, reply = %08x\n",
-                                             nwords,     addr,       response);
+                                          nbytes / 4,     addr,       response);
         exit(-1);
     }
 
-    flash_crc = get_pe_response(a) & 0xffff;
+    return get_pe_response(a) & 0xffff;
+}
+
+/*
+ * Verify a block of memory.
+ */
+static void bitbang_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    unsigned data_crc, flash_crc;
+
+    if (DBG2)
+        fprintf(stderr, "verify_data\n");
+    if (DBG3)
+        fprintf(stderr, "\nverifying %u words at %08x ", nwords, addr);
+
+    flash_crc = bitbang_get_crc(adapter, addr, nwords * 4);
 
-    data_crc = calculate_crc(0xffff, (unsigned char*) data, nwords * 4);
+    data_crc = crc16(CRC16_PE_SEED, (unsigned char*) data, nwords * 4);
     if (flash_crc != data_crc) {
         fprintf(stderr, "\nchecksum failed at %08x: returned %04x, expected %04x\n",
                                                addr,        flash_crc,     data_crc);
@@ -1315,6 +1297,7 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
 //
 
     a->adapter.block_override = 0;
+    a->adapter.name = "Bitbang";
     a->adapter.flags = AD_PROBE | AD_ERASE | AD_READ | AD_WRITE;
 
     /* User functions. */
@@ -1324,7 +1307,10 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
     a->adapter.read_word = bitbang_read_word;
     a->adapter.read_data = bitbang_read_data;
     a->adapter.verify_data = bitbang_verify_data;
+    a->adapter.get_crc = bitbang_get_crc;
     a->adapter.erase_chip = bitbang_erase_chip;
+    a->adapter.erase_page = bitbang_erase_page;
+    a->adapter.blank_check = bitbang_blank_check;
     a->adapter.program_word = bitbang_program_word;
     a->adapter.program_row = bitbang_program_row;
     return &a->adapter;
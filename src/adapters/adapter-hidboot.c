@@ -17,6 +17,7 @@
 
 #include "adapter.h"
 #include "hidapi.h"
+#include "transport.h"
 #include "pic32.h"
 #include "console.h"
 
@@ -75,7 +76,7 @@ static void hidboot_command(hidboot_adapter_t *a, unsigned char cmd,
         }
         fprintf(stderr, "\n");
     }
-    hid_write(a->hiddev, buf, 64);
+    transport_hid_write(a->hiddev, buf, 64);
 
     if (cmd != CMD_QUERY_DEVICE && cmd != CMD_GET_DATA) {
         /* No reply expected. */
@@ -83,7 +84,7 @@ static void hidboot_command(hidboot_adapter_t *a, unsigned char cmd,
     }
 
     memset(a->reply, 0, sizeof(a->reply));
-    a->reply_len = hid_read_timeout(a->hiddev, a->reply, 64, 4000);
+    a->reply_len = transport_hid_read(a->hiddev, a->reply, 64, 4000);
     if (a->reply_len == 0) {
         fprintf(stderr, "Timed out.\n");
         exit(-1);
@@ -245,13 +246,13 @@ adapter_t *adapter_open_hidboot(int vid, int pid, const char *serial, int report
         wchar_t buf[256];
         if (serial)
             mbstowcs(buf, serial, 256);
-        hiddev = hid_open(vid, pid, serial ? buf : 0);
+        hiddev = transport_hid_open(vid, pid, serial ? buf : 0);
     } else {
-        hiddev = hid_open(MICROCHIP_VID, BOOTLOADER_PID, 0);
+        hiddev = transport_hid_open(MICROCHIP_VID, BOOTLOADER_PID, 0);
         if (! hiddev)
-            hiddev = hid_open(MICROCHIP_VID, MAXIMITE_PID, 0);
+            hiddev = transport_hid_open(MICROCHIP_VID, MAXIMITE_PID, 0);
         if (! hiddev)
-            hiddev = hid_open(OLIMEX_VID, DUINOMITE_PID, 0);
+            hiddev = transport_hid_open(OLIMEX_VID, DUINOMITE_PID, 0);
     }
     if (! hiddev) {
         if (vid)
@@ -281,6 +282,7 @@ adapter_t *adapter_open_hidboot(int vid, int pid, const char *serial, int report
         a->adapter.user_start + a->adapter.user_nbytes - 1);
 
     a->adapter.block_override = 0;
+    a->adapter.name = "HIDBoot";
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     /* User functions. */
@@ -7,6 +7,8 @@
  *  - Olimex MIPS-USB-OCD-H adapter
  *  - Bus Blaster v2 from Dangerous Prototypes
  *  - TinCanTools Flyswatter adapter
+ * Simulated target is connected the same way, through
+ * a model of ARM-USB-Tiny-H in place of USB transfers.
  *
  * Copyright (C) 2011-2013 Serge Vakulenko
  * Copyright (C) 2015-2017 Majenko Technologies
@@ -26,6 +28,12 @@
 #include "adapter.h"
 #include "pic32.h"
 #include "console.h"
+#include "report.h"
+#include "transport.h"
+#include "cache.h"
+#include "jtag-encode.h"
+#include "crc16.h"
+#include "sim.h"
 
 typedef struct {
     uint16_t vid;
@@ -42,6 +50,48 @@ typedef struct {
     const char *product;
 } device_t;
 
+/*
+ * Instructions in one speculative transfer, and the maximum
+ * size of a group, which is repeated as a whole.
+ */
+#define BATCH_MAX               40
+#define BATCH_GROUP             3
+
+/*
+ * Max size of one instruction or PE response in the output buffer:
+ * six packets. Replies of a batch are decoded by offset, so the batch
+ * must not be split by a flush in mpsse_send().
+ */
+#define XFER_BYTES              (6 * MPSSE_PACKET_MAX)
+
+/*
+ * TCK clock at start, and steps of tuning, kHz.
+ * The target is checked a few times at every step.
+ * One passed step is left as a margin, also when all steps pass.
+ * The checksum is taken from the start of boot flash.
+ */
+#define DEFAULT_KHZ             500
+static const unsigned clock_steps[] = {
+    1000, 2000, 3000, 6000, 10000, 15000, 30000, 0,
+};
+#define CLOCK_ROUNDS            8
+#define CLOCK_CRC_ADDR          0x1fc00000
+#define CLOCK_CRC_BYTES         1024
+#define CLOCK_POLLS             100     /* Polls of PE response */
+
+/*
+ * USB transfers in flight, to keep the FIFOs of FTDI chip busy.
+ */
+#define NWRITES                 4
+#define NREADS                  4
+
+typedef struct {
+    struct libusb_transfer *usb;
+    int busy;                           /* Submitted, not completed */
+    int len;                            /* Result of replayed transfer */
+    unsigned char data [256*16];
+} urb_t;
+
 typedef struct {
     /* Common part */
     adapter_t adapter;
@@ -50,19 +100,24 @@ typedef struct {
     /* Device handle for libusb. */
     libusb_device_handle *usbdev;
     libusb_context *context;
+    sim_t *sim;                         /* Simulated target, no USB */
 
     /* Transmit buffer for MPSSE packet. */
     unsigned char output [256*16];
     int bytes_to_write;
 
     /* Receive buffer. */
-    unsigned char input [64];
+    unsigned char input [256*16];
     int bytes_to_read;
-    int bytes_per_word;
-    unsigned long long fix_high_bit;
-    unsigned long long high_byte_mask;
-    unsigned long long high_bit_mask;
-    unsigned high_byte_bits;
+    int max_packet;                     /* Size of USB packet */
+
+    /* Asynchronous transfers. */
+    urb_t wr [NWRITES];
+    urb_t rd [NREADS];
+    int wr_next;                        /* Oldest write */
+    mpsse_reply_t reply;                /* Layout of the last reply */
+    int fastdata_check;                 /* Replies are PrAcc of FASTDATA */
+    unsigned fastdata_lost;             /* Words not accepted by the PE */
 
     /* Mapping of /TRST, /SYSRST and LED control signals. */
     unsigned trst_control, trst_inverted;
@@ -71,8 +126,28 @@ typedef struct {
     unsigned dir_control;
 
     unsigned mhz;
+    unsigned khz;                       /* TCK clock */
+    unsigned clock_tuned;               /* Tuned, or cached and checked */
+    unsigned clock_cached;              /* Taken from cache, not checked */
+    unsigned idcode;
+    char serial [32];                   /* Serial number of adapter */
     unsigned use_executive;
     unsigned serial_execution_mode;
+
+    /* Image of PE, to load it again. */
+    const unsigned *pe;
+    unsigned pe_nwords;
+    unsigned pe_version;
+
+    /* Queued request, waiting for PE response. */
+    adapter_req_t *pending;
+
+    /* Instructions, sent without waiting for PRACC. */
+    unsigned batch [BATCH_MAX];
+    unsigned char batch_group [BATCH_MAX];  /* Start of group */
+    int batch_len;
+    int group_next;                     /* Next instruction starts a group */
+    unsigned batch_misses;
 } mpsse_adapter_t;
 
 /*
@@ -110,15 +185,6 @@ typedef struct {
 #define SIO_WRITE_EEPROM        0x91
 #define SIO_ERASE_EEPROM        0x92
 
-/* MPSSE commands. */
-#define CLKWNEG                 0x01
-#define BITMODE                 0x02
-#define CLKRNEG                 0x04
-#define LSB                     0x08
-#define WTDI                    0x10
-#define RTDO                    0x20
-#define WTMS                    0x40
-
 static const device_t devlist[] = {
     { OLIMEX_VID,           OLIMEX_ARM_USB_TINY,    "Olimex ARM-USB-Tiny",               6,  0x0f10, 0x0100, 1,  0x0200,  0,   0x0800,  0, NULL},
     { OLIMEX_VID,           OLIMEX_ARM_USB_TINY_H,  "Olimex ARM-USB-Tiny-H",            30,  0x0f10, 0x0100, 1,  0x0200,  0,   0x0800,  0, NULL},
@@ -130,32 +196,127 @@ static const device_t devlist[] = {
 };
 
 /*
- * Calculate checksum.
+ * Transfers are done at once, without libusb:
+ * on replay and with the simulated target.
  */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
+static int sync_transfers(mpsse_adapter_t *a)
 {
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
+    return capture_replaying || a->sim;
+}
+
+/*
+ * Bulk transfer on the given endpoint.
+ * Return number of bytes, or -1 on error.
+ * On replay, the transfer is taken from the capture file.
+ * The simulated target decodes MPSSE commands and returns the reply.
+ */
+static int bulk_transfer(mpsse_adapter_t *a, int is_read,
+    unsigned char *data, int nbytes, int timeout_msec)
+{
+    int ret, n;
+
+    transport_begin(TRANSPORT_BULK, is_read, nbytes);
+    if (capture_replaying) {
+        n = capture_replay_transfer(TRANSPORT_BULK, is_read, data, nbytes);
+    } else if (a->sim) {
+        if (is_read) {
+            n = sim_mpsse_read(a->sim, data, nbytes, a->max_packet);
+        } else {
+            sim_mpsse_write(a->sim, data, nbytes);
+            n = nbytes;
+        }
+    } else {
+        ret = libusb_bulk_transfer(a->usbdev, is_read ? OUT_EP : IN_EP,
+            data, nbytes, &n, timeout_msec);
+        if (ret != 0) {
+            fprintf(stderr, "usb bulk %s failed: %d: %s\n",
+                is_read ? "read" : "write", ret, libusb_strerror(ret));
+            n = -1;
+        }
+    }
+    transport_end(TRANSPORT_BULK, is_read, data, n);
+    return n;
+}
+
+static void LIBUSB_CALL urb_complete(struct libusb_transfer *t)
+{
+    urb_t *u = t->user_data;
+
+    u->busy = 0;
+}
+
+/*
+ * Start an asynchronous transfer of nbytes from the buffer of urb.
+ */
+static void urb_submit(mpsse_adapter_t *a, urb_t *u, int is_read,
+    int nbytes, int timeout_msec)
+{
+    int ret;
+
+    libusb_fill_bulk_transfer(u->usb, a->usbdev, is_read ? OUT_EP : IN_EP,
+        u->data, nbytes, urb_complete, u, timeout_msec);
+    u->busy = 1;
+    ret = libusb_submit_transfer(u->usb);
+    if (ret != 0) {
+        fprintf(stderr, "usb bulk %s failed: %d: %s\n",
+            is_read ? "read" : "write", ret, libusb_strerror(ret));
+        exit(-1);
+    }
+}
+
+/*
+ * Wait until the transfer is completed.
+ * Return number of bytes.
+ */
+static int urb_wait(mpsse_adapter_t *a, urb_t *u)
+{
+    struct libusb_transfer *t = u->usb;
+    int ret;
+
+    while (u->busy) {
+        ret = libusb_handle_events(a->context);
+        if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "usb events failed: %d: %s\n",
+                ret, libusb_strerror(ret));
+            exit(-1);
+        }
+    }
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "usb bulk %s failed: transfer status %d\n",
+            (t->endpoint == OUT_EP) ? "read" : "write", t->status);
+        exit(-1);
+    }
+    if (t->endpoint == IN_EP && t->actual_length != t->length)
+        fprintf(stderr, "usb bulk written %d bytes of %d\n",
+            t->actual_length, t->length);
+    return t->actual_length;
+}
+
+/*
+ * Wait until all writes reach the device.
+ * Needed before a delay, which must follow the commands.
+ */
+static void bulk_drain(mpsse_adapter_t *a)
+{
+    int i;
+
+    if (sync_transfers(a))
+        return;
+    for (i=0; i<NWRITES; i++) {
+        urb_t *u = &a->wr[(a->wr_next + i) % NWRITES];
+        if (u->busy)
+            urb_wait(a, u);
+    }
 }
 
 /*
  * Send a packet to USB device.
+ * The write is queued: it completes while the next packet is prepared.
  */
 static void bulk_write(mpsse_adapter_t *a, unsigned char *output, int nbytes)
 {
     int bytes_written;
+    urb_t *u;
 
     if (debug_level > 1) {
         int i;
@@ -165,27 +326,102 @@ static void bulk_write(mpsse_adapter_t *a, unsigned char *output, int nbytes)
         fprintf(stderr, "\n");
     }
 
-    int ret = libusb_bulk_transfer(a->usbdev, IN_EP, (unsigned char*) output,
-        nbytes, &bytes_written, 1000);
+    if (sync_transfers(a)) {
+        bytes_written = bulk_transfer(a, 0, output, nbytes, 1000);
+        if (bytes_written < 0)
+            exit(-1);
+        return;
+    }
 
-    if (ret != 0) {
-        fprintf(stderr, "usb bulk write failed: %d: %s\n",
-            ret, libusb_strerror(ret));
-        exit(-1);
+    /* Writes complete in order: reuse the oldest one. */
+    u = &a->wr[a->wr_next];
+    a->wr_next = (a->wr_next + 1) % NWRITES;
+    if (u->busy)
+        urb_wait(a, u);
+
+    transport_begin(TRANSPORT_BULK, 0, nbytes);
+    memcpy(u->data, output, nbytes);
+    urb_submit(a, u, 0, nbytes, 1000);
+    transport_end(TRANSPORT_BULK, 0, output, nbytes);
+}
+
+/*
+ * Queue a read of the reply, which has nbytes of data.
+ * Return size of data in the transfer: it's less than nbytes,
+ * when the reply needs more than one transfer.
+ * On replay and with the simulated target, the transfer
+ * is done immediately.
+ */
+static int read_submit(mpsse_adapter_t *a, urb_t *u, int nbytes)
+{
+    /* Every USB packet starts with two status bytes. */
+    int npackets = (nbytes + a->max_packet - 3) / (a->max_packet - 2);
+    int len = nbytes + 2*npackets;
+
+    if (len > sizeof(u->data)) {
+        npackets = sizeof(u->data) / a->max_packet;
+        len = npackets * a->max_packet;
+        nbytes = len - 2*npackets;
+    }
+    if (sync_transfers(a)) {
+        u->len = bulk_transfer(a, 1, u->data, len, 2000);
+        if (u->len < 0)
+            exit(-1);
+    } else
+        urb_submit(a, u, 1, len, 2000);
+    return nbytes;
+}
+
+/*
+ * Wait for the queued read and copy the data to input buffer.
+ * Return number of data bytes.
+ */
+static int read_complete(mpsse_adapter_t *a, urb_t *u, int offset)
+{
+    int n, k, len, nbytes = 0;
+
+    if (sync_transfers(a)) {
+        n = u->len;
+    } else {
+        transport_begin(TRANSPORT_BULK, 1, u->usb->length);
+        n = urb_wait(a, u);
+        transport_end(TRANSPORT_BULK, 1, u->data, n);
     }
-    if (bytes_written != nbytes)
-        fprintf(stderr, "usb bulk written %d bytes of %d",
-            bytes_written, nbytes);
+    if (debug_level > 1) {
+        int i;
+        fprintf(stderr, "usb bulk read %d bytes:", n);
+        for (i=0; i<n; i++)
+            fprintf(stderr, "%c%02x", i ? '-' : ' ', u->data[i]);
+        fprintf(stderr, "\n");
+    }
+    for (k=0; k<n; k+=a->max_packet) {
+        len = n - k;
+        if (len > a->max_packet)
+            len = a->max_packet;
+        len -= 2;
+        if (len > a->bytes_to_read - offset - nbytes)
+            len = a->bytes_to_read - offset - nbytes;
+        if (len > 0) {
+            /* Copy data. */
+            memcpy(a->input + offset + nbytes, u->data + k + 2, len);
+            nbytes += len;
+        }
+    }
+    return nbytes;
 }
 
+static unsigned long long mpsse_fix_data(mpsse_adapter_t *a, unsigned long long word);
+
 /*
  * If there are any data in transmit buffer -
  * send them to device.
+ * Wait for the reply, when it's expected.
  */
 static void mpsse_flush_output(mpsse_adapter_t *a)
 {
-    int bytes_read, n;
-    unsigned char reply [64];
+    int bytes_read, requested, head, tail, i;
+    int expect [NREADS];
+    unsigned long long word;
 
     if (a->bytes_to_write <= 0)
         return;
@@ -195,40 +431,38 @@ static void mpsse_flush_output(mpsse_adapter_t *a)
     if (a->bytes_to_read <= 0)
         return;
 
-    /* Get reply. */
+    /* Keep several reads queued, until the whole reply is requested.
+     * The device never sends more than requested, so the reads
+     * are unable to take the data of the next reply. */
     bytes_read = 0;
+    requested = 0;
+    head = tail = 0;
     while (bytes_read < a->bytes_to_read) {
-        int ret = libusb_bulk_transfer(a->usbdev, OUT_EP, (unsigned char*) reply,
-            a->bytes_to_read - bytes_read + 2, &n, 2000);
-        if (ret != 0) {
-            fprintf(stderr, "usb bulk read failed\n");
-            exit(-1);
-        }
-        if (debug_level > 1) {
-            if (n != a->bytes_to_read + 2)
-                fprintf(stderr, "usb bulk read %d bytes of %d\n",
-                    n, a->bytes_to_read - bytes_read + 2);
-            else {
-                int i;
-                fprintf(stderr, "usb bulk read %d bytes:", n);
-                for (i=0; i<n; i++)
-                    fprintf(stderr, "%c%02x", i ? '-' : ' ', reply[i]);
-                fprintf(stderr, "\n");
-            }
-        }
-        if (n > 2) {
-            /* Copy data. */
-            memcpy(a->input + bytes_read, reply + 2, n - 2);
-            bytes_read += n - 2;
+        while (head - tail < NREADS &&
+               bytes_read + requested < a->bytes_to_read) {
+            i = head++ % NREADS;
+            expect[i] = read_submit(a, &a->rd[i],
+                a->bytes_to_read - bytes_read - requested);
+            requested += expect[i];
         }
+        i = tail++ % NREADS;
+        requested -= expect[i];
+        bytes_read += read_complete(a, &a->rd[i], bytes_read);
     }
     if (debug_level > 1) {
-        int i;
         fprintf(stderr, "mpsse_flush_output received %d bytes:", a->bytes_to_read);
         for (i=0; i<a->bytes_to_read; i++)
             fprintf(stderr, "%c%02x", i ? '-' : ' ', a->input[i]);
         fprintf(stderr, "\n");
     }
+    if (a->fastdata_check) {
+        /* Count FASTDATA words, which the PE did not take. */
+        for (i=0; i<a->bytes_to_read; i+=a->reply.bytes_per_word) {
+            memcpy(&word, a->input + i, sizeof(word));
+            if (! (mpsse_fix_data(a, word) & 1))
+                a->fastdata_lost++;
+        }
+    }
     a->bytes_to_read = 0;
 }
 
@@ -236,129 +470,33 @@ static void mpsse_send(mpsse_adapter_t *a,
     unsigned tms_prolog_nbits, unsigned tms_prolog,
     unsigned tdi_nbits, unsigned long long tdi, int read_flag)
 {
-    unsigned tms_epilog_nbits = 0, tms_epilog = 0;
-
-    if (tdi_nbits > 0) {
-        /* We have some data; add generic prologue TMS 1-0-0
-         * and epilogue TMS 1-0. */
-        tms_prolog |= 1 << tms_prolog_nbits;
-        tms_prolog_nbits += 3;
-        tms_epilog = 1;
-        tms_epilog_nbits = 2;
-    }
-    /* Check that we have enough space in output buffer.
-     * Max size of one packet is 23 bytes (6+8+3+3+3). */
-    if (a->bytes_to_write > sizeof(a->output) - 23)
+    /* Check that we have enough space in output buffer. */
+    if (a->bytes_to_write > sizeof(a->output) - MPSSE_PACKET_MAX)
         mpsse_flush_output(a);
 
-    /* Prepare a packet of MPSSE commands. */
-    if (tms_prolog_nbits > 0) {
-        /* Prologue TMS, from 1 to 14 bits.
-         * 4b - Clock Data to TMS Pin (no Read) */
-        a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-        if (tms_prolog_nbits < 8) {
-            a->output [a->bytes_to_write++] = tms_prolog_nbits - 1;
-            a->output [a->bytes_to_write++] = tms_prolog;
-        } else {
-            a->output [a->bytes_to_write++] = 7 - 1;
-            a->output [a->bytes_to_write++] = tms_prolog & 0x7f;
-            a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-            a->output [a->bytes_to_write++] = tms_prolog_nbits - 7 - 1;
-            a->output [a->bytes_to_write++] = tms_prolog >> 7;
-        }
-    }
-    if (tdi_nbits > 0) {
-        /* Data, from 1 to 64 bits. */
-        if (tms_epilog_nbits > 0) {
-            /* Last bit should be accompanied with signal TMS=1. */
-            tdi_nbits--;
-        }
-        unsigned nbytes = tdi_nbits / 8;
-        unsigned last_byte_bits = tdi_nbits & 7;
-        if (read_flag) {
-            a->high_byte_bits = last_byte_bits;
-            a->fix_high_bit = 0;
-            a->high_byte_mask = 0;
-            a->bytes_per_word = nbytes;
-            if (a->high_byte_bits > 0)
-                a->bytes_per_word++;
-            a->bytes_to_read += a->bytes_per_word;
-        }
-        if (nbytes > 0) {
-            /* Whole bytes.
-             * 39 - Clock Data Bytes In and Out LSB First
-             * 19 - Clock Data Bytes Out LSB First (no Read) */
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTDI + RTDO + CLKWNEG + LSB) :
-                (WTDI + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = nbytes - 1;
-            a->output [a->bytes_to_write++] = (nbytes - 1) >> 8;
-            while (nbytes-- > 0) {
-                a->output [a->bytes_to_write++] = tdi;
-                tdi >>= 8;
-            }
-        }
-        if (last_byte_bits) {
-            /* Last partial byte.
-             * 3b - Clock Data Bits In and Out LSB First
-             * 1b - Clock Data Bits Out LSB First (no Read) */
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTDI + RTDO + BITMODE + CLKWNEG + LSB) :
-                (WTDI + BITMODE + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = last_byte_bits - 1;
-            a->output [a->bytes_to_write++] = tdi;
-            tdi >>= last_byte_bits;
-            a->high_byte_mask = 0xffULL << (a->bytes_per_word - 1) * 8;
-        }
-        if (tms_epilog_nbits > 0) {
-            /* Last bit (actually two bits).
-             * 6b - Clock Data to TMS Pin with Read
-             * 4b - Clock Data to TMS Pin (no Read) */
-            tdi_nbits++;
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTMS + RTDO + BITMODE + CLKWNEG + LSB) :
-                (WTMS + BITMODE + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = 1;
-            a->output [a->bytes_to_write++] = tdi << 7 | 1 | tms_epilog << 1;
-            tms_epilog_nbits--;
-            tms_epilog >>= 1;
-            if (read_flag) {
-                /* Last bit wil come in next byte.
-                 * Compute a mask for correction. */
-                a->fix_high_bit = 0x40ULL << (a->bytes_per_word * 8);
-                a->bytes_per_word++;
-                a->bytes_to_read++;
-            }
-        }
-        if (read_flag)
-            a->high_bit_mask = 1ULL << (tdi_nbits - 1);
-    }
-    if (tms_epilog_nbits > 0) {
-        /* Epiloque TMS, from 1 to 7 bits.
-         * 4b - Clock Data to TMS Pin (no Read) */
-        a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-        a->output [a->bytes_to_write++] = tms_epilog_nbits - 1;
-        a->output [a->bytes_to_write++] = tms_epilog;
-    }
+    a->bytes_to_write += mpsse_encode(a->output + a->bytes_to_write,
+        tms_prolog_nbits, tms_prolog, tdi_nbits, tdi, read_flag, &a->reply);
+    if (read_flag)
+        a->bytes_to_read += a->reply.bytes_per_word;
 }
 
 static unsigned long long mpsse_fix_data(mpsse_adapter_t *a, unsigned long long word)
 {
-    unsigned long long fix_high_bit = word & a->fix_high_bit;
-    //if (debug) fprintf(stderr, "fix (%08llx) high_bit=%08llx\n", word, a->fix_high_bit);
+    unsigned long long fix_high_bit = word & a->reply.fix_high_bit;
+    //if (debug) fprintf(stderr, "fix (%08llx) high_bit=%08llx\n", word, a->reply.fix_high_bit);
 
-    if (a->high_byte_bits) {
+    if (a->reply.high_byte_bits) {
         /* Fix a high byte of received data. */
-        unsigned long long high_byte = a->high_byte_mask &
-            ((word & a->high_byte_mask) >> (8 - a->high_byte_bits));
-        word = (word & ~a->high_byte_mask) | high_byte;
-        //if (debug) fprintf(stderr, "Corrected byte %08llx -> %08llx\n", a->high_byte_mask, high_byte);
+        unsigned long long high_byte = a->reply.high_byte_mask &
+            ((word & a->reply.high_byte_mask) >> (8 - a->reply.high_byte_bits));
+        word = (word & ~a->reply.high_byte_mask) | high_byte;
+        //if (debug) fprintf(stderr, "Corrected byte %08llx -> %08llx\n", a->reply.high_byte_mask, high_byte);
     }
-    word &= a->high_bit_mask - 1;
+    word &= a->reply.high_bit_mask - 1;
     if (fix_high_bit) {
         /* Fix a high bit of received data. */
-        word |= a->high_bit_mask;
-        //if (debug) fprintf(stderr, "Corrected bit %08llx -> %08llx\n", a->high_bit_mask, word >> 9);
+        word |= a->reply.high_bit_mask;
+        //if (debug) fprintf(stderr, "Corrected bit %08llx -> %08llx\n", a->reply.high_bit_mask, word >> 9);
     }
     return word;
 }
@@ -418,6 +556,9 @@ static void mpsse_speed(mpsse_adapter_t *a, int khz)
     unsigned char output [3];
     int divisor = (a->mhz * 2000 / khz + 1) / 2 - 1;
 
+    /* Queued commands go at the old clock. */
+    mpsse_flush_output(a);
+    a->khz = khz;
     if (divisor < 0)
         divisor = 0;
     if (debug_level)
@@ -447,6 +588,75 @@ static void mpsse_speed(mpsse_adapter_t *a, int khz)
     }
 }
 
+/*
+ * Get serial number of the adapter: it identifies
+ * the adapter in the cache of clock rates.
+ */
+static void read_serial(mpsse_adapter_t *a)
+{
+    struct libusb_device_descriptor desc = {0};
+    int i;
+
+    if (libusb_get_device_descriptor(libusb_get_device(a->usbdev), &desc) != 0 ||
+        desc.iSerialNumber == 0)
+        return;
+    if (libusb_get_string_descriptor_ascii(a->usbdev, desc.iSerialNumber,
+        (unsigned char*) a->serial, sizeof(a->serial)) <= 0) {
+        a->serial[0] = 0;
+        return;
+    }
+    for (i=0; a->serial[i]; i++) {
+        if (a->serial[i] <= ' ' || a->serial[i] > '~')
+            a->serial[i] = '_';
+    }
+}
+
+static struct libusb_transfer *alloc_transfer(void)
+{
+    struct libusb_transfer *t = libusb_alloc_transfer(0);
+
+    if (! t) {
+        fprintf(stderr, "adapter_open_mpsse: out of memory\n");
+        exit(-1);
+    }
+    return t;
+}
+
+static void urb_alloc(mpsse_adapter_t *a)
+{
+    int i;
+
+    for (i=0; i<NWRITES; i++)
+        a->wr[i].usb = alloc_transfer();
+    for (i=0; i<NREADS; i++)
+        a->rd[i].usb = alloc_transfer();
+}
+
+/*
+ * Release the transfers, when all writes are completed.
+ */
+static void urb_free(mpsse_adapter_t *a)
+{
+    int i;
+
+    bulk_drain(a);
+    for (i=0; i<NWRITES; i++)
+        libusb_free_transfer(a->wr[i].usb);
+    for (i=0; i<NREADS; i++)
+        libusb_free_transfer(a->rd[i].usb);
+}
+
+/*
+ * Delay on the host side, after the commands reached the device.
+ */
+static void mpsse_delay(mpsse_adapter_t *a, unsigned msec)
+{
+    if (a->sim)
+        sim_delay(a->sim, msec);
+    else
+        mdelay(msec);
+}
+
 static void mpsse_close(adapter_t *adapter, int power_on)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
@@ -460,8 +670,17 @@ static void mpsse_close(adapter_t *adapter, int power_on)
     mpsse_reset(a, 0, 1, 1);
     mpsse_reset(a, 0, 0, 0);
 
-    libusb_release_interface(a->usbdev, 0);
-    libusb_close(a->usbdev);
+    if (debug_level > 0 && a->batch_misses > 0)
+        fprintf(stderr, "%s: CPU was not ready in %u batches\n",
+            a->name, a->batch_misses);
+    if (a->sim) {
+        sim_print_stats(a->sim);
+        sim_close(a->sim);
+    } else if (! capture_replaying) {
+        urb_free(a);
+        libusb_release_interface(a->usbdev, 0);
+        libusb_close(a->usbdev);
+    }
     free(a);
 }
 
@@ -489,6 +708,7 @@ static void serial_execution(mpsse_adapter_t *a)
     if (a->serial_execution_mode)
         return;
     a->serial_execution_mode = 1;
+    report_begin(PHASE_SERIAL_EXEC);
 
     /* Enter serial execution. */
     if (debug_level > 0)
@@ -514,7 +734,8 @@ static void serial_execution(mpsse_adapter_t *a)
 
     /* Deactivate /SYSRST. */
     mpsse_reset(a, 0, 0, 1);
-    mdelay(10);
+    bulk_drain(a);
+    mpsse_delay(a, 10);
 
     /* Check status. */
     mpsse_send(a, 1, 1, 5, TAP_SW_MTAP, 0);     /* Send command. */
@@ -532,6 +753,7 @@ static void serial_execution(mpsse_adapter_t *a)
     /* Leave it in ETAP mode. */
     mpsse_send(a, 1, 1, 5, TAP_SW_ETAP, 0);     /* Send command. */
     mpsse_flush_output(a);
+    report_end(PHASE_SERIAL_EXEC);
 }
 
 static void xfer_fastdata(mpsse_adapter_t *a, unsigned word)
@@ -539,6 +761,16 @@ static void xfer_fastdata(mpsse_adapter_t *a, unsigned word)
     mpsse_send(a, 0, 0, 33, (unsigned long long) word << 1, 0);
 }
 
+/*
+ * Send a word to FASTDATA, capturing the PrAcc bit.
+ * The bits are checked by mpsse_flush_output(),
+ * when fastdata_check is set.
+ */
+static void xfer_fastdata_pracc(mpsse_adapter_t *a, unsigned word)
+{
+    mpsse_send(a, 0, 0, 33, (unsigned long long) word << 1, 1);
+}
+
 static void xfer_instruction(mpsse_adapter_t *a, unsigned instruction)
 {
     unsigned ctl;
@@ -570,9 +802,96 @@ static void xfer_instruction(mpsse_adapter_t *a, unsigned instruction)
                             CONTROL_PROBTRAP, 0);
 }
 
-static unsigned get_pe_response(mpsse_adapter_t *a)
+/*
+ * Check PRACC bits of the queued instructions.
+ * When the CPU was not ready, the instructions after the miss
+ * could have been executed out of order: repeat them, starting
+ * from the beginning of the group, waiting for PRACC every time.
+ */
+static void xfer_batch_flush(mpsse_adapter_t *a)
+{
+    unsigned long long word;
+    int n = a->batch_len, i;
+
+    if (n == 0)
+        return;
+    a->batch_len = 0;
+    mpsse_flush_output(a);
+
+    for (i=0; i<n; i++) {
+        memcpy(&word, a->input + i * a->reply.bytes_per_word, sizeof(word));
+        if (! (mpsse_fix_data(a, word) & CONTROL_PRACC))
+            break;
+    }
+    if (i == n)
+        return;
+
+    while (i > 0 && ! a->batch_group[i])
+        i--;
+    a->batch_misses++;
+    if (debug_level > 0)
+        fprintf(stderr, "%s: CPU not ready, repeat %d of %d instructions\n",
+            a->name, n - i, n);
+    for (; i<n; i++)
+        xfer_instruction(a, a->batch[i]);
+}
+
+/*
+ * Start a group of instructions, which can be executed again
+ * from its beginning without harm. At most BATCH_GROUP instructions.
+ */
+static void xfer_group(mpsse_adapter_t *a)
+{
+    if (a->batch_len > BATCH_MAX - BATCH_GROUP ||
+        a->bytes_to_write + BATCH_GROUP * XFER_BYTES > sizeof(a->output))
+        xfer_batch_flush(a);
+    a->group_next = 1;
+}
+
+/*
+ * Queue an instruction without waiting for the CPU.
+ * Status of PRACC is captured in the same transfer,
+ * and checked by xfer_batch_flush().
+ */
+static void xfer_batch(mpsse_adapter_t *a, unsigned instruction)
+{
+    if (a->batch_len == BATCH_MAX ||
+        a->bytes_to_write + XFER_BYTES > sizeof(a->output)) {
+        /* Group is too long: the rest becomes a new group. */
+        xfer_batch_flush(a);
+    }
+    if (a->batch_len == 0)
+        mpsse_flush_output(a);
+    if (debug_level > 1)
+        fprintf(stderr, "%s: batch instruction %08x\n", a->name, instruction);
+
+    /* First instruction of a transfer always starts a group. */
+    a->batch[a->batch_len] = instruction;
+    a->batch_group[a->batch_len] = a->group_next || a->batch_len == 0;
+    a->group_next = 0;
+    a->batch_len++;
+
+    mpsse_send(a, 1, 1, 5, ETAP_CONTROL, 0);        /* Send command. */
+    mpsse_send(a, 0, 0, 32, CONTROL_PRACC |         /* Capture PRACC. */
+                            CONTROL_PROBEN |
+                            CONTROL_PROBTRAP |
+                            CONTROL_EJTAGBRK, 1);
+    mpsse_send(a, 1, 1, 5, ETAP_DATA, 0);           /* Send command. */
+    mpsse_send(a, 0, 0, 32, instruction, 0);        /* Send data. */
+    mpsse_send(a, 1, 1, 5, ETAP_CONTROL, 0);        /* Send command. */
+    mpsse_send(a, 0, 0, 32, CONTROL_PROBEN |        /* Send data. */
+                            CONTROL_PROBTRAP, 0);
+}
+
+/*
+ * Get a response from PE, polling the CPU at most max_polls times,
+ * or until ready when max_polls is 0.
+ * Return 0 when the CPU is not ready.
+ */
+static int wait_pe_response(mpsse_adapter_t *a, unsigned *result, int max_polls)
 {
     unsigned ctl, response;
+    int npolls = 0;
 
     // Select Control Register
     mpsse_send(a, 1, 1, 5, ETAP_CONTROL, 0);        /* Send command. */
@@ -580,6 +899,8 @@ static unsigned get_pe_response(mpsse_adapter_t *a)
     // Wait until CPU is ready
     // Check if Processor Access bit (bit 18) is set
     do {
+        if (max_polls > 0 && npolls++ == max_polls)
+            return 0;
         mpsse_send(a, 0, 0, 32, CONTROL_PRACC |     /* Xfer data. */
                                 CONTROL_PROBEN |
                                 CONTROL_PROBTRAP |
@@ -599,9 +920,89 @@ static unsigned get_pe_response(mpsse_adapter_t *a)
                             CONTROL_PROBTRAP, 0);
     if (debug_level > 1)
         fprintf(stderr, "%s: get PE response %08x\n", a->name, response);
+    *result = response;
+    return 1;
+}
+
+static unsigned get_pe_response(mpsse_adapter_t *a)
+{
+    unsigned response;
+
+    wait_pe_response(a, &response, 0);
     return response;
 }
 
+/*
+ * Collect a series of responses of the executive in one transfer.
+ * Control register is captured before and after every data read:
+ * the response is valid when PRACC was set before the read.
+ * Responses, which were not ready, are taken one by one.
+ * A long series is split into transfers, which fit in the output buffer.
+ * Return 0 when a response was lost: the executive completed
+ * the access after the data was captured.
+ */
+static int get_pe_responses(mpsse_adapter_t *a, unsigned *response, int count)
+{
+    unsigned long long word;
+    unsigned data, ready, done;
+    int i, n, offset, consumed, nvalid = 0, lost = 0;
+
+    while (count > 0) {
+        offset = a->bytes_to_read;
+        for (n=0; n<count; n++) {
+            if (a->bytes_to_write + XFER_BYTES > sizeof(a->output))
+                break;
+            mpsse_send(a, 1, 1, 5, ETAP_CONTROL, 0);    /* Send command. */
+            mpsse_send(a, 0, 0, 32, CONTROL_PRACC |     /* Capture PRACC. */
+                                    CONTROL_PROBEN |
+                                    CONTROL_PROBTRAP |
+                                    CONTROL_EJTAGBRK, 1);
+            mpsse_send(a, 1, 1, 5, ETAP_DATA, 0);       /* Send command. */
+            mpsse_send(a, 0, 0, 32, 0, 1);              /* Get data. */
+            mpsse_send(a, 1, 1, 5, ETAP_CONTROL, 0);    /* Send command. */
+            mpsse_send(a, 0, 0, 32, CONTROL_PROBEN |    /* Complete access, */
+                                    CONTROL_PROBTRAP, 1);   /* capture PRACC. */
+        }
+        mpsse_flush_output(a);
+        if (n == 0)
+            continue;
+
+        consumed = 0;
+        for (i=0; i<n; i++) {
+            unsigned char *input = a->input + offset + 3 * i * a->reply.bytes_per_word;
+
+            memcpy(&word, input, sizeof(word));
+            ready = mpsse_fix_data(a, word) & CONTROL_PRACC;
+            memcpy(&word, input + a->reply.bytes_per_word, sizeof(word));
+            data = mpsse_fix_data(a, word);
+            memcpy(&word, input + 2*a->reply.bytes_per_word, sizeof(word));
+            done = mpsse_fix_data(a, word) & CONTROL_PRACC;
+
+            if (done)
+                consumed++;
+            if (ready) {
+                if (! lost)
+                    response[nvalid++] = data;
+            } else if (done) {
+                /* Completed, but the data was captured too early. */
+                lost = 1;
+            }
+        }
+        if (debug_level > 0 && consumed < n)
+            fprintf(stderr, "%s: %d of %d responses were not ready\n",
+                a->name, n - consumed, n);
+
+        /* Take the rest of responses. */
+        for (; consumed < n; consumed++) {
+            data = get_pe_response(a);
+            if (! lost)
+                response[nvalid++] = data;
+        }
+        count -= n;
+    }
+    return ! lost;
+}
+
 /*
  * Read a word from memory (without PE).
  */
@@ -629,6 +1030,8 @@ static unsigned mpsse_read_word(adapter_t *adapter, unsigned addr)
     return word;
 }
 
+static void mpsse_sync(adapter_t *adapter);
+
 /*
  * Read a memory block.
  */
@@ -637,6 +1040,9 @@ static void mpsse_read_data(adapter_t *adapter,
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
     unsigned words_read, i;
+    int speculative = 1;
+
+    mpsse_sync(adapter);
 
     //fprintf(stderr, "%s: read %d bytes from %08x\n", a->name, nwords*4, addr);
     if (! a->use_executive) {
@@ -648,26 +1054,42 @@ static void mpsse_read_data(adapter_t *adapter,
         return;
     }
 
-    /* Use PE to read memory. */
+    /* Use PE to read memory.
+     * Command and all responses go in one transfer. */
     for (words_read = 0; words_read < nwords; words_read += 32) {
+        unsigned response [1 + 32];
 
         mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);
         xfer_fastdata(a, PE_READ << 16 | 32);       /* Read 32 words */
         xfer_fastdata(a, addr);                     /* Address */
 
-        unsigned response = get_pe_response(a);     /* Get response */
-        if (response != PE_READ << 16) {
+        if (! speculative || ! get_pe_responses(a, response, 1 + 32)) {
+            if (speculative) {
+                /* Executive is slower than JTAG: repeat the command,
+                 * and wait for every response from now on. */
+                speculative = 0;
+                mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);
+                xfer_fastdata(a, PE_READ << 16 | 32);
+                xfer_fastdata(a, addr);
+            }
+            for (i=0; i<1+32; i++)
+                response[i] = get_pe_response(a);
+        }
+        if (response[0] != PE_READ << 16) {
             fprintf(stderr, "%s: bad READ response = %08x, expected %08x\n",
-                a->name, response, PE_READ << 16);
+                a->name, response[0], PE_READ << 16);
             exit(-1);
         }
-        for (i=0; i<32; i++) {
-            *data++ = get_pe_response(a);           /* Get data */
-        }
+        memcpy(data, response + 1, 32*4);
+        data += 32;
         addr += 32*4;
     }
 }
 
+static int tune_clock(mpsse_adapter_t *a);
+static void save_clock(mpsse_adapter_t *a, unsigned khz);
+static void reload_executive(mpsse_adapter_t *a, unsigned khz);
+
 /*
  * Download programming executive (PE).
  */
@@ -676,12 +1098,18 @@ static void mpsse_load_executive(adapter_t *adapter,
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
 
+    a->pe = pe;
+    a->pe_nwords = nwords;
+    a->pe_version = pe_version;
     a->use_executive = 1;
     serial_execution(a);
 
     if (debug_level > 0)
         fprintf(stderr, "%s: download PE loader\n", a->name);
 
+    /* Setup of the bus matrix: every instruction depends on
+     * registers set by the previous ones, so wait for the CPU. */
+
     /* Step 1. */
     xfer_instruction(a, 0x3c04bf88);    // lui a0, 0xbf88
     xfer_instruction(a, 0x34842000);    // ori a0, 0x2000 - address of BMXCON
@@ -702,18 +1130,21 @@ static void mpsse_load_executive(adapter_t *adapter,
     xfer_instruction(a, 0x3c04a000);    // lui a0, 0xa000
     xfer_instruction(a, 0x34840800);    // ori a0, 0x800  - a0 has a0000800
 
-    /* Download the PE loader. */
+    /* Download the PE loader in batches, without waiting for the CPU.
+     * Every word is stored at its own offset from a0, so a group
+     * of three instructions can be repeated from its beginning. */
     int i;
     for (i=0; i<PIC32_PE_LOADER_LEN; i+=2) {
         /* Step 5. */
         unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
         unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
 
-        xfer_instruction(a, opcode1);       // lui a2, PE_loader_hi++
-        xfer_instruction(a, opcode2);       // ori a2, PE_loader_lo++
-        xfer_instruction(a, 0xac860000);    // sw  a2, 0(a0)
-        xfer_instruction(a, 0x24840004);    // addiu a0, 4
+        xfer_group(a);
+        xfer_batch(a, opcode1);             // lui a2, PE_loader_hi
+        xfer_batch(a, opcode2);             // ori a2, PE_loader_lo
+        xfer_batch(a, 0xac860000 | i*2);    // sw  a2, offset(a0)
     }
+    xfer_batch_flush(a);
 
     /* Jump to PE loader (step 6). */
     xfer_instruction(a, 0x3c19a000);    // lui t9, 0xa000
@@ -727,36 +1158,91 @@ static void mpsse_load_executive(adapter_t *adapter,
 
     /* Send parameters for the loader (step 7-A).
      * PE_ADDRESS = 0xA000_0900,
-     * PE_SIZE */
+     * PE_SIZE
+     * PrAcc bits are checked, like for a row: at a cached clock
+     * the loader can miss words before the clock is checked. */
+    a->fastdata_check = 1;
+    a->fastdata_lost = 0;
     mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
-    xfer_fastdata(a, 0xa0000900);
-    xfer_fastdata(a, nwords);
+    xfer_fastdata_pracc(a, 0xa0000900);
+    xfer_fastdata_pracc(a, nwords);
 
     /* Download the PE itself (step 7-B). */
     if (debug_level > 0)
         fprintf(stderr, "%s: download PE\n", a->name);
     for (i=0; i<nwords; i++) {
-        xfer_fastdata(a, *pe++);
+        xfer_fastdata_pracc(a, pe[i]);
     }
     mpsse_flush_output(a);
-    mdelay(10);
+    a->fastdata_check = 0;
+    if (a->fastdata_lost > 0) {
+        if (a->khz <= DEFAULT_KHZ) {
+            fprintf(stderr, "%s: PE loader was not ready, lost words: %u\n",
+                a->name, a->fastdata_lost);
+            exit(-1);
+        }
+        fprintf(stderr, "%s: PE loader was not ready at %u kHz\n",
+            a->name, a->khz);
+        save_clock(a, 0);
+        reload_executive(a, DEFAULT_KHZ);
+        return;
+    }
+    bulk_drain(a);
+    mpsse_delay(a, 10);
 
     /* Download the PE instructions. */
     xfer_fastdata(a, 0);                        /* Step 8 - jump to PE. */
     xfer_fastdata(a, 0xDEAD0000);
     mpsse_flush_output(a);
-    mdelay(10);
+    bulk_drain(a);
+    mpsse_delay(a, 10);
     xfer_fastdata(a, PE_EXEC_VERSION << 16);
 
     unsigned version = get_pe_response(a);
     if (version != (PE_EXEC_VERSION << 16 | pe_version)) {
         fprintf(stderr, "%s: bad PE version = %08x, expected %08x\n",
             a->name, version, PE_EXEC_VERSION << 16 | pe_version);
-        exit(-1);
+        if (a->khz <= DEFAULT_KHZ)
+            exit(-1);
+
+        /* PE was corrupted by the download: the clock is too fast. */
+        save_clock(a, 0);
+        reload_executive(a, DEFAULT_KHZ);
+        return;
     }
     if (debug_level > 0)
         fprintf(stderr, "%s: PE version = %04x\n",
             a->name, version & 0xffff);
+    if (! a->clock_tuned) {
+        report_begin(PHASE_CLOCK_TUNE);
+        int ok = tune_clock(a);
+        report_end(PHASE_CLOCK_TUNE);
+        if (! ok) {
+            /* The clock is set to the last one passed. */
+            fprintf(stderr, "%s: lost the link to PE, reload at %u kHz\n",
+                a->name, a->khz);
+            save_clock(a, (a->khz > DEFAULT_KHZ) ? a->khz : 0);
+            reload_executive(a, a->khz);
+        }
+    }
+}
+
+/*
+ * PE is out of step: reset the target and load
+ * the PE again at the given clock.
+ */
+static void reload_executive(mpsse_adapter_t *a, unsigned khz)
+{
+    mpsse_speed(a, khz);
+    report_jtag_clock(a->khz, (khz == DEFAULT_KHZ) ? "default" : "reduced");
+    a->clock_tuned = 1;
+    a->clock_cached = 0;
+    a->use_executive = 0;
+    a->serial_execution_mode = 0;
+    mpsse_reset(a, 0, 1, 1);
+    bulk_drain(a);
+    mpsse_delay(a, 10);
+    mpsse_load_executive(&a->adapter, a->pe, a->pe_nwords, a->pe_version);
 }
 
 /*
@@ -770,12 +1256,77 @@ static void mpsse_erase_chip(adapter_t *adapter)
     mpsse_send(a, 1, 1, 5, MTAP_COMMAND, 0);    /* Send command. */
     mpsse_send(a, 0, 0, 8, MCHP_ERASE, 0);      /* Xfer data. */
     mpsse_flush_output(a);
-    mdelay(400);
+    bulk_drain(a);
+    mpsse_delay(a, 400);
 
     /* Leave it in ETAP mode. */
     mpsse_send(a, 1, 1, 5, TAP_SW_ETAP, 0);     /* Send command. */
 }
 
+/*
+ * Erase a page of flash memory.
+ */
+static void mpsse_erase_page(adapter_t *adapter, unsigned addr)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_sync(adapter);
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: erase page at %08x\n", a->name, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow page erase not implemented yet.\n", a->name);
+        exit(-1);
+    }
+
+    /* Use PE to erase flash memory. */
+    mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
+    xfer_fastdata(a, PE_PAGE_ERASE << 16 | 1);
+    xfer_fastdata(a, addr);                     /* Send address. */
+
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PAGE_ERASE << 16)) {
+        fprintf(stderr, "%s: failed to erase page at %08x, reply = %08x\n",
+            a->name, addr, response);
+        exit(-1);
+    }
+}
+
+/*
+ * Check that flash memory is erased.
+ * Return 1 when blank.
+ */
+static int mpsse_blank_check(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_sync(adapter);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow blank check not implemented yet.\n", a->name);
+        exit(-1);
+    }
+
+    /* Use PE to check flash memory. */
+    mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
+    xfer_fastdata(a, PE_BLANK_CHECK << 16);
+    xfer_fastdata(a, addr);                     /* Send address. */
+    xfer_fastdata(a, nbytes);                   /* Send length. */
+
+    unsigned response = get_pe_response(a);
+    if ((response >> 16) != PE_BLANK_CHECK) {
+        fprintf(stderr, "%s: failed to blank check %d bytes at %08x, reply = %08x\n",
+            a->name, nbytes, addr, response);
+        exit(-1);
+    }
+    if (debug_level > 0)
+        fprintf(stderr, "%s: blank check %d bytes at %08x: %s\n",
+            a->name, nbytes, addr, (response & 0xffff) ? "not blank" : "blank");
+    return (response & 0xffff) == 0;
+}
+
 /*
  * Write a word to flash memory.
  */
@@ -784,6 +1335,8 @@ static void mpsse_program_word(adapter_t *adapter,
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
 
+    mpsse_sync(adapter);
+
     if (debug_level > 0)
         fprintf(stderr, "%s: program word at %08x: %08x\n", a->name, addr, word);
     if (! a->use_executive) {
@@ -795,9 +1348,7 @@ static void mpsse_program_word(adapter_t *adapter,
     /* Use PE to write flash memory. */
     mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
     xfer_fastdata(a, PE_WORD_PROGRAM << 16 | 2);
-    mpsse_flush_output(a);
     xfer_fastdata(a, addr);                     /* Send address. */
-    mpsse_flush_output(a);
     xfer_fastdata(a, word);                     /* Send word. */
 
     unsigned response = get_pe_response(a);
@@ -809,12 +1360,12 @@ static void mpsse_program_word(adapter_t *adapter,
 }
 
 /*
- * Flash write row of memory.
+ * Send a row of data to the PE, without waiting for the response.
  */
-static void mpsse_program_row(adapter_t *adapter, unsigned addr,
+static void send_row(mpsse_adapter_t *a, unsigned addr,
     unsigned *data, unsigned words_per_row)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned khz;
     int i;
 
     if (debug_level > 0)
@@ -826,20 +1377,48 @@ static void mpsse_program_row(adapter_t *adapter, unsigned addr,
         exit(-1);
     }
 
-    /* Use PE to write flash memory. */
-    mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
-    xfer_fastdata(a, PE_ROW_PROGRAM << 16 | words_per_row);
-    mpsse_flush_output(a);
-    xfer_fastdata(a, addr);                     /* Send address. */
+    /* Use PE to write flash memory.
+     * The whole row goes as one stream: the output buffer
+     * is flushed only when full. PrAcc bit of every word
+     * is captured in the same transfers, and checked
+     * at the end of the row. */
+    for (;;) {
+        a->fastdata_check = 1;
+        a->fastdata_lost = 0;
+        mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
+        xfer_fastdata_pracc(a, PE_ROW_PROGRAM << 16 | words_per_row);
+        xfer_fastdata_pracc(a, addr);               /* Send address. */
+
+        /* Download data. */
+        for (i = 0; i < words_per_row; i++)
+            xfer_fastdata_pracc(a, data[i]);        /* Send word. */
+        mpsse_flush_output(a);
+        a->fastdata_check = 0;
+        if (a->fastdata_lost == 0)
+            break;
 
-    /* Download data. */
-    for (i = 0; i < words_per_row; i++) {
-        if ((i & 7) == 0)
-            mpsse_flush_output(a);
-        xfer_fastdata(a, *data++);              /* Send word. */
+        if (a->khz <= DEFAULT_KHZ) {
+            fprintf(stderr, "%s: PE was not ready for row at %08x, lost words: %u\n",
+                a->name, addr, a->fastdata_lost);
+            exit(-1);
+        }
+
+        /* PE waits for the rest of the row, and has not written
+         * the flash yet. Restart it one clock step lower,
+         * and send the row again. The lower clock replaces
+         * the cached one. */
+        khz = DEFAULT_KHZ;
+        for (i=0; clock_steps[i] && clock_steps[i] < a->khz; i++)
+            khz = clock_steps[i];
+        fprintf(stderr, "%s: PE was not ready for row at %08x, retry at %u kHz\n",
+            a->name, addr, khz);
+        save_clock(a, (khz == DEFAULT_KHZ) ? 0 : khz);
+        reload_executive(a, khz);
     }
-    mpsse_flush_output(a);
+}
 
+static void check_row_response(mpsse_adapter_t *a, unsigned addr)
+{
     unsigned response = get_pe_response(a);
     if (response != (PE_ROW_PROGRAM << 16)) {
         fprintf(stderr, "%s: failed to program row at %08x, reply = %08x\n",
@@ -849,15 +1428,10 @@ static void mpsse_program_row(adapter_t *adapter, unsigned addr,
 }
 
 /*
- * Verify a block of memory.
+ * Send GET_CRC command to the PE, without waiting for the response.
  */
-static void mpsse_verify_data(adapter_t *adapter,
-    unsigned addr, unsigned nwords, unsigned *data)
+static void send_get_crc(mpsse_adapter_t *a, unsigned addr, unsigned nbytes)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-    unsigned data_crc, flash_crc;
-
-    //fprintf(stderr, "%s: verify %d words at %08x\n", a->name, nwords, addr);
     if (! a->use_executive) {
         /* Without PE. */
         fprintf(stderr, "%s: slow verify not implemented yet.\n", a->name);
@@ -867,20 +1441,295 @@ static void mpsse_verify_data(adapter_t *adapter,
     /* Use PE to get CRC of flash memory. */
     mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);   /* Send command. */
     xfer_fastdata(a, PE_GET_CRC << 16);
-    mpsse_flush_output(a);
     xfer_fastdata(a, addr);                     /* Send address. */
+    xfer_fastdata(a, nbytes);                   /* Send length. */
     mpsse_flush_output(a);
-    xfer_fastdata(a, nwords * 4);               /* Send length. */
+}
 
+static unsigned get_crc_response(mpsse_adapter_t *a,
+    unsigned addr, unsigned nbytes)
+{
     unsigned response = get_pe_response(a);
     if (response != (PE_GET_CRC << 16)) {
         fprintf(stderr, "%s: failed to verify %d words at %08x, reply = %08x\n",
-            a->name, nwords, addr, response);
+            a->name, nbytes / 4, addr, response);
         exit(-1);
     }
-    flash_crc = get_pe_response(a) & 0xffff;
+    return get_pe_response(a) & 0xffff;
+}
+
+/*
+ * Read IDCODE through MTAP, without reset of the TAP controller.
+ * Return 1 when it matches the identifier of the target.
+ */
+static int check_idcode(mpsse_adapter_t *a)
+{
+    mpsse_send(a, 1, 1, 5, TAP_SW_MTAP, 0);     /* Send command. */
+    mpsse_send(a, 1, 1, 5, MTAP_IDCODE, 0);     /* Send command. */
+    mpsse_send(a, 0, 0, 32, 0, 1);              /* Get data. */
+    return mpsse_recv(a) == a->idcode;
+}
+
+/*
+ * Check the link at the current clock: IDCODE, status of MTAP
+ * and a checksum from PE. The command goes to FASTDATA as a stream,
+ * like a row of data, and PrAcc bit of every word is checked.
+ * Return 0 on failure. Words of PE reply, which did not come,
+ * are counted as missing; with lost words of the command,
+ * PE is out of step and missing is set to -1.
+ */
+static int check_link(mpsse_adapter_t *a, unsigned *status, unsigned *crc,
+    int *missing)
+{
+    unsigned header;
+    int ok;
+
+    *missing = 0;
+    ok = check_idcode(a);
+    if (ok) {
+        mpsse_send(a, 1, 1, 5, MTAP_COMMAND, 0);    /* Send command. */
+        mpsse_send(a, 0, 0, 8, MCHP_STATUS, 1);     /* Xfer data. */
+        *status = mpsse_recv(a);
+    }
+    mpsse_send(a, 1, 1, 5, TAP_SW_ETAP, 0);         /* Send command. */
+    if (! ok)
+        return 0;
 
-    data_crc = calculate_crc(0xffff, (unsigned char*) data, nwords * 4);
+    a->fastdata_check = 1;
+    a->fastdata_lost = 0;
+    mpsse_send(a, 1, 1, 5, ETAP_FASTDATA, 0);       /* Send command. */
+    xfer_fastdata_pracc(a, PE_GET_CRC << 16);
+    xfer_fastdata_pracc(a, CLOCK_CRC_ADDR);         /* Send address. */
+    xfer_fastdata_pracc(a, CLOCK_CRC_BYTES);        /* Send length. */
+    mpsse_flush_output(a);
+    a->fastdata_check = 0;
+    if (a->fastdata_lost > 0) {
+        *missing = -1;
+        return 0;
+    }
+    *missing += ! wait_pe_response(a, &header, CLOCK_POLLS);
+    *missing += ! wait_pe_response(a, crc, CLOCK_POLLS);
+    return *missing == 0 && header == (PE_GET_CRC << 16);
+}
+
+/*
+ * Save the clock for this adapter and target.
+ * Zero khz removes the clock from the cache.
+ */
+static void save_clock(mpsse_adapter_t *a, unsigned khz)
+{
+    cache_t cache;
+
+    if (! a->serial[0] || capture_replaying || capture_recording)
+        return;
+    cache_load(&cache, 0);
+    cache_set_clock(&cache, a->serial, a->idcode, khz);
+    cache_save(&cache);
+    cache_free(&cache);
+}
+
+/*
+ * Use the clock, tuned for this adapter and target before.
+ * Here only IDCODE is checked: the link to PE is checked
+ * by tune_clock(), when the PE is loaded.
+ */
+static void load_clock(mpsse_adapter_t *a)
+{
+    cache_t cache;
+    unsigned khz;
+
+    report_jtag_clock(a->khz, "default");
+    if (! a->serial[0] || capture_replaying || capture_recording)
+        return;
+    cache_load(&cache, 0);
+    khz = cache_find_clock(&cache, a->serial, a->idcode);
+    cache_free(&cache);
+    if (khz == 0)
+        return;
+
+    mpsse_speed(a, khz);
+    if (! check_idcode(a)) {
+        if (debug_level > 0)
+            fprintf(stderr, "%s: cached clock %u kHz failed\n", a->name, khz);
+        mpsse_speed(a, DEFAULT_KHZ);
+        save_clock(a, 0);
+        return;
+    }
+    a->clock_cached = 1;
+    report_jtag_clock(a->khz, "cached");
+}
+
+/*
+ * Check the link a few times at the given clock.
+ * Return 0 when the target replies not the same as before.
+ */
+static int check_clock(mpsse_adapter_t *a, unsigned khz,
+    unsigned status, unsigned crc, int *missing)
+{
+    unsigned s, c;
+    int round;
+
+    mpsse_speed(a, khz);
+    for (round=0; round<CLOCK_ROUNDS; round++)
+        if (! check_link(a, &s, &c, missing) || s != status || c != crc)
+            break;
+    if (debug_level > 0)
+        fprintf(stderr, "%s: clock %u kHz %s\n", a->name, a->khz,
+            (round == CLOCK_ROUNDS) ? "passed" : "failed");
+    return (round == CLOCK_ROUNDS);
+}
+
+/*
+ * Return to the clock, which passed, after a failed check:
+ * take the reply, left from the failed check, and check
+ * that PE is still in step. Return 0 when it is not.
+ */
+static int restore_clock(mpsse_adapter_t *a, unsigned khz,
+    unsigned status, unsigned crc, int missing)
+{
+    unsigned s, c;
+
+    mpsse_speed(a, khz);
+    if (missing < 0)
+        return 0;
+    while (missing-- > 0)
+        wait_pe_response(a, &c, CLOCK_POLLS);
+    return check_link(a, &s, &c, &missing) && s == status && c == crc;
+}
+
+/*
+ * Raise TCK clock step by step, while the target replies
+ * the same as at the initial clock. PE must be running.
+ * The cached clock is checked the same way, and tuned again
+ * when it fails. One passed step is left as a margin.
+ * Return 0 when PE is out of step and must be loaded again,
+ * at the clock which passed.
+ */
+static int tune_clock(mpsse_adapter_t *a)
+{
+    unsigned status, crc, cached = 0, good, margin;
+    int i, missing = 0;
+
+    if (a->clock_cached) {
+        /* Take the reference reply at the default clock. */
+        cached = a->khz;
+        mpsse_speed(a, DEFAULT_KHZ);
+    }
+    a->clock_tuned = 1;
+    a->clock_cached = 0;
+    if (! check_link(a, &status, &crc, &missing)) {
+        fprintf(stderr, "%s: no reliable reply at %u kHz, clock not tuned\n",
+            a->name, a->khz);
+        return (missing == 0);
+    }
+    if (cached) {
+        if (check_clock(a, cached, status, crc, &missing)) {
+            report_jtag_clock(a->khz, "cached");
+            return 1;
+        }
+        save_clock(a, 0);
+        if (! restore_clock(a, DEFAULT_KHZ, status, crc, missing))
+            return 0;
+    }
+    good = margin = a->khz;
+    for (i=0; clock_steps[i] && clock_steps[i] <= a->mhz * 1000; i++) {
+        if (clock_steps[i] <= good)
+            continue;
+        if (! check_clock(a, clock_steps[i], status, crc, &missing))
+            break;
+        margin = good;
+        good = a->khz;
+    }
+    if (a->khz != margin &&
+        ! restore_clock(a, margin, status, crc, missing))
+        return 0;
+    report_jtag_clock(a->khz, "tuned");
+    save_clock(a, a->khz);
+    return 1;
+}
+
+/*
+ * Wait for the PE to complete the queued request.
+ * The PE handles one command at a time, so this must be done
+ * before any other command is sent.
+ */
+static void mpsse_sync(adapter_t *adapter)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    adapter_req_t *req = a->pending;
+
+    if (! req)
+        return;
+    a->pending = 0;
+    switch (req->op) {
+    case AQ_PROGRAM_ROW:
+        check_row_response(a, req->addr);
+        break;
+    case AQ_GET_CRC:
+        req->result = get_crc_response(a, req->addr, req->nwords * 4);
+        break;
+    }
+    if (req->done)
+        req->done(req);
+}
+
+/*
+ * Queue a request. The response of the PE is collected
+ * before the next command, so the host is free to do other work
+ * while the PE writes the flash or computes the checksum.
+ */
+static void mpsse_submit(adapter_t *adapter, adapter_req_t *req)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_sync(adapter);
+    switch (req->op) {
+    case AQ_PROGRAM_ROW:
+        send_row(a, req->addr, req->data, req->nwords);
+        break;
+    case AQ_GET_CRC:
+        send_get_crc(a, req->addr, req->nwords * 4);
+        break;
+    }
+    a->pending = req;
+}
+
+/*
+ * Flash write row of memory.
+ */
+static void mpsse_program_row(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned words_per_row)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_sync(adapter);
+    send_row(a, addr, data, words_per_row);
+    check_row_response(a, addr);
+}
+
+/*
+ * Verify a block of memory.
+ */
+static unsigned mpsse_get_crc(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_sync(adapter);
+    send_get_crc(a, addr, nbytes);
+    return get_crc_response(a, addr, nbytes);
+}
+
+static void mpsse_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned data_crc, flash_crc;
+
+    //fprintf(stderr, "%s: verify %d words at %08x\n", a->name, nwords, addr);
+    flash_crc = mpsse_get_crc(adapter, addr, nwords * 4);
+
+    data_crc = crc16(CRC16_PE_SEED, (unsigned char*) data, nwords * 4);
     if (flash_crc != data_crc) {
         fprintf(stderr, "%s: checksum failed at %08x: sum=%04x, expected=%04x\n",
             a->name, addr, flash_crc, data_crc);
@@ -889,12 +1738,12 @@ static void mpsse_verify_data(adapter_t *adapter,
 }
 
 /*
- * Initialize adapter F2232.
+ * Initialize adapter F2232, or the simulated target,
+ * when the configuration of simulator is given.
  * Return a pointer to a data structure, allocated dynamically.
  * When adapter not found, return 0.
- * Parameters vid, pid and serial are not used.
  */
-adapter_t *adapter_open_mpsse(int vid, int pid, const char *serial, int report)
+static adapter_t *mpsse_open(const char *sim_config)
 {
     mpsse_adapter_t *a;
     unsigned char product [256];
@@ -905,6 +1754,25 @@ adapter_t *adapter_open_mpsse(int vid, int pid, const char *serial, int report)
         fprintf(stderr, "adapter_open_mpsse: out of memory\n");
         return 0;
     }
+    if (capture_replaying) {
+        /* Type of adapter is taken from the capture file. */
+        for (i = 0; devlist[i].vid; i++)
+            if (capture_open(TRANSPORT_BULK, devlist[i].name))
+                goto found;
+        free(a);
+        return 0;
+    }
+    if (sim_config) {
+        /* Simulated target behind ARM-USB-Tiny-H. */
+        a->sim = sim_open(sim_config);
+        if (! a->sim) {
+            free(a);
+            return 0;
+        }
+        for (i = 0; devlist[i].pid != OLIMEX_ARM_USB_TINY_H; i++)
+            continue;
+        goto found;
+    }
     a->context = NULL;
     int ret = libusb_init(&a->context);
 
@@ -933,18 +1801,8 @@ adapter_t *adapter_open_mpsse(int vid, int pid, const char *serial, int report)
                 }
             }
 
-            if (match == 1) {
-                a->name = devlist[i].name;
-                a->mhz = devlist[i].mhz;
-                a->dir_control      = devlist[i].dir_control;
-                a->trst_control     = devlist[i].trst_control;
-                a->trst_inverted    = devlist[i].trst_inverted;
-                a->sysrst_control   = devlist[i].sysrst_control;
-                a->sysrst_inverted  = devlist[i].sysrst_inverted;
-                a->led_control      = devlist[i].led_control;
-                a->led_inverted     = devlist[i].led_inverted;
+            if (match == 1)
                 goto found;
-            }
         }
     }
 
@@ -955,6 +1813,25 @@ found:
     /*fprintf(stderr, "found USB adapter: vid %04x, pid %04x, type %03x\n",
         dev->descriptor.idVendor, dev->descriptor.idProduct,
         dev->descriptor.bcdDevice);*/
+    a->name = devlist[i].name;
+    a->mhz = devlist[i].mhz;
+    a->max_packet = (a->mhz > 6) ? 512 : 64;    /* High speed or full speed */
+    a->dir_control      = devlist[i].dir_control;
+    a->trst_control     = devlist[i].trst_control;
+    a->trst_inverted    = devlist[i].trst_inverted;
+    a->sysrst_control   = devlist[i].sysrst_control;
+    a->sysrst_inverted  = devlist[i].sysrst_inverted;
+    a->led_control      = devlist[i].led_control;
+    a->led_inverted     = devlist[i].led_inverted;
+    if (capture_replaying)
+        goto configured;
+    if (a->sim) {
+        capture_open(TRANSPORT_BULK, a->name);
+        goto configured;
+    }
+
+    urb_alloc(a);
+    read_serial(a);
 
     ret = libusb_detach_kernel_driver(a->usbdev, 0);
     if (ret != 0) {
@@ -974,8 +1851,13 @@ found:
             fprintf(stderr, "%s: superuser privileges needed.\n", a->name);
         else
             fprintf(stderr, "%s: FTDI reset failed\n", a->name);
-failed: libusb_release_interface(a->usbdev, 0);
-        libusb_close(a->usbdev);
+failed: if (a->sim) {
+            sim_close(a->sim);
+        } else if (! capture_replaying) {
+            urb_free(a);
+            libusb_release_interface(a->usbdev, 0);
+            libusb_close(a->usbdev);
+        }
         free(a);
         return 0;
     }
@@ -1004,10 +1886,11 @@ failed: libusb_release_interface(a->usbdev, 0);
     }
     if (debug_level)
     	fprintf(stderr, "%s: latency timer: %u usec\n", a->name, latency_timer);
+    capture_open(TRANSPORT_BULK, a->name);
 
+configured:
     /* By default, use 500 kHz speed. */
-    int khz = 500;
-    mpsse_speed(a, khz);
+    mpsse_speed(a, DEFAULT_KHZ);
 
     /* Disable TDI to TDO loopback. */
     unsigned char enable_loopback[] = "\x85";
@@ -1033,7 +1916,8 @@ failed: libusb_release_interface(a->usbdev, 0);
 
     /* Activate /SYSRST and LED. */
     mpsse_reset(a, 0, 1, 1);
-    mdelay(10);
+    bulk_drain(a);
+    mpsse_delay(a, 10);
 
     /* Check status. */
     mpsse_send(a, 1, 1, 5, TAP_SW_MTAP, 0);         /* Send command. */
@@ -1049,9 +1933,12 @@ failed: libusb_release_interface(a->usbdev, 0);
         mpsse_reset(a, 0, 0, 0);
         goto failed;
     }
+    a->idcode = idcode;
+    load_clock(a);
     conprintf("      Adapter: %s\n", a->name);
 
     a->adapter.block_override = 0;
+    a->adapter.name = a->name;
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     /* User functions. */
@@ -1061,8 +1948,30 @@ failed: libusb_release_interface(a->usbdev, 0);
     a->adapter.read_word = mpsse_read_word;
     a->adapter.read_data = mpsse_read_data;
     a->adapter.verify_data = mpsse_verify_data;
+    a->adapter.get_crc = mpsse_get_crc;
     a->adapter.erase_chip = mpsse_erase_chip;
+    a->adapter.erase_page = mpsse_erase_page;
+    a->adapter.blank_check = mpsse_blank_check;
     a->adapter.program_word = mpsse_program_word;
     a->adapter.program_row = mpsse_program_row;
+    a->adapter.submit = mpsse_submit;
+    a->adapter.sync = mpsse_sync;
     return &a->adapter;
 }
+
+/*
+ * Parameters vid, pid and serial are not used.
+ */
+adapter_t *adapter_open_mpsse(int vid, int pid, const char *serial, int report)
+{
+    return mpsse_open(0);
+}
+
+/*
+ * Open the simulated target: the port is the configuration
+ * of simulator, like "mx3,rtt=125".
+ */
+adapter_t *adapter_open_mpsse_sim(const char *port, int baud_rate)
+{
+    return mpsse_open(port);
+}
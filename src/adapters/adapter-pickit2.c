@@ -20,9 +20,11 @@
 
 #include "adapter.h"
 #include "hidapi.h"
+#include "transport.h"
 #include "pickit2.h"
 #include "pic32.h"
 #include "console.h"
+#include "report.h"
 
 typedef struct {
     /* Common part */
@@ -76,7 +78,7 @@ static void pickit_send_buf(pickit_adapter_t *a, unsigned char *buf, unsigned nb
         }
         fprintf(stderr, "\n");
     }
-    hid_write(a->hiddev, buf, 64);
+    transport_hid_write(a->hiddev, buf, 64);
 }
 
 static void pickit_send(pickit_adapter_t *a, unsigned argc, ...)
@@ -95,7 +97,7 @@ static void pickit_send(pickit_adapter_t *a, unsigned argc, ...)
 
 static void pickit_recv(pickit_adapter_t *a)
 {
-    if (hid_read(a->hiddev, a->reply, 64) != 64) {
+    if (transport_hid_read(a->hiddev, a->reply, 64, -1) != 64) {
         fprintf(stderr, "%s: error receiving packet\n", a->name);
         exit(-1);
     }
@@ -133,6 +135,7 @@ static void serial_execution(pickit_adapter_t *a)
     if (a->serial_execution_mode)
         return;
     a->serial_execution_mode = 1;
+    report_begin(PHASE_SERIAL_EXEC);
 
     // Enter serial execution.
     if (debug_level > 0)
@@ -152,6 +155,7 @@ static void serial_execution(pickit_adapter_t *a)
         SCRIPT_JT2_XFERDATA8_LIT, MCHP_DEASSERT_RST,
         SCRIPT_DELAY_LONG, 20, // 100 msec
         SCRIPT_JT2_XFERDATA8_LIT, MCHP_FLASH_ENABLE);
+    report_end(PHASE_SERIAL_EXEC);
 }
 
 /*
@@ -322,10 +326,20 @@ static void pickit_load_executive(adapter_t *adapter,
         fprintf(stderr, "%s: PE version = %04x\n", a->name, version);
 }
 
-#if 0
-int pe_blank_check(pickit_adapter_t *a,
-    unsigned int start, unsigned int nbytes)
+/*
+ * Check that flash memory is erased.
+ * Return 1 when blank.
+ */
+static int pickit_blank_check(adapter_t *adapter,
+    unsigned start, unsigned nbytes)
 {
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow blank check not implemented yet.\n", a->name);
+        exit(-1);
+    }
     pickit_send(a, 21, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 18,
         SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
         SCRIPT_JT2_XFRFASTDAT_LIT,
@@ -351,9 +365,19 @@ int pe_blank_check(pickit_adapter_t *a,
     return 1;
 }
 
-int pe_get_crc(pickit_adapter_t *a,
-    unsigned int start, unsigned int nbytes)
+/*
+ * Get checksum of flash memory.
+ */
+static unsigned pickit_get_crc(adapter_t *adapter,
+    unsigned start, unsigned nbytes)
 {
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow verify not implemented yet.\n", a->name);
+        exit(-1);
+    }
     pickit_send(a, 22, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 19,
         SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
         SCRIPT_JT2_XFRFASTDAT_LIT,
@@ -375,13 +399,12 @@ int pe_get_crc(pickit_adapter_t *a,
     pickit_send(a, 1, CMD_UPLOAD_DATA);
     pickit_recv(a);
     if (a->reply[3] != 8 || a->reply[1] != 0) { // response code 0 = success
-        return 0;
+        fprintf(stderr, "%s: failed to get checksum of %d words at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, nbytes / 4, start, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
     }
-
-    int crc = a->reply[5] | (a->reply[6] << 8);
-    return crc;
+    return a->reply[5] | (a->reply[6] << 8);
 }
-#endif
 
 static void pickit_finish(pickit_adapter_t *a, int power_on)
 {
@@ -657,6 +680,41 @@ static void pickit_program_word(adapter_t *adapter,
     }
 }
 
+/*
+ * Erase a page of flash memory.
+ */
+static void pickit_erase_page(adapter_t *adapter, unsigned addr)
+{
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: erase page at %08x\n", a->name, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow page erase not implemented yet.\n", a->name);
+        exit(-1);
+    }
+    /* Use PE to erase flash memory. */
+    pickit_send(a, 17, CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 13,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                1, 0, 5, 0,                     // PAGE_ERASE, 1 page
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) addr,
+                (unsigned char) (addr >> 8),
+                (unsigned char) (addr >> 16),
+                (unsigned char) (addr >> 24),
+            SCRIPT_JT2_GET_PE_RESP,
+        CMD_UPLOAD_DATA);
+    pickit_recv(a);
+    if (a->reply[0] != 4 || a->reply[1] != 0) { // response code 0 = success
+        fprintf(stderr, "%s: failed to erase page at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, addr, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
+    }
+}
+
 /*
  * Write 4 words to flash memory.
  */
@@ -986,6 +1044,7 @@ static adapter_t *open_pickit(hid_device *hiddev, int is_pk3)
     }
 
     a->adapter.block_override = 0;
+    a->adapter.name = a->name;
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     if (! (a->reply[1] & MCHP_STATUS_CPS)) {
@@ -1000,6 +1059,9 @@ static adapter_t *open_pickit(hid_device *hiddev, int is_pk3)
     a->adapter.read_word = pickit_read_word;
     a->adapter.read_data = pickit_read_data;
     a->adapter.erase_chip = pickit_erase_chip;
+    a->adapter.erase_page = pickit_erase_page;
+    a->adapter.blank_check = pickit_blank_check;
+    a->adapter.get_crc = pickit_get_crc;
     a->adapter.program_word = pickit_program_word;
     a->adapter.program_row = pickit_program_row;
     a->adapter.program_quad_word = pickit_program_quad_word;
@@ -1019,9 +1081,9 @@ adapter_t *adapter_open_pickit2(int vid, int pid, const char *serial, int report
         wchar_t buf[256];
         if (serial)
             mbstowcs(buf, serial, 256);
-        hiddev = hid_open(vid, pid, serial ? buf : 0);
+        hiddev = transport_hid_open(vid, pid, serial ? buf : 0);
     } else {
-        hiddev = hid_open(MICROCHIP_VID, PICKIT2_PID, 0);
+        hiddev = transport_hid_open(MICROCHIP_VID, PICKIT2_PID, 0);
     }
     if (! hiddev) {
         if (vid)
@@ -1045,11 +1107,11 @@ adapter_t *adapter_open_pickit3(int vid, int pid, const char *serial, int report
         wchar_t buf[256];
         if (serial)
             mbstowcs(buf, serial, 256);
-        hiddev = hid_open(vid, pid, serial ? buf : 0);
+        hiddev = transport_hid_open(vid, pid, serial ? buf : 0);
     } else {
-        hiddev = hid_open(MICROCHIP_VID, PICKIT3_PID, 0);
+        hiddev = transport_hid_open(MICROCHIP_VID, PICKIT3_PID, 0);
         if (! hiddev)
-            hiddev = hid_open(MICROCHIP_VID, CHIPKIT_PID, 0);
+            hiddev = transport_hid_open(MICROCHIP_VID, CHIPKIT_PID, 0);
     }
     if (! hiddev) {
         if (vid)
@@ -17,6 +17,7 @@
 #include "pic32.h"
 #include "serial.h"
 #include "console.h"
+#include "transport.h"
 
 /*
  * AVR068 - STK500 Communication Protocol
@@ -136,6 +137,7 @@ flush_input:
         serial_read(buf, sizeof(buf), a->timeout_msec);
         if (retry) {
             retry = 1;
+            transport_retry(TRANSPORT_SERIAL);
             goto again;
         }
         return 0;
@@ -625,6 +627,7 @@ adapter_t *adapter_open_stk500v2(const char *port, int baud_rate)
     a->adapter.user_nbytes = 2048 * 1024;
     a->adapter.boot_nbytes = 80 * 1024;
     a->adapter.block_override = 1024;
+    a->adapter.name = "STK500v2";
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     conprintf(" Program area: %08x-%08x\n", a->adapter.user_start,
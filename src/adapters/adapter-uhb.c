@@ -17,6 +17,7 @@
 
 #include "adapter.h"
 #include "hidapi.h"
+#include "transport.h"
 #include "pic32.h"
 #include "console.h"
 
@@ -96,7 +97,7 @@ static void uhb_command(uhb_adapter_t *a, unsigned char cmd,
         }
         fprintf(stderr, "\n");
     }
-    hid_write(a->hiddev, buf, 64);
+    transport_hid_write(a->hiddev, buf, 64);
 
     if (cmd == CMD_REBOOT) {
         /* No reply expected. */
@@ -115,14 +116,14 @@ static void uhb_command(uhb_adapter_t *a, unsigned char cmd,
                 }
                 fprintf(stderr, "\n");
             }
-            hid_write(a->hiddev, data, 64);
+            transport_hid_write(a->hiddev, data, 64);
             data += 64;
         }
     }
 
     /* Get reply. */
     memset(a->reply, 0, sizeof(a->reply));
-    reply_len = hid_read_timeout(a->hiddev, a->reply, 64, 500);
+    reply_len = transport_hid_read(a->hiddev, a->reply, 64, 500);
     if (reply_len == 0) {
         fprintf(stderr, "Timed out.\n");
         exit(-1);
@@ -262,9 +263,9 @@ adapter_t *adapter_open_uhb(int vid, int pid, const char *serial, int report)
         wchar_t buf[256];
         if (serial)
             mbstowcs(buf, serial, 256);
-        hiddev = hid_open(vid, pid, serial ? buf : 0);
+        hiddev = transport_hid_open(vid, pid, serial ? buf : 0);
     } else
-        hiddev = hid_open(MIKROE_VID, MIKROEBOOT_PID, 0);
+        hiddev = transport_hid_open(MIKROE_VID, MIKROEBOOT_PID, 0);
 
     if (! hiddev) {
         if (vid)
@@ -325,6 +326,7 @@ adapter_t *adapter_open_uhb(int vid, int pid, const char *serial, int report)
     }
 
     a->adapter.block_override = 0;
+    a->adapter.name = "UHB";
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     /* User functions. */
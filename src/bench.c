@@ -0,0 +1,562 @@
+/*
+ * Microbenchmarks for host-side code paths of PIC32PROG.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "loader.h"
+#include "image.h"
+#include "crc16.h"
+#include "jtag-encode.h"
+#include "pic32.h"
+#include "config.h"
+
+#define FLASHV_BASE     0x9d000000
+#define IMAGE_MAX       (2048 * 1024)
+
+/* Macros for converting between hex and binary. */
+#define NIBBLE(x)       (isdigit(x) ? (x)-'0' : tolower(x)+10-'a')
+#define HEX(buffer)     ((NIBBLE((buffer)[0])<<4) + NIBBLE((buffer)[1]))
+
+static unsigned char image [IMAGE_MAX];
+static unsigned image_bytes;
+static char tmpname [256];
+static unsigned char payload [IMAGE_MAX];
+static unsigned erased [IMAGE_MAX / 4];  /* Contents of blank flash */
+static volatile unsigned sink;          /* Keeps results alive */
+
+/* Image sizes and row sizes of all families. */
+static const unsigned sizes[] = { 128*1024, 512*1024, 2048*1024 };
+static const unsigned row_sizes[] = { 128, 512, 2048 };
+
+#define NSIZES          (sizeof(sizes) / sizeof(sizes[0]))
+#define NROWS           (sizeof(row_sizes) / sizeof(row_sizes[0]))
+
+/*
+ * Time in nanoseconds.
+ */
+static double bench_nsec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+#else
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec * 1e9 + t.tv_usec * 1e3;
+#endif
+}
+
+/*
+ * Store one byte, checking the address range on every call,
+ * as the old parser did.
+ */
+static void legacy_store(unsigned address, unsigned byte)
+{
+    if (address >= FLASHV_BASE && address < FLASHV_BASE + IMAGE_MAX) {
+        image [address - FLASHV_BASE] = byte;
+        image_bytes++;
+    }
+}
+
+/*
+ * Old line-by-line HEX parser, kept as a reference.
+ */
+static int legacy_hex(char *filename)
+{
+    FILE *fd;
+    unsigned char buf [256], data[16], record_type, sum;
+    unsigned address, high;
+    int bytes, i;
+
+    fd = fopen(filename, "r");
+    if (! fd) {
+        perror(filename);
+        exit(1);
+    }
+    high = 0;
+    while (fgets((char*) buf, sizeof(buf), fd)) {
+        if (buf[0] != ':')
+            break;
+        record_type = HEX(buf+7);
+        if (record_type == 1)
+            break;
+        bytes = HEX(buf+1);
+        address = high << 16 | HEX(buf+3) << 8 | HEX(buf+5);
+        sum = 0;
+        for (i=0; i<bytes; ++i) {
+            data [i] = HEX(buf+9 + i + i);
+            sum += data [i];
+        }
+        sum += record_type + bytes + (address & 0xff) + (address >> 8 & 0xff);
+        if (sum != (unsigned char) - HEX(buf+9 + bytes + bytes))
+            return 0;
+        if (record_type == 4) {
+            high = data[0] << 8 | data[1];
+            continue;
+        }
+        for (i=0; i<bytes; i++)
+            legacy_store(address++, data [i]);
+    }
+    fclose(fd);
+    return 1;
+}
+
+/*
+ * Old line-by-line SREC parser, kept as a reference.
+ */
+static int legacy_srec(char *filename)
+{
+    FILE *fd;
+    unsigned char buf [256];
+    unsigned char *data;
+    unsigned address;
+    int bytes;
+
+    fd = fopen(filename, "r");
+    if (! fd) {
+        perror(filename);
+        exit(1);
+    }
+    while (fgets((char*) buf, sizeof(buf), fd)) {
+        if (buf[0] != 'S' || buf[1] == '7')
+            break;
+        if (buf[1] != '3')
+            continue;
+        bytes = HEX(buf + 2) - 5;
+        data = buf + 4;
+        address = HEX(data) << 24 | HEX(data+2) << 16 |
+                  HEX(data+4) << 8 | HEX(data+6);
+        data += 8;
+        while (bytes-- > 0) {
+            legacy_store(address++, HEX(data));
+            data += 2;
+        }
+    }
+    fclose(fd);
+    return 1;
+}
+
+/*
+ * Store a whole record, as the new loader does.
+ */
+static void loader_store(void *arg, unsigned address,
+    const unsigned char *data, unsigned nbytes)
+{
+    unsigned offset = address - FLASHV_BASE;
+
+    if (offset < IMAGE_MAX && nbytes <= IMAGE_MAX - offset) {
+        memcpy(image + offset, data, nbytes);
+        image_bytes += nbytes;
+    }
+}
+
+static int new_hex(char *filename)
+{
+    loader_file_t file;
+    int ok;
+
+    loader_map(filename, &file);
+    ok = loader_hex(filename, &file, loader_store, 0);
+    loader_unmap(&file);
+    return ok;
+}
+
+static int new_srec(char *filename)
+{
+    loader_file_t file;
+    int ok;
+
+    loader_map(filename, &file);
+    ok = loader_srec(filename, &file, loader_store, 0);
+    loader_unmap(&file);
+    return ok;
+}
+
+/*
+ * Create a synthetic image of pseudo-random data.
+ */
+static void make_payload(unsigned char *buf, unsigned nbytes)
+{
+    unsigned i, x = 12345;
+
+    for (i=0; i<nbytes; i++) {
+        x = x * 1103515245 + 12345;
+        buf[i] = x >> 16;
+    }
+}
+
+static void write_hex(const char *filename, const unsigned char *buf, unsigned nbytes)
+{
+    FILE *fd = fopen(filename, "w");
+    unsigned addr, i, n, sum;
+
+    if (! fd) {
+        perror(filename);
+        exit(1);
+    }
+    for (addr=0; addr<nbytes; addr+=16) {
+        if ((addr & 0xffff) == 0) {
+            unsigned high = (FLASHV_BASE + addr) >> 16;
+            sum = 2 + 4 + (high >> 8) + (high & 0xff);
+            fprintf(fd, ":02000004%04X%02X\n", high, -sum & 0xff);
+        }
+        n = (nbytes - addr < 16) ? nbytes - addr : 16;
+        sum = n + (addr >> 8 & 0xff) + (addr & 0xff);
+        fprintf(fd, ":%02X%04X00", n, addr & 0xffff);
+        for (i=0; i<n; i++) {
+            fprintf(fd, "%02X", buf[addr+i]);
+            sum += buf[addr+i];
+        }
+        fprintf(fd, "%02X\n", -sum & 0xff);
+    }
+    fprintf(fd, ":00000001FF\n");
+    fclose(fd);
+}
+
+static void write_srec(const char *filename, const unsigned char *buf, unsigned nbytes)
+{
+    FILE *fd = fopen(filename, "w");
+    unsigned addr, a, i, n, sum;
+
+    if (! fd) {
+        perror(filename);
+        exit(1);
+    }
+    for (addr=0; addr<nbytes; addr+=32) {
+        n = (nbytes - addr < 32) ? nbytes - addr : 32;
+        a = FLASHV_BASE + addr;
+        sum = (n + 5) + (a >> 24) + (a >> 16 & 0xff) + (a >> 8 & 0xff) + (a & 0xff);
+        fprintf(fd, "S3%02X%08X", n + 5, a);
+        for (i=0; i<n; i++) {
+            fprintf(fd, "%02X", buf[addr+i]);
+            sum += buf[addr+i];
+        }
+        fprintf(fd, "%02X\n", ~sum & 0xff);
+    }
+    fprintf(fd, "S705%08X%02X\n", FLASHV_BASE,
+        ~(5 + 0x9d) & 0xff);
+    fclose(fd);
+}
+
+/*
+ * Run the parser several times and print time per byte of payload.
+ */
+static void run_parser(const char *name, int (*parse)(char*), unsigned nbytes)
+{
+    double t0, best = 0;
+    int i;
+
+    for (i=0; i<5; i++) {
+        image_bytes = 0;
+        t0 = bench_nsec();
+        if (! parse(tmpname) || image_bytes != nbytes) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            exit(1);
+        }
+        t0 = bench_nsec() - t0;
+        if (i == 0 || t0 < best)
+            best = t0;
+    }
+    printf("%-18s %8u %10.3f ns/byte %8.2f MB/s\n", name, nbytes,
+        best / nbytes, nbytes / best * 1e3);
+}
+
+static void bench_loader(void)
+{
+    unsigned i;
+
+    for (i=0; i<NSIZES; i++) {
+        write_hex(tmpname, payload, sizes[i]);
+        run_parser("hex-legacy", legacy_hex, sizes[i]);
+        run_parser("hex-loader", new_hex, sizes[i]);
+        if (memcmp(image, payload, sizes[i]) != 0) {
+            fprintf(stderr, "hex-loader: data mismatch\n");
+            exit(1);
+        }
+
+        write_srec(tmpname, payload, sizes[i]);
+        run_parser("srec-legacy", legacy_srec, sizes[i]);
+        run_parser("srec-loader", new_srec, sizes[i]);
+        if (memcmp(image, payload, sizes[i]) != 0) {
+            fprintf(stderr, "srec-loader: data mismatch\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Run the function repeatedly: every trial lasts at least 20 msec,
+ * and the best of five trials is printed as time per byte.
+ */
+static void run_bench(const char *name, unsigned row_size,
+    void (*func)(unsigned, unsigned), unsigned nbytes)
+{
+    char label [32];
+    double t0, t, best = 0;
+    unsigned reps = 1, r;
+    int i;
+
+    /* Find the number of repetitions. */
+    for (;;) {
+        t0 = bench_nsec();
+        for (r=0; r<reps; r++)
+            func(nbytes, row_size);
+        if (bench_nsec() - t0 >= 20e6 || reps >= 1u << 20)
+            break;
+        reps *= 2;
+    }
+    for (i=0; i<5; i++) {
+        t0 = bench_nsec();
+        for (r=0; r<reps; r++)
+            func(nbytes, row_size);
+        t = (bench_nsec() - t0) / reps;
+        if (i == 0 || t < best)
+            best = t;
+    }
+    if (row_size)
+        snprintf(label, sizeof(label), "%s/%u", name, row_size);
+    else
+        snprintf(label, sizeof(label), "%s", name);
+    printf("%-18s %8u %10.3f ns/byte %8.2f MB/s\n", label, nbytes,
+        best / nbytes, nbytes / best * 1e3);
+}
+
+/*
+ * Store records of 16 bytes, as HEX loader delivers them.
+ */
+static void store_legacy(unsigned nbytes, unsigned row_size)
+{
+    unsigned addr, i;
+
+    image_bytes = 0;
+    for (addr=0; addr<nbytes; addr+=16)
+        for (i=0; i<16; i++)
+            legacy_store(FLASHV_BASE + addr + i, payload[addr + i]);
+}
+
+static void store_image(unsigned nbytes, unsigned row_size)
+{
+    image_t img;
+    unsigned addr;
+
+    image_init(&img, row_size);
+    for (addr=0; addr<nbytes; addr+=16)
+        image_write(&img, 0x1d000000 + addr, payload + addr, 16);
+    sink = img.nextents;
+    image_free(&img);
+}
+
+/*
+ * Checksum of every row.
+ */
+static void crc_table(unsigned nbytes, unsigned row_size)
+{
+    unsigned addr, crc = 0;
+
+    for (addr=0; addr<nbytes; addr+=row_size)
+        crc += crc16(CRC16_PE_SEED, payload + addr, row_size);
+    sink = crc;
+}
+
+/*
+ * Copy of target_test_empty_block() from target.c.
+ */
+static int target_test_empty_block(unsigned *data, unsigned nwords)
+{
+    while (nwords--)
+        if (*data++ != 0xFFFFFFFF)
+            return 0;
+    return 1;
+}
+
+/*
+ * Scan erased rows: the worst case, every word is compared.
+ */
+static void empty_block(unsigned nbytes, unsigned row_size)
+{
+    unsigned addr, n = 0;
+
+    for (addr=0; addr<nbytes; addr+=row_size)
+        n += target_test_empty_block(erased + addr/4, row_size / 4);
+    sink = n;
+}
+
+/*
+ * Command encoding of MPSSE adapter, by mpsse_encode().
+ * Flush of the output buffer only resets it.
+ */
+static unsigned char mpsse_output [256*16];
+static int mpsse_bytes_to_write;
+
+static void mpsse_send(unsigned tms_prolog_nbits, unsigned tms_prolog,
+    unsigned tdi_nbits, unsigned long long tdi, int read_flag)
+{
+    mpsse_reply_t reply;
+
+    if (mpsse_bytes_to_write > sizeof(mpsse_output) - MPSSE_PACKET_MAX)
+        mpsse_bytes_to_write = 0;
+    mpsse_bytes_to_write += mpsse_encode(mpsse_output + mpsse_bytes_to_write,
+        tms_prolog_nbits, tms_prolog, tdi_nbits, tdi, read_flag, &reply);
+}
+
+/*
+ * Row programming through PE, as send_row() does it.
+ */
+static void mpsse_rows(unsigned nbytes, unsigned row_size)
+{
+    unsigned addr, i, words_per_row = row_size / 4;
+    unsigned *data = (unsigned*) payload;
+
+    mpsse_bytes_to_write = 0;
+    for (addr=0; addr<nbytes; addr+=row_size) {
+        mpsse_send(1, 1, 5, ETAP_FASTDATA, 0);
+        mpsse_send(0, 0, 33, (unsigned long long) (PE_ROW_PROGRAM << 16 | words_per_row) << 1, 1);
+        mpsse_send(0, 0, 33, (unsigned long long) (0x1d000000 + addr) << 1, 1);
+        for (i=0; i<words_per_row; i++)
+            mpsse_send(0, 0, 33, (unsigned long long) *data++ << 1, 1);
+    }
+    sink = mpsse_bytes_to_write;
+}
+
+/*
+ * ASCII encoding of bitbang adapter, by bitbang_encode(),
+ * with 4-bit packing and no read.
+ */
+static unsigned char bitbang_output [1024];
+static int bitbang_index;
+
+static void bitbang_send(unsigned tms_nbits, unsigned tms,
+    unsigned tdi_nbits, unsigned long long tdi)
+{
+    bitbang_count_t c;
+
+    if (bitbang_index + BITBANG_PACKET_MAX > sizeof(bitbang_output))
+        bitbang_index = 0;
+    bitbang_index += bitbang_encode(bitbang_output + bitbang_index,
+        tms_nbits, tms, tdi_nbits, tdi, 0, 1, 0, &c);
+}
+
+static void bitbang_rows(unsigned nbytes, unsigned row_size)
+{
+    unsigned addr, i, words_per_row = row_size / 4;
+    unsigned *data = (unsigned*) payload;
+
+    bitbang_index = 0;
+    for (addr=0; addr<nbytes; addr+=row_size) {
+        bitbang_send(1, 1, 5, ETAP_FASTDATA);
+        bitbang_send(0, 0, 33, (unsigned long long) (PE_ROW_PROGRAM << 16 | words_per_row) << 1);
+        bitbang_send(0, 0, 33, (unsigned long long) (0x1d000000 + addr) << 1);
+        for (i=0; i<words_per_row; i++)
+            bitbang_send(0, 0, 33, (unsigned long long) *data++ << 1);
+    }
+    sink = bitbang_index;
+}
+
+/*
+ * Framing of AN1388 bootloader: program_flash() and an1388_command()
+ * from adapters/adapter-an1388.c, for 32-byte data records.
+ */
+#define FRAME_SOH       0x01
+#define FRAME_EOT       0x04
+#define FRAME_DLE       0x10
+
+static inline unsigned add_byte(unsigned char c,
+    unsigned char *buf, unsigned indx)
+{
+    if (c == FRAME_EOT || c == FRAME_SOH || c == FRAME_DLE)
+        buf[indx++] = FRAME_DLE;
+    buf[indx++] = c;
+    return indx;
+}
+
+static unsigned an1388_frame(unsigned char cmd, unsigned char *data,
+    unsigned data_len, unsigned char *buf)
+{
+    unsigned i, crc, n = 0;
+
+    memset(buf, FRAME_EOT, 128);
+    buf[n++] = FRAME_SOH;
+    n = add_byte(cmd, buf, n);
+    crc = crc16(0, &cmd, 1);
+    for (i=0; i<data_len; ++i)
+        n = add_byte(data[i], buf, n);
+    crc = crc16(crc, data, data_len);
+    n = add_byte(crc, buf, n);
+    n = add_byte(crc >> 8, buf, n);
+    buf[n++] = FRAME_EOT;
+    return n;
+}
+
+static void an1388_records(unsigned nbytes, unsigned row_size)
+{
+    unsigned char request [64], buf [128];
+    unsigned addr, sum, i, total = 0;
+
+    for (addr=0; addr<nbytes; addr+=32) {
+        request[0] = 32;
+        request[1] = addr >> 8;
+        request[2] = addr;
+        request[3] = 0;
+        memcpy(request+4, payload + addr, 32);
+        sum = 0;
+        for (i=0; i<32+4; i++)
+            sum += request[i];
+        request[32+4] = -sum;
+        total += an1388_frame(3, request, 32 + 5, buf);
+    }
+    sink = total;
+}
+
+/*
+ * Host-side work per byte of image, for every family row size.
+ */
+static void bench_host(void)
+{
+    unsigned i, k;
+
+    memset(erased, 0xff, sizeof(erased));
+    for (i=0; i<NSIZES; i++) {
+        run_bench("store-legacy", 0, store_legacy, sizes[i]);
+        for (k=0; k<NROWS; k++)
+            run_bench("store-image", row_sizes[k], store_image, sizes[i]);
+        for (k=0; k<NROWS; k++)
+            run_bench("crc-table", row_sizes[k], crc_table, sizes[i]);
+        for (k=0; k<NROWS; k++)
+            run_bench("test-empty", row_sizes[k], empty_block, sizes[i]);
+        for (k=0; k<NROWS; k++)
+            run_bench("mpsse-send", row_sizes[k], mpsse_rows, sizes[i]);
+        for (k=0; k<NROWS; k++)
+            run_bench("bitbang-send", row_sizes[k], bitbang_rows, sizes[i]);
+        run_bench("an1388-frame", 0, an1388_records, sizes[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *tmpdir = getenv("TMPDIR");
+
+    snprintf(tmpname, sizeof(tmpname), "%s/pic32bench-%d.tmp",
+        tmpdir ? tmpdir : "/tmp", (int) getpid());
+
+    make_payload(payload, IMAGE_MAX);
+    bench_loader();
+    bench_host();
+
+    unlink(tmpname);
+    return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Cache of images, programmed into target devices,
+ * and of JTAG clock rates, tuned for adapters.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef MINGW32
+#   include <sys/file.h>
+#endif
+
+#include "cache.h"
+#include "localize.h"
+#include "fatal.h"
+
+/*
+ * Keep this number of most recently used entries.
+ */
+#define MAX_ENTRIES     256
+#define MAX_CLOCKS      32
+
+static const char *default_filename(void)
+{
+    static char buf [1024];
+    const char *name, *home;
+
+    name = getenv("PIC32PROG_CACHE_FILE");
+    if (name)
+        return name;
+#if defined(__CYGWIN32__) || defined(MINGW32)
+    home = getenv("USERPROFILE");
+#else
+    home = getenv("HOME");
+#endif
+    if (! home)
+        return "pic32prog.cache";
+    snprintf(buf, sizeof(buf), "%s/.pic32prog-cache", home);
+    return buf;
+}
+
+static void cache_append(cache_t *c, const cache_entry_t *entry)
+{
+    if (c->nentries == MAX_ENTRIES) {
+        /* Drop the oldest entry. */
+        memmove(&c->entry[0], &c->entry[1],
+            (MAX_ENTRIES - 1) * sizeof(cache_entry_t));
+        c->nentries--;
+    }
+    c->entry[c->nentries++] = *entry;
+}
+
+static void clock_append(cache_t *c, const cache_clock_t *clock)
+{
+    if (c->nclocks == MAX_CLOCKS) {
+        /* Drop the oldest entry. */
+        memmove(&c->clock[0], &c->clock[1],
+            (MAX_CLOCKS - 1) * sizeof(cache_clock_t));
+        c->nclocks--;
+    }
+    c->clock[c->nclocks++] = *clock;
+}
+
+static cache_clock_t *clock_find(cache_t *c, const char *serial, unsigned cpuid)
+{
+    unsigned i;
+
+    for (i=0; i<c->nclocks; i++) {
+        if (c->clock[i].cpuid == cpuid && strcmp(c->clock[i].serial, serial) == 0)
+            return &c->clock[i];
+    }
+    return 0;
+}
+
+void cache_load(cache_t *c, const char *filename)
+{
+    char line [256];
+    cache_entry_t e;
+    cache_clock_t k;
+    FILE *fd;
+
+    memset(c, 0, sizeof(*c));
+    c->filename = filename ? filename : default_filename();
+    c->entry = malloc(MAX_ENTRIES * sizeof(cache_entry_t));
+    c->clock = malloc(MAX_CLOCKS * sizeof(cache_clock_t));
+    if (! c->entry || ! c->clock) {
+        fprintf(stderr, _("Out of memory\n"));
+        exit(1);
+    }
+
+    fd = fopen(c->filename, "r");
+    if (! fd) {
+        /* No cache yet: that's OK. */
+        return;
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "stats %u %u %lu",
+            &c->hits, &c->misses, &c->saved_msec) == 3)
+            continue;
+        memset(&k, 0, sizeof(k));
+        if (sscanf(line, "clock %31s %x %u", k.serial, &k.cpuid, &k.khz) == 3) {
+            clock_append(c, &k);
+            continue;
+        }
+        memset(&e, 0, sizeof(e));
+        if (sscanf(line, "%x %llx %x %x %x %x %x %x %u",
+            &e.cpuid, &e.hash,
+            &e.flash.base, &e.flash.nbytes, &e.flash.crc,
+            &e.boot.base, &e.boot.nbytes, &e.boot.crc, &e.msec) == 9)
+            cache_append(c, &e);
+    }
+    fclose(fd);
+    c->loaded_hits = c->hits;
+    c->loaded_misses = c->misses;
+    c->loaded_msec = c->saved_msec;
+}
+
+cache_entry_t *cache_find(cache_t *c, unsigned cpuid, unsigned long long hash)
+{
+    unsigned i;
+
+    for (i=0; i<c->nentries; i++) {
+        if (c->entry[i].cpuid == cpuid && c->entry[i].hash == hash)
+            return &c->entry[i];
+    }
+    return 0;
+}
+
+void cache_add(cache_t *c, const cache_entry_t *entry)
+{
+    cache_entry_t *e = cache_find(c, entry->cpuid, entry->hash);
+
+    if (e) {
+        /* Move to the end, as most recently used. */
+        memmove(e, e + 1, (&c->entry[c->nentries] - (e + 1)) * sizeof(*e));
+        c->nentries--;
+    }
+    cache_append(c, entry);
+}
+
+unsigned cache_find_clock(cache_t *c, const char *serial, unsigned cpuid)
+{
+    cache_clock_t *k = clock_find(c, serial, cpuid);
+
+    return k ? k->khz : 0;
+}
+
+void cache_set_clock(cache_t *c, const char *serial, unsigned cpuid, unsigned khz)
+{
+    cache_clock_t *k = clock_find(c, serial, cpuid);
+    cache_clock_t clock;
+
+    if (k) {
+        memmove(k, k + 1, (&c->clock[c->nclocks] - (k + 1)) * sizeof(*k));
+        c->nclocks--;
+    }
+
+    /* Removed entry is kept with zero rate till the file is saved,
+     * so that it is removed from the file too. */
+    memset(&clock, 0, sizeof(clock));
+    strncpy(clock.serial, serial, sizeof(clock.serial) - 1);
+    clock.cpuid = cpuid;
+    clock.khz = khz;
+    clock_append(c, &clock);
+}
+
+/*
+ * Put the entries from memory over the file contents: other sessions
+ * may have added their entries since the file was read.
+ */
+static void cache_merge(cache_t *c, cache_t *disk)
+{
+    cache_entry_t *entry;
+    cache_clock_t *clock;
+    unsigned i;
+
+    for (i=0; i<c->nentries; i++)
+        cache_add(disk, &c->entry[i]);
+    for (i=0; i<c->nclocks; i++)
+        cache_set_clock(disk, c->clock[i].serial, c->clock[i].cpuid,
+            c->clock[i].khz);
+    c->hits += disk->hits - c->loaded_hits;
+    c->misses += disk->misses - c->loaded_misses;
+    c->saved_msec += disk->saved_msec - c->loaded_msec;
+
+    /* Exchange the lists: the old ones go away with the disk copy. */
+    entry = c->entry;
+    c->entry = disk->entry;
+    disk->entry = entry;
+    c->nentries = disk->nentries;
+    clock = c->clock;
+    c->clock = disk->clock;
+    disk->clock = clock;
+    c->nclocks = disk->nclocks;
+}
+
+static void write_entries(cache_t *c, FILE *fd)
+{
+    cache_entry_t *e;
+    unsigned i;
+
+    fprintf(fd, "# pic32prog cache: cpuid hash flash-base flash-bytes flash-crc boot-base boot-bytes boot-crc msec\n");
+    fprintf(fd, "# clock adapter-serial cpuid khz\n");
+    fprintf(fd, "stats %u %u %lu\n", c->hits, c->misses, c->saved_msec);
+    for (i=0; i<c->nentries; i++) {
+        e = &c->entry[i];
+        fprintf(fd, "%08x %016llx %08x %x %04x %08x %x %04x %u\n",
+            e->cpuid, e->hash,
+            e->flash.base, e->flash.nbytes, e->flash.crc,
+            e->boot.base, e->boot.nbytes, e->boot.crc, e->msec);
+    }
+    for (i=0; i<c->nclocks; i++)
+        if (c->clock[i].khz != 0)
+            fprintf(fd, "clock %s %08x %u\n",
+                c->clock[i].serial, c->clock[i].cpuid, c->clock[i].khz);
+}
+
+void cache_save(cache_t *c)
+{
+    char tmpname [1024], lockname [1024];
+    cache_t disk;
+    FILE *fd;
+    int lock;
+
+    /* Sessions of gang programming save the file at the same time. */
+    snprintf(lockname, sizeof(lockname), "%s.lock", c->filename);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", c->filename);
+    lock = open(lockname, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) {
+        perror(lockname);
+        return;
+    }
+#ifndef MINGW32
+    if (flock(lock, LOCK_EX) < 0) {
+        perror(lockname);
+        close(lock);
+        return;
+    }
+#endif
+    cache_load(&disk, c->filename);
+    cache_merge(c, &disk);
+    cache_free(&disk);
+
+    /* Readers see either the old file or the new one. */
+    fd = fopen(tmpname, "w");
+    if (! fd) {
+        perror(tmpname);
+        goto done;
+    }
+    write_entries(c, fd);
+    if (fclose(fd) != 0) {
+        perror(tmpname);
+        remove(tmpname);
+        goto done;
+    }
+#ifdef MINGW32
+    remove(c->filename);
+#endif
+    if (rename(tmpname, c->filename) != 0) {
+        perror(c->filename);
+        remove(tmpname);
+    }
+done:
+    /* Closing the file releases the lock. */
+    close(lock);
+}
+
+void cache_free(cache_t *c)
+{
+    free(c->entry);
+    free(c->clock);
+    c->entry = 0;
+    c->nentries = 0;
+    c->clock = 0;
+    c->nclocks = 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Capture of adapter transfers into a file, and replay from it.
+ *
+ * File starts with the magic "P32CAP", version and a reserved byte.
+ * Every record is:
+ *      kind        - byte: transport type, read and open flags
+ *      time        - varint: microseconds since the previous record
+ *      result      - zigzag varint: bytes, 0 on timeout, negative on error
+ *      data        - bytes of the transfer, or name of the opened device
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "report.h"
+#include "console.h"
+#include "localize.h"
+#include "adapter.h"
+
+#define MAGIC           "P32CAP\1"      /* Version 1 */
+#define MAGIC_LEN       8
+
+/* Kind of record. */
+#define KIND_TYPE       0x07            /* Transport type */
+#define KIND_READ       0x08            /* Read transfer */
+#define KIND_OPEN       0x10            /* Device opened */
+
+typedef struct {
+    int             kind;
+    unsigned long long usec;            /* Time since the previous record */
+    int             result;
+    unsigned char   *data;
+    unsigned        size;               /* Allocated size of data */
+} record_t;
+
+int capture_replaying;
+int capture_recording;
+
+static FILE *capture_fd;
+static const char *capture_name;
+static unsigned long long start;        /* Start of recording or replay */
+static unsigned long long last_usec;    /* Time of the previous record */
+static record_t next;                   /* Lookahead record of replay */
+static int next_valid;
+static unsigned long nrecords;          /* Replayed records */
+static unsigned long long recorded_usec;
+static unsigned long nmismatch;         /* Writes, which differ */
+
+static void put_varint(unsigned long long value)
+{
+    while (value >= 0x80) {
+        putc((value & 0x7f) | 0x80, capture_fd);
+        value >>= 7;
+    }
+    putc(value, capture_fd);
+}
+
+static int get_varint(unsigned long long *value)
+{
+    int c, shift = 0;
+
+    *value = 0;
+    do {
+        c = getc(capture_fd);
+        if (c == EOF || shift > 63)
+            return 0;
+        *value |= (unsigned long long) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+static void put_record(int kind, const unsigned char *data, int result)
+{
+    unsigned long long usec = (report_clock() - start) / 1000;
+
+    putc(kind, capture_fd);
+    put_varint(usec - last_usec);
+    put_varint(((unsigned) result << 1) ^ (unsigned) (result >> 31));
+    if (result > 0)
+        fwrite(data, 1, result, capture_fd);
+    last_usec = usec;
+}
+
+/*
+ * Get the next record of replay, without consuming it.
+ * Return 0 at end of file.
+ */
+static record_t *peek(void)
+{
+    unsigned long long zigzag;
+    int c;
+
+    if (next_valid)
+        return &next;
+    c = getc(capture_fd);
+    if (c == EOF)
+        return 0;
+    next.kind = c;
+    if (! get_varint(&next.usec) || ! get_varint(&zigzag))
+        goto corrupted;
+    next.result = (int) (zigzag >> 1) ^ -(int) (zigzag & 1);
+    if (next.result > 0) {
+        if (next.result > next.size) {
+            next.size = next.result;
+            next.data = realloc(next.data, next.size);
+            if (! next.data) {
+                fprintf(stderr, _("Out of memory\n"));
+                exit(-1);
+            }
+        }
+        if (fread(next.data, 1, next.result, capture_fd) != next.result)
+            goto corrupted;
+    }
+    next_valid = 1;
+    return &next;
+
+corrupted:
+    fprintf(stderr, _("%s: Capture file is truncated\n"), capture_name);
+    exit(-1);
+}
+
+static void consume(void)
+{
+    next_valid = 0;
+    nrecords++;
+    recorded_usec += next.usec;
+}
+
+static void diverged(const char *reason)
+{
+    fprintf(stderr, _("\nReplay diverged at record %lu: %s\n"),
+        nrecords + 1, reason);
+    exit(-1);
+}
+
+static void capture_close(void)
+{
+    if (capture_replaying) {
+        conprintf(_("       Replay: %lu records, recorded in %llu msec, replayed in %llu msec\n"),
+            nrecords, recorded_usec / 1000, (report_clock() - start) / 1000000);
+        if (nmismatch > 0)
+            conprintf(_("       Replay: %lu writes differ from the capture\n"),
+                nmismatch);
+    }
+    fclose(capture_fd);
+    capture_fd = 0;
+}
+
+static void open_file(const char *filename, const char *mode)
+{
+    capture_fd = fopen(filename, mode);
+    if (! capture_fd) {
+        perror(filename);
+        exit(1);
+    }
+    capture_name = filename;
+    start = report_clock();
+    atexit(capture_close);
+}
+
+void capture_record(const char *filename)
+{
+    open_file(filename, "wb");
+    fwrite(MAGIC, 1, MAGIC_LEN, capture_fd);
+    capture_recording = 1;
+}
+
+void capture_replay(const char *filename)
+{
+    char magic [MAGIC_LEN];
+
+    open_file(filename, "rb");
+    if (fread(magic, 1, MAGIC_LEN, capture_fd) != MAGIC_LEN ||
+        memcmp(magic, MAGIC, MAGIC_LEN) != 0) {
+        fprintf(stderr, _("%s: Not a capture file\n"), filename);
+        exit(1);
+    }
+    capture_replaying = 1;
+}
+
+int capture_open(int type, const char *name)
+{
+    record_t *r;
+
+    if (capture_recording) {
+        put_record(KIND_OPEN | type, (const unsigned char*) name, strlen(name));
+        return 1;
+    }
+    if (! capture_replaying)
+        return 1;
+
+    r = peek();
+    if (! r || ! (r->kind & KIND_OPEN) || (r->kind & KIND_TYPE) != type)
+        return 0;
+    if (name && (r->result != strlen(name) ||
+                 memcmp(r->data, name, r->result) != 0))
+        return 0;
+    consume();
+    return 1;
+}
+
+void capture_transfer(int type, int is_read, const unsigned char *data, int result)
+{
+    if (! capture_recording)
+        return;
+    put_record(type | (is_read ? KIND_READ : 0), data, result);
+}
+
+int capture_replay_transfer(int type, int is_read, unsigned char *data, int nbytes)
+{
+    record_t *r = peek();
+
+    if (! r)
+        diverged(_("end of capture"));
+    if ((r->kind & KIND_OPEN) || (r->kind & KIND_TYPE) != type ||
+        ! (r->kind & KIND_READ) != ! is_read)
+        diverged(is_read ? _("unexpected read") : _("unexpected write"));
+
+    if (is_read) {
+        if (r->result > nbytes)
+            diverged(_("reply does not fit the buffer"));
+        if (r->result > 0)
+            memcpy(data, r->data, r->result);
+    } else if (r->result > 0 &&
+        (r->result != nbytes || memcmp(data, r->data, nbytes) != 0)) {
+        if (nmismatch++ == 0 || debug_level > 0)
+            fprintf(stderr, _("Replay: record %lu, written data differ from the capture\n"),
+                nrecords + 1);
+    }
+    consume();
+    return r->result;
+}
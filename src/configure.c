@@ -15,6 +15,7 @@
 #include <ctype.h>
 #include "target.h"
 #include "console.h"
+#include "fatal.h"
 
 static const char *confname;
 static char *bufr;
@@ -0,0 +1,123 @@
+/*
+ * Precompiled image container.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "localize.h"
+#include "fatal.h"
+
+#define BOOTP_BASE      0x1fc00000
+
+static inline void put32(unsigned char *p, unsigned val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+static inline unsigned get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static void write_error(const char *filename, FILE *fd)
+{
+    perror(filename);
+    fclose(fd);
+    unlink(filename);
+    exit(1);
+}
+
+void container_write(const char *filename, const image_t *img,
+    const family_t *family, unsigned nbytes)
+{
+    unsigned char hdr [CONTAINER_HDRSZ], entry [8];
+    unsigned addr, nrows, i;
+    FILE *fd;
+
+    fd = fopen(filename, "wb");
+    if (! fd) {
+        perror(filename);
+        exit(1);
+    }
+    nrows = image_nrows(img, 0, 0xffffffff);
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, CONTAINER_MAGIC, 8);
+    put32(hdr + 8, CONTAINER_VERSION);
+    put32(hdr + 12, img->row_size);
+    put32(hdr + 16, nrows);
+    put32(hdr + 20, nbytes);
+    put32(hdr + 24, family->devcfg_offset);
+    for (i=0; i<4; i++)
+        put32(hdr + 28 + i*4, image_read_word(img,
+            BOOTP_BASE + family->devcfg_offset + i*4));
+    strncpy((char*) hdr + 44, family->name, 16);
+    if (fwrite(hdr, 1, sizeof(hdr), fd) != sizeof(hdr))
+        write_error(filename, fd);
+
+    /* Table of rows. */
+    for (addr=0; image_next_row(img, &addr, 0xffffffff); addr+=img->row_size) {
+        put32(entry, addr);
+        put32(entry + 4, image_row_crc(img, addr));
+        if (fwrite(entry, 1, sizeof(entry), fd) != sizeof(entry))
+            write_error(filename, fd);
+    }
+
+    /* Contents of rows. */
+    for (addr=0; image_next_row(img, &addr, 0xffffffff); addr+=img->row_size) {
+        if (fwrite(image_row(img, addr), 1, img->row_size, fd) != img->row_size)
+            write_error(filename, fd);
+    }
+    if (fclose(fd) != 0) {
+        perror(filename);
+        exit(1);
+    }
+}
+
+int container_load(const char *filename, const loader_file_t *file,
+    image_t *img, loader_store_t *store, void *arg, unsigned *nbytes)
+{
+    const unsigned char *hdr = file->data;
+    const unsigned char *table, *data;
+    unsigned row_size, nrows, addr, i;
+
+    if (file->size < CONTAINER_HDRSZ || memcmp(hdr, CONTAINER_MAGIC, 8) != 0)
+        return 0;
+    if (get32(hdr + 8) != CONTAINER_VERSION) {
+        fprintf(stderr, _("%s: unsupported container version %u\n"),
+            filename, get32(hdr + 8));
+        exit(1);
+    }
+    row_size = get32(hdr + 12);
+    nrows = get32(hdr + 16);
+    if (row_size == 0 || (row_size & 3) ||
+        nrows > (file->size - CONTAINER_HDRSZ) / (8 + row_size)) {
+        fprintf(stderr, _("%s: corrupted container\n"), filename);
+        exit(1);
+    }
+    table = hdr + CONTAINER_HDRSZ;
+    data = table + nrows * 8;
+
+    for (i=0; i<nrows; i++) {
+        addr = get32(table + i*8);
+        (*store)(arg, addr, data + i*row_size, row_size);
+
+        /* Keep the checksum when row sizes match. */
+        if (row_size == img->row_size)
+            image_set_row_crc(img, addr, get32(table + i*8 + 4));
+    }
+    *nbytes = get32(hdr + 20);
+    return 1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Handling of fatal errors.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+
+#include "fatal.h"
+#include "config.h"
+
+#undef exit
+
+#ifdef HAVE_PTHREAD
+static __thread jmp_buf *catch_env;
+#else
+static jmp_buf *catch_env;
+#endif
+
+jmp_buf *fatal_catch(jmp_buf *env)
+{
+    jmp_buf *old = catch_env;
+
+    catch_env = env;
+    return old;
+}
+
+void pic32_exit(int status)
+{
+    jmp_buf *env = catch_env;
+
+    if (! env) {
+        exit(status);
+    }
+    fflush(stdout);
+    catch_env = 0;
+    longjmp(*env, status ? status : -1);
+}
@@ -0,0 +1,383 @@
+/*
+ * Sparse image of flash memory contents.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "crc16.h"
+#include "localize.h"
+#include "fatal.h"
+
+/*
+ * Extents separated by no more than this number of rows
+ * are merged together.
+ */
+#define MERGE_GAP       8
+
+#define BITS            (8 * sizeof(unsigned))
+
+#define CRC_UNKNOWN     0xffffffff
+
+static void *xrealloc(void *ptr, size_t nbytes)
+{
+    ptr = realloc(ptr, nbytes);
+    if (! ptr) {
+        fprintf(stderr, _("Out of memory\n"));
+        exit(1);
+    }
+    return ptr;
+}
+
+static inline int row_is_dirty(const extent_t *e, unsigned row)
+{
+    return (e->dirty[row / BITS] >> (row % BITS)) & 1;
+}
+
+static inline void row_set_dirty(extent_t *e, unsigned row)
+{
+    e->dirty[row / BITS] |= 1u << (row % BITS);
+}
+
+void image_init(image_t *img, unsigned row_size)
+{
+    memset(img, 0, sizeof(*img));
+    img->row_size = row_size;
+}
+
+void image_free(image_t *img)
+{
+    unsigned i;
+
+    for (i=0; i<img->nextents; i++) {
+        free(img->extent[i].data);
+        free(img->extent[i].dirty);
+        free(img->extent[i].crc);
+    }
+    free(img->extent);
+    image_init(img, img->row_size);
+}
+
+/*
+ * Make sure the extent has space for the given number of bytes.
+ * New space is filled with 0xff and marked as clean.
+ */
+static void extent_grow(image_t *img, extent_t *e, unsigned nbytes)
+{
+    unsigned nalloc, old_words, new_words, old_rows, new_rows;
+
+    if (nbytes > e->nalloc) {
+        nalloc = e->nalloc * 2;
+        if (nalloc < nbytes)
+            nalloc = nbytes;
+        old_words = (e->nalloc / img->row_size + BITS - 1) / BITS;
+        new_words = (nalloc / img->row_size + BITS - 1) / BITS;
+
+        e->data = xrealloc(e->data, nalloc);
+        memset(e->data + e->nalloc, 0xff, nalloc - e->nalloc);
+        e->dirty = xrealloc(e->dirty, new_words * sizeof(unsigned));
+        memset(e->dirty + old_words, 0, (new_words - old_words) * sizeof(unsigned));
+
+        old_rows = e->nalloc / img->row_size;
+        new_rows = nalloc / img->row_size;
+        e->crc = xrealloc(e->crc, new_rows * sizeof(unsigned));
+        memset(e->crc + old_rows, 0xff, (new_rows - old_rows) * sizeof(unsigned));
+        e->nalloc = nalloc;
+    }
+    e->nbytes = nbytes;
+}
+
+/*
+ * Find extent which contains the address.
+ * Return index of extent, or -1 when not found.
+ */
+static int image_find(const image_t *img, unsigned addr)
+{
+    const extent_t *e;
+    unsigned lo, hi, mid;
+
+    if (img->nextents > 0) {
+        e = &img->extent[img->last];
+        if (addr >= e->base && addr - e->base < e->nbytes)
+            return img->last;
+    }
+    lo = 0;
+    hi = img->nextents;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        e = &img->extent[mid];
+        if (addr < e->base)
+            hi = mid;
+        else if (addr - e->base >= e->nbytes)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+/*
+ * Get an extent which covers the given range of rows.
+ * Neighbouring extents are merged.
+ */
+static extent_t *image_extent(image_t *img, unsigned start, unsigned end)
+{
+    unsigned gap = MERGE_GAP * img->row_size;
+    unsigned first, last, lo, hi, mid, i, row, nrows;
+    unsigned nbase, nend;
+    extent_t *e, merged;
+
+    /* Files are mostly sorted: try the last used extent first. */
+    if (img->nextents > 0) {
+        e = &img->extent[img->last];
+        if (start >= e->base && end <= e->base + e->nbytes)
+            return e;
+    }
+
+    /* Find the first extent which ends near or after the start. */
+    lo = 0;
+    hi = img->nextents;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        e = &img->extent[mid];
+        if (e->base + e->nbytes + gap < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+    for (last=first; last<img->nextents; last++) {
+        if (img->extent[last].base > end + gap)
+            break;
+    }
+
+    if (first == last) {
+        /* No neighbours: insert a new extent. */
+        if (img->nextents == img->maxextents) {
+            img->maxextents = img->maxextents ? img->maxextents * 2 : 16;
+            img->extent = xrealloc(img->extent,
+                img->maxextents * sizeof(extent_t));
+        }
+        memmove(&img->extent[first+1], &img->extent[first],
+            (img->nextents - first) * sizeof(extent_t));
+        img->nextents++;
+
+        e = &img->extent[first];
+        memset(e, 0, sizeof(*e));
+        e->base = start;
+        extent_grow(img, e, end - start);
+        img->last = first;
+        return e;
+    }
+
+    e = &img->extent[first];
+    nend = img->extent[last-1].base + img->extent[last-1].nbytes;
+    if (nend < end)
+        nend = end;
+    if (last == first + 1 && e->base <= start) {
+        /* Append to a single extent. */
+        extent_grow(img, e, nend - e->base);
+        img->last = first;
+        return e;
+    }
+
+    /* Merge several extents into one. */
+    nbase = (start < e->base) ? start : e->base;
+    memset(&merged, 0, sizeof(merged));
+    merged.base = nbase;
+    extent_grow(img, &merged, nend - nbase);
+    for (i=first; i<last; i++) {
+        e = &img->extent[i];
+        memcpy(merged.data + (e->base - nbase), e->data, e->nbytes);
+        nrows = e->nbytes / img->row_size;
+        for (row=0; row<nrows; row++) {
+            if (row_is_dirty(e, row))
+                row_set_dirty(&merged, row + (e->base - nbase) / img->row_size);
+        }
+        memcpy(merged.crc + (e->base - nbase) / img->row_size, e->crc,
+            nrows * sizeof(unsigned));
+        free(e->data);
+        free(e->dirty);
+        free(e->crc);
+    }
+    img->extent[first] = merged;
+    memmove(&img->extent[first+1], &img->extent[last],
+        (img->nextents - last) * sizeof(extent_t));
+    img->nextents -= last - first - 1;
+    img->last = first;
+    return &img->extent[first];
+}
+
+void image_write(image_t *img, unsigned addr, const void *data, unsigned nbytes)
+{
+    unsigned mask = img->row_size - 1;
+    unsigned row, last_row;
+    extent_t *e;
+
+    if (nbytes == 0)
+        return;
+    e = image_extent(img, addr & ~mask, (addr + nbytes + mask) & ~mask);
+    memcpy(e->data + (addr - e->base), data, nbytes);
+
+    last_row = (addr + nbytes - 1 - e->base) / img->row_size;
+    for (row=(addr - e->base) / img->row_size; row<=last_row; row++) {
+        row_set_dirty(e, row);
+        e->crc[row] = CRC_UNKNOWN;
+    }
+}
+
+const unsigned char *image_data(const image_t *img, unsigned addr)
+{
+    int i = image_find(img, addr);
+
+    if (i < 0)
+        return 0;
+    return img->extent[i].data + (addr - img->extent[i].base);
+}
+
+unsigned char *image_row(const image_t *img, unsigned addr)
+{
+    const extent_t *e;
+    unsigned row;
+    int i = image_find(img, addr);
+
+    if (i < 0)
+        return 0;
+    e = &img->extent[i];
+    row = (addr - e->base) / img->row_size;
+    if (! row_is_dirty(e, row))
+        return 0;
+    return e->data + row * img->row_size;
+}
+
+unsigned image_read_word(const image_t *img, unsigned addr)
+{
+    const unsigned char *p = image_data(img, addr);
+    unsigned word;
+
+    if (! p)
+        return 0xffffffff;
+    memcpy(&word, p, 4);
+    return word;
+}
+
+int image_next_row(const image_t *img, unsigned *addr, unsigned limit)
+{
+    const extent_t *e;
+    unsigned i, row, nrows, word;
+
+    for (i=0; i<img->nextents; i++) {
+        e = &img->extent[i];
+        if (e->base + e->nbytes <= *addr)
+            continue;
+        if (e->base >= limit)
+            break;
+
+        row = (*addr > e->base) ? (*addr - e->base) / img->row_size : 0;
+        nrows = e->nbytes / img->row_size;
+        while (row < nrows) {
+            word = e->dirty[row / BITS] >> (row % BITS);
+            if (word == 0) {
+                /* Skip to next bitmap word. */
+                row = (row / BITS + 1) * BITS;
+                continue;
+            }
+            while (! (word & 1)) {
+                word >>= 1;
+                row++;
+            }
+            if (e->base + row * img->row_size >= limit)
+                return 0;
+            *addr = e->base + row * img->row_size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned image_nrows(const image_t *img, unsigned start, unsigned limit)
+{
+    unsigned addr, n = 0;
+
+    for (addr=start; image_next_row(img, &addr, limit); addr+=img->row_size)
+        n++;
+    return n;
+}
+
+unsigned image_row_crc(const image_t *img, unsigned addr)
+{
+    extent_t *e;
+    unsigned row;
+    int i = image_find(img, addr);
+
+    if (i < 0) {
+        /* No data: compute checksum of erased row. */
+        unsigned char blank [img->row_size];
+
+        memset(blank, 0xff, img->row_size);
+        return crc16(CRC16_PE_SEED, blank, img->row_size);
+    }
+    e = &img->extent[i];
+    row = (addr - e->base) / img->row_size;
+    if (e->crc[row] == CRC_UNKNOWN)
+        e->crc[row] = crc16(CRC16_PE_SEED, e->data + row * img->row_size,
+            img->row_size);
+    return e->crc[row];
+}
+
+void image_set_row_crc(image_t *img, unsigned addr, unsigned crc)
+{
+    extent_t *e;
+    int i = image_find(img, addr);
+
+    if (i < 0)
+        return;
+    e = &img->extent[i];
+    e->crc[(addr - e->base) / img->row_size] = crc & 0xffff;
+}
+
+unsigned long long image_hash(const image_t *img)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    unsigned addr, i;
+
+    /* FNV-1a over addresses and contents of dirty rows. */
+    for (addr=0; image_next_row(img, &addr, 0xffffffff); addr+=img->row_size) {
+        for (i=0; i<32; i+=8)
+            hash = (hash ^ ((addr >> i) & 0xff)) * 0x100000001b3ULL;
+        p = image_data(img, addr);
+        for (i=0; i<img->row_size; i++)
+            hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void image_set_row_size(image_t *img, unsigned row_size)
+{
+    image_t new;
+    extent_t *e;
+    unsigned i, row, nrows;
+
+    if (row_size == img->row_size)
+        return;
+    image_init(&new, row_size);
+    for (i=0; i<img->nextents; i++) {
+        e = &img->extent[i];
+        nrows = e->nbytes / img->row_size;
+        for (row=0; row<nrows; row++) {
+            if (row_is_dirty(e, row))
+                image_write(&new, e->base + row * img->row_size,
+                    e->data + row * img->row_size, img->row_size);
+        }
+    }
+    image_free(img);
+    *img = new;
+}
@@ -14,12 +14,37 @@
 
 #include <stdarg.h>
 
+#include "fatal.h"
+
 #define AD_READ  0x0001
 #define AD_WRITE 0x0002
 #define AD_ERASE 0x0004
 #define AD_PROBE 0x0008
 
 typedef struct _adapter_t adapter_t;
+typedef struct _adapter_req_t adapter_req_t;
+
+/*
+ * Request for the adapter command queue.
+ * The done() callback is invoked when the request completes,
+ * at the latest from sync(). The request must stay valid until then.
+ * Adapters keep at most AQ_DEPTH requests in flight:
+ * submit() waits for completion of older ones.
+ */
+#define AQ_PROGRAM_ROW  1               /* Program a row of flash memory */
+#define AQ_GET_CRC      2               /* Get checksum of nwords */
+
+#define AQ_DEPTH        2
+
+struct _adapter_req_t {
+    int op;
+    unsigned addr;                      /* Physical address */
+    unsigned nwords;
+    unsigned *data;                     /* Data for AQ_PROGRAM_ROW */
+    unsigned result;                    /* Checksum for AQ_GET_CRC */
+    void (*done)(adapter_req_t *req);
+    void *arg;
+};
 
 struct _adapter_t {
     unsigned user_start;                /* Start address of user area */
@@ -29,6 +54,7 @@ struct _adapter_t {
     unsigned block_override;            /* Overridden block size for target */
 
     unsigned flags;
+    const char *name;                   /* Type of adapter */
     const char *family_name;            /* Name of pic32 family */
 
     void (*close)(adapter_t *a, int power_on);
@@ -37,6 +63,7 @@ struct _adapter_t {
         const unsigned *pe, unsigned nwords, unsigned pe_version);
     void (*read_data)(adapter_t *a, unsigned addr, unsigned nwords, unsigned *data);
     void (*verify_data)(adapter_t *a, unsigned addr, unsigned nwords, unsigned *data);
+    unsigned (*get_crc)(adapter_t *a, unsigned addr, unsigned nbytes);
     void (*program_block)(adapter_t *a, unsigned addr, unsigned *data);
     void (*program_quad_word)(adapter_t *a, unsigned addr, unsigned word0,
         unsigned word1, unsigned word2, unsigned word3);
@@ -44,6 +71,10 @@ struct _adapter_t {
     void (*program_word)(adapter_t *a, unsigned addr, unsigned word);
     unsigned (*read_word)(adapter_t *a, unsigned addr);
     void (*erase_chip)(adapter_t *a);
+    void (*erase_page)(adapter_t *a, unsigned addr);
+    int (*blank_check)(adapter_t *a, unsigned addr, unsigned nbytes);
+    void (*submit)(adapter_t *a, adapter_req_t *req);
+    void (*sync)(adapter_t *a);
 };
 
 adapter_t *adapter_open_pickit2(int vid, int pid, const char *serial, int report);
@@ -51,6 +82,7 @@ adapter_t *adapter_open_pickit3(int vid, int pid, const char *serial, int report
 adapter_t *adapter_open_an1388(int vid, int pid, const char *serial, int report);
 adapter_t *adapter_open_hidboot(int vid, int pid, const char *serial, int report);
 adapter_t *adapter_open_mpsse(int vid, int pid, const char *serial, int report);
+adapter_t *adapter_open_mpsse_sim(const char *port, int baud_rate);
 adapter_t *adapter_open_bitbang(const char *port, int baud_rate);
 adapter_t *adapter_open_an1388_uart(const char *port, int baud_rate);
 adapter_t *adapter_open_stk500v2(const char *port, int baud_rate);
@@ -0,0 +1,98 @@
+/*
+ * Cache of images, programmed into target devices,
+ * and of JTAG clock rates, tuned for adapters.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+/*
+ * Address range of flash memory with the expected checksum,
+ * as reported by the target after successful programming.
+ */
+typedef struct {
+    unsigned        base;
+    unsigned        nbytes;             /* Zero when unused */
+    unsigned        crc;
+} cache_span_t;
+
+/*
+ * The image, programmed into a device with given CPUID.
+ */
+typedef struct {
+    unsigned        cpuid;
+    unsigned long long hash;            /* Hash of the image contents */
+    cache_span_t    flash;
+    cache_span_t    boot;
+    unsigned        msec;               /* Time of erase and program phases */
+} cache_entry_t;
+
+/*
+ * JTAG clock rate, tuned for a pair of adapter and device.
+ */
+typedef struct {
+    char            serial [32];        /* Serial number of adapter */
+    unsigned        cpuid;
+    unsigned        khz;
+} cache_clock_t;
+
+typedef struct {
+    const char      *filename;
+    unsigned        hits;               /* Statistics over all sessions */
+    unsigned        misses;
+    unsigned long   saved_msec;
+    unsigned        nentries;
+    cache_entry_t   *entry;
+    unsigned        nclocks;
+    cache_clock_t   *clock;
+    unsigned        loaded_hits;        /* Statistics as read from file */
+    unsigned        loaded_misses;
+    unsigned long   loaded_msec;
+} cache_t;
+
+/*
+ * Read the cache file. A missing file gives an empty cache.
+ * When filename is 0, use PIC32PROG_CACHE_FILE environment variable
+ * or a file in the home directory.
+ */
+void cache_load(cache_t *c, const char *filename);
+
+/*
+ * Find the entry for the given device and image.
+ * Return 0 when not found.
+ */
+cache_entry_t *cache_find(cache_t *c, unsigned cpuid, unsigned long long hash);
+
+/*
+ * Add or replace the entry for the device and image.
+ */
+void cache_add(cache_t *c, const cache_entry_t *entry);
+
+/*
+ * Find the clock rate for the adapter and device.
+ * Return 0 when not found.
+ */
+unsigned cache_find_clock(cache_t *c, const char *serial, unsigned cpuid);
+
+/*
+ * Set the clock rate for the adapter and device.
+ * Zero rate removes the entry.
+ */
+void cache_set_clock(cache_t *c, const char *serial, unsigned cpuid, unsigned khz);
+
+/*
+ * Write the cache file back.
+ * Other sessions may have updated the file since it was read:
+ * their entries and statistics are merged, under a lock.
+ * On error, print a warning: the cache is optional.
+ */
+void cache_save(cache_t *c);
+void cache_free(cache_t *c);
+
+#endif
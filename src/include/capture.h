@@ -0,0 +1,53 @@
+/*
+ * Capture of adapter transfers into a file, and replay from it.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+/*
+ * Transfers are taken from the capture file, instead of the device.
+ */
+extern int capture_replaying;
+
+/*
+ * Transfers are saved into the capture file.
+ */
+extern int capture_recording;
+
+/*
+ * Start recording of all transfers into the file,
+ * or replay of the recorded transfers.
+ * The summary of the replay is printed at exit.
+ */
+void capture_record(const char *filename);
+void capture_replay(const char *filename);
+
+/*
+ * Open of the device with the given name.
+ * While recording, the name is saved: call it only when the device
+ * is opened successfully. On replay, return 1 when the same kind
+ * of device was recorded at this point; a null name matches any device.
+ * Return 1 when neither recording nor replaying.
+ */
+int capture_open(int type, const char *name);
+
+/*
+ * Record a completed transfer with its data.
+ * Result is number of bytes, 0 on timeout, or negative on error.
+ */
+void capture_transfer(int type, int is_read, const unsigned char *data, int result);
+
+/*
+ * Replay the next transfer: return the recorded result, and copy
+ * the received data. Written data is compared with the recording.
+ */
+int capture_replay_transfer(int type, int is_read, unsigned char *data, int nbytes);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Precompiled image container.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _CONTAINER_H
+#define _CONTAINER_H
+
+#include "target.h"
+#include "loader.h"
+#include "image.h"
+
+/*
+ * Layout of container file, all values little endian:
+ *
+ *      Header (64 bytes):
+ *          0   magic "PIC32IMG"
+ *          8   version
+ *          12  row size in bytes
+ *          16  number of rows
+ *          20  number of data bytes in original file
+ *          24  offset of DEVCFG words in boot memory
+ *          28  DEVCFG3, DEVCFG2, DEVCFG1, DEVCFG0
+ *          44  family name, zero padded
+ *      Row table: address and CRC16 of every row, 8 bytes per row.
+ *      Row data: contents of every row.
+ */
+#define CONTAINER_MAGIC         "PIC32IMG"
+#define CONTAINER_VERSION       1
+#define CONTAINER_HDRSZ         64
+
+/*
+ * Write all dirty rows of the image into a container file.
+ * On error, print a message and exit.
+ */
+void container_write(const char *filename, const image_t *img,
+    const family_t *family, unsigned nbytes);
+
+/*
+ * Load the container: every row is passed to store(),
+ * and precomputed checksums are saved in the image.
+ * Return 0 when the file is not a container.
+ */
+int container_load(const char *filename, const loader_file_t *file,
+    image_t *img, loader_store_t *store, void *arg, unsigned *nbytes);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * CRC-16 checksum, as computed by the PIC32 programming executive.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _CRC16_H
+#define _CRC16_H
+
+/*
+ * Initial value of checksum, used by PE_GET_CRC command.
+ */
+#define CRC16_PE_SEED   0xffff
+
+/*
+ * Update CRC-CCITT checksum (polynomial 0x1021) with the data.
+ */
+unsigned crc16(unsigned crc, const unsigned char *data, unsigned nbytes);
+
+#endif
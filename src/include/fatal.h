@@ -0,0 +1,37 @@
+/*
+ * Handling of fatal errors.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _FATAL_H
+#define _FATAL_H
+
+#include <stdlib.h>
+#include <setjmp.h>
+
+/*
+ * Fatal errors are reported by exit() all over the code.
+ * When the calling thread has a jump buffer installed,
+ * control returns there with the exit status (or -1 for zero);
+ * otherwise the process terminates as usual.
+ */
+void pic32_exit(int status)
+#ifdef __GNUC__
+    __attribute__((noreturn))
+#endif
+    ;
+
+/*
+ * Install the jump buffer for fatal errors of the calling thread,
+ * or remove it when env is 0. Return the previous one.
+ */
+jmp_buf *fatal_catch(jmp_buf *env);
+
+#define exit(status)    pic32_exit(status)
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Sparse image of flash memory contents.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+/*
+ * Contiguous range of memory, aligned to rows.
+ * Bytes which were never written are 0xff.
+ */
+typedef struct {
+    unsigned        base;               /* Start address */
+    unsigned        nbytes;             /* Size, multiple of row size */
+    unsigned        nalloc;             /* Allocated size of data */
+    unsigned char   *data;              /* Contents */
+    unsigned        *dirty;             /* Bitmap of rows with data */
+    unsigned        *crc;               /* Checksums of rows, ~0 if unknown */
+} extent_t;
+
+/*
+ * Image is a list of extents, sorted by address.
+ */
+typedef struct {
+    unsigned        row_size;           /* Size of row, power of two */
+    unsigned        nextents;           /* Number of extents */
+    unsigned        maxextents;         /* Allocated size of extent list */
+    extent_t        *extent;            /* List of extents */
+    unsigned        last;               /* Index of recently used extent */
+} image_t;
+
+void image_init(image_t *img, unsigned row_size);
+void image_free(image_t *img);
+
+/*
+ * Store data into the image.
+ * All rows touched by the data are marked as dirty.
+ */
+void image_write(image_t *img, unsigned addr, const void *data, unsigned nbytes);
+
+/*
+ * Get a pointer to the byte at given address.
+ * Return 0 when the address is outside of all extents.
+ */
+const unsigned char *image_data(const image_t *img, unsigned addr);
+
+/*
+ * Get a pointer to the dirty row, which contains the given address.
+ * Return 0 when the row is not dirty.
+ */
+unsigned char *image_row(const image_t *img, unsigned addr);
+
+/*
+ * Read a 32-bit word. Return 0xffffffff when no data present.
+ */
+unsigned image_read_word(const image_t *img, unsigned addr);
+
+/*
+ * Find the first dirty row at or above *addr and below the limit.
+ * Store the row address in *addr and return 1.
+ * Return 0 when no more dirty rows.
+ */
+int image_next_row(const image_t *img, unsigned *addr, unsigned limit);
+
+/*
+ * Count dirty rows in the given address range.
+ */
+unsigned image_nrows(const image_t *img, unsigned start, unsigned limit);
+
+/*
+ * Get CRC16 of the row which contains the given address,
+ * as computed by PE_GET_CRC command.
+ * Checksums are cached until the row is modified.
+ */
+unsigned image_row_crc(const image_t *img, unsigned addr);
+void image_set_row_crc(image_t *img, unsigned addr, unsigned crc);
+
+/*
+ * Change the row size, keeping the contents.
+ * Dirty rows are merged into larger ones, or split into smaller.
+ */
+void image_set_row_size(image_t *img, unsigned row_size);
+
+/*
+ * Compute 64-bit hash of all dirty rows and their addresses.
+ */
+unsigned long long image_hash(const image_t *img);
+
+#endif
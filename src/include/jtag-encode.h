@@ -0,0 +1,74 @@
+/*
+ * Encoding of JTAG packets for MPSSE and bitbang adapters.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _JTAG_ENCODE_H
+#define _JTAG_ENCODE_H
+
+/* MPSSE commands. */
+#define CLKWNEG                 0x01
+#define BITMODE                 0x02
+#define CLKRNEG                 0x04
+#define LSB                     0x08
+#define WTDI                    0x10
+#define RTDO                    0x20
+#define WTMS                    0x40
+
+/*
+ * Max size of one MPSSE packet: 6+8+3+3+3 bytes.
+ */
+#define MPSSE_PACKET_MAX        23
+
+/*
+ * Layout of the reply to a packet with read_flag set.
+ */
+typedef struct {
+    int bytes_per_word;
+    unsigned long long fix_high_bit;
+    unsigned long long high_byte_mask;
+    unsigned long long high_bit_mask;
+    unsigned high_byte_bits;
+} mpsse_reply_t;
+
+/*
+ * Encode a packet of MPSSE commands: TMS prologue, TDI data
+ * and TMS epilogue. With read_flag, the layout of the reply
+ * is stored. Return the number of bytes written.
+ */
+unsigned mpsse_encode(unsigned char *out,
+    unsigned tms_prolog_nbits, unsigned tms_prolog,
+    unsigned tdi_nbits, unsigned long long tdi,
+    int read_flag, mpsse_reply_t *reply);
+
+/*
+ * Counters of one bitbang command string.
+ */
+typedef struct {
+    int chars_to_read;                  /* Characters of the reply */
+    int pairs;                          /* TDI/TMS pairs encoded */
+    int count;                          /* Symbols used for the pairs */
+} bitbang_count_t;
+
+/*
+ * Max size of one bitbang command string, without handshake.
+ */
+#define BITBANG_PACKET_MAX      100
+
+/*
+ * Encode TMS and TDI bits as ASCII symbols of bitbang adapter.
+ * With compress, TDI is packed four bits per symbol;
+ * spacers add '.' between parts, ignored by the programmer.
+ * Return the number of bytes written.
+ */
+unsigned bitbang_encode(unsigned char *out,
+    unsigned tms_nbits, unsigned tms,
+    unsigned tdi_nbits, unsigned long long tdi,
+    int read_flag, int compress, int spacers, bitbang_count_t *c);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Library interface to the PIC32 flash programmer.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _LIBPIC32PROG_H
+#define _LIBPIC32PROG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Session holds an open adapter with the detected target,
+ * and the image of the last loaded firmware file.
+ * Different sessions may be used from different threads,
+ * each one from a single thread at a time.
+ * Serial adapters share one port, so only one session
+ * may use a serial adapter.
+ * Verbosity and the debug output, reports, traces, link statistics
+ * and captures of adapter traffic are process-wide: they are
+ * shared by all sessions, and are meant for one session per process.
+ * After a failure of the adapter or target, the adapter is closed:
+ * all following calls of the session return PIC32_ERR_ADAPTER,
+ * and the session can only be closed.
+ */
+typedef struct _pic32_session_t pic32_session_t;
+
+/*
+ * Error codes, returned by the session calls.
+ */
+#define PIC32_OK                0
+#define PIC32_ERR_NOMEM         -1      /* Out of memory */
+#define PIC32_ERR_NO_TARGET     -2      /* Adapter or device not found */
+#define PIC32_ERR_UNSUPPORTED   -3      /* Operation not supported by adapter */
+#define PIC32_ERR_FILE          -4      /* Cannot read the file */
+#define PIC32_ERR_FORMAT        -5      /* Bad file format or contents */
+#define PIC32_ERR_ADAPTER       -6      /* Communication with the target failed */
+#define PIC32_ERR_VERIFY        -7      /* Flash memory differs from the file */
+#define PIC32_ERR_ARGS          -8      /* Bad arguments */
+
+/*
+ * Flags for pic32_program().
+ */
+#define PIC32_NO_VERIFY         0x0001  /* Skip verification */
+#define PIC32_BLANK_CHECK       0x0002  /* Skip erase when the chip is blank */
+#define PIC32_FORCE             0x0004  /* Allow missing configuration words */
+
+/*
+ * Progress of the current operation, in bytes.
+ */
+typedef void pic32_progress_t(void *arg, unsigned done, unsigned total);
+
+/*
+ * Completion of an operation, with its status.
+ */
+typedef void pic32_done_t(void *arg, int status);
+
+/*
+ * Open the adapter at the given port (0 for autodetect),
+ * and identify the target. Baud rate is used for serial adapters.
+ * On failure, return 0 and store the error code.
+ */
+pic32_session_t *pic32_open(const char *port, int baud_rate, int *error);
+
+/*
+ * Close the adapter and free the session.
+ * With power_on, the target board is left powered.
+ */
+void pic32_close(pic32_session_t *s, int power_on);
+
+/*
+ * Set callbacks for all following operations of the session.
+ */
+void pic32_set_callbacks(pic32_session_t *s, pic32_progress_t *progress,
+    pic32_done_t *done, void *arg);
+
+/*
+ * Set the amount of messages printed by all sessions:
+ * -1 for errors only, 0 for normal output, 1 and above for debug.
+ */
+void pic32_set_verbosity(int level);
+
+/*
+ * Parameters of the detected target.
+ */
+const char *pic32_cpu_name(pic32_session_t *s);
+unsigned pic32_cpuid(pic32_session_t *s);
+unsigned pic32_flash_bytes(pic32_session_t *s);
+unsigned pic32_boot_bytes(pic32_session_t *s);
+
+/*
+ * Erase the whole flash memory.
+ */
+int pic32_erase(pic32_session_t *s);
+
+/*
+ * Program the firmware file in container, ELF, HEX or SREC format.
+ */
+int pic32_program(pic32_session_t *s, const char *filename, int flags);
+
+/*
+ * Compare flash memory with the firmware file.
+ */
+int pic32_verify(pic32_session_t *s, const char *filename);
+
+/*
+ * Read memory contents.
+ */
+int pic32_read(pic32_session_t *s, unsigned addr, unsigned nbytes, void *data);
+
+/*
+ * Get a message for the error code.
+ */
+const char *pic32_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
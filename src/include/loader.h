@@ -0,0 +1,63 @@
+/*
+ * Loader of firmware files.
+ *
+ * Copyright (C) 2011-2013 Serge Vakulenko
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _LOADER_H
+#define _LOADER_H
+
+#include <stddef.h>
+
+/*
+ * Contents of a file, mapped into memory.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t          size;
+    int             mapped;             /* Memory was mapped, not allocated */
+} loader_file_t;
+
+/*
+ * Callback for storing the payload of one record into the image.
+ */
+typedef void loader_store_t(void *arg, unsigned address,
+    const unsigned char *data, unsigned nbytes);
+
+/*
+ * Map the file into memory.
+ * On error, print a message and exit.
+ */
+void loader_map(const char *filename, loader_file_t *file);
+void loader_unmap(loader_file_t *file);
+
+/*
+ * Decode a string of hex digits into binary.
+ * Return 0 when a non-hex character is found.
+ */
+int loader_decode(unsigned char *dst, const unsigned char *src, unsigned nbytes);
+
+/*
+ * Parse file contents in Intel HEX or Motorola SREC format.
+ * Every record is passed to the store() callback.
+ * Return 0 when the file is not in the given format.
+ * On a malformed record, print a message and exit.
+ */
+int loader_hex(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg);
+int loader_srec(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg);
+
+/*
+ * Parse file contents in ELF format: store all loadable segments.
+ * Return 0 when the file is not ELF.
+ */
+int loader_elf(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg);
+
+#endif
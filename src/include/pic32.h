@@ -105,6 +105,7 @@ extern const unsigned pic32_pemz[];
 #define PE_PROGRAM_CLUSTER      0x9     /* Program N bytes */
 #define PE_GET_DEVICEID         0xA     /* Return the hardware ID of device */
 #define PE_CHANGE_CFG           0xB     /* Change PE settings */
+#define PE_QUAD_WORD_PROGRAM    0xD     /* Program four words of flash memory */
 
 /*-------------------------------------------------------------------
  * MX3/4/5/6/7 family.
@@ -0,0 +1,83 @@
+/*
+ * Timing of programming phases.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _REPORT_H
+#define _REPORT_H
+
+/*
+ * Phases of a session.
+ * Phases may be nested: time of the inner phase is not
+ * counted in the outer one.
+ */
+enum {
+    PHASE_OPEN,                         /* Find and open the adapter */
+    PHASE_IDCODE,                       /* Read device identifier */
+    PHASE_SERIAL_EXEC,                  /* Enter serial execution mode */
+    PHASE_PE_LOAD,                      /* Download programming executive */
+    PHASE_ERASE,                        /* Chip erase or blank check */
+    PHASE_PROGRAM,                      /* Program flash memory */
+    PHASE_BOOT,                         /* Program boot memory */
+    PHASE_DEVCFG,                       /* Program configuration words */
+    PHASE_VERIFY,                       /* Verify flash and boot memory */
+    PHASE_READ,                         /* Read memory to file */
+    PHASE_CLOCK_TUNE,                   /* Tune JTAG clock of the adapter */
+    NPHASES
+};
+
+typedef struct {
+    unsigned        count;              /* Times entered */
+    unsigned long long wall_nsec;       /* Elapsed time */
+    unsigned long long cpu_nsec;        /* CPU time of the host */
+    unsigned long long nbytes;          /* Data moved to or from the target */
+    unsigned long   ntransactions;      /* Calls into the adapter */
+} phase_stat_t;
+
+/*
+ * Statistics are collected only when enabled.
+ */
+extern int report_enabled;
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+unsigned long long report_clock(void);
+
+void report_begin(int phase);
+void report_end(int phase);
+
+/*
+ * Get statistics of the phase, collected so far.
+ */
+const phase_stat_t *report_phase(int phase);
+
+/*
+ * Count one adapter transaction, which moved the given number of bytes.
+ */
+void report_io(unsigned nbytes);
+
+/*
+ * Remember the detected target.
+ */
+void report_target(const char *cpu_name, unsigned cpuid);
+
+/*
+ * Remember the JTAG clock, chosen by the adapter, and how it was chosen.
+ * Get returns the clock in kHz, or 0 when not known.
+ */
+void report_jtag_clock(unsigned khz, const char *how);
+unsigned report_get_jtag_clock(const char **how);
+
+/*
+ * Write statistics of all phases in JSON format.
+ * On error, print a warning.
+ */
+void report_write_json(const char *filename, const char *status);
+
+#endif
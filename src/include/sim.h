@@ -0,0 +1,46 @@
+/*
+ * Simulated PIC32 target, as seen from the JTAG port.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+typedef struct _sim_t sim_t;
+
+/*
+ * Create a simulated target. The configuration is a chip or family
+ * name, optionally followed by latency settings, like
+ * "mx3,rtt=125,fastdata=1500". Return 0 on invalid configuration.
+ */
+sim_t *sim_open(const char *config);
+void sim_close(sim_t *s);
+
+/*
+ * Print the simulated time and the amount of JTAG traffic.
+ */
+void sim_print_stats(sim_t *s);
+
+/*
+ * USB side of an FT2232H in MPSSE mode, wired to the JTAG port
+ * and /SYSRST of the target like ARM-USB-Tiny-H. Write executes
+ * the MPSSE commands. Read returns the captured data in packets
+ * of max_packet bytes, each starting with two status bytes;
+ * it is one round trip of the probe, when commands were written
+ * since the last read. With pacing enabled, the read waits
+ * until the wall clock reaches the simulated time.
+ */
+void sim_mpsse_write(sim_t *s, const unsigned char *data, int nbytes);
+int sim_mpsse_read(sim_t *s, unsigned char *data, int nbytes, int max_packet);
+
+/*
+ * Delay on the host side, in milliseconds of simulated time.
+ */
+void sim_delay(sim_t *s, unsigned msec);
+
+#endif
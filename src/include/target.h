@@ -22,6 +22,7 @@ typedef struct {
     unsigned        boot_kbytes;
     unsigned        devcfg_offset;
     unsigned        bytes_per_row;
+    unsigned        bytes_per_page;
     print_func_t    *print_devcfg;
     word_mask_func_t *word_mask;
     const unsigned  *pe_code;
@@ -44,13 +45,25 @@ typedef struct {
     unsigned        flash_addr;
     unsigned        flash_bytes;
     unsigned        boot_bytes;
+    int             pe_loaded;          /* Executive is resident in RAM */
 } target_t;
 
+/*
+ * Settings, shared by all targets.
+ */
+extern unsigned long open_retries;
+extern unsigned long open_delay;
+extern int alternate_speed;
+
 target_t *target_open(const char *port, int baud_rate);
+target_t *target_alloc(void);
+void target_connect(target_t *t, const char *port, int baud_rate);
 void target_close(target_t *t, int power_on);
 void target_use_executive(target_t *t);
 void target_configure(void);
 void target_add_variant(char *name, unsigned id, char *family, unsigned flash_kbytes);
+const family_t *target_find_family(const char *name);
+const variant_t *target_find_variant(const char *name);
 
 unsigned target_idcode(target_t *t);
 const char *target_cpu_name(target_t *t);
@@ -58,17 +71,29 @@ unsigned target_flash_width(target_t *t);
 unsigned target_flash_bytes(target_t *t);
 unsigned target_boot_bytes(target_t *t);
 unsigned target_block_size(target_t *t);
+unsigned target_page_size(target_t *t);
 unsigned target_devcfg_offset(target_t *t);
 void target_print_devcfg(target_t *t);
 
 void target_read_block(target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
+void target_readback_block(target_t *t, unsigned addr,
+	unsigned nwords, unsigned *data);
 void target_verify_block(target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
+void target_verify_block_crc(target_t *t, unsigned addr,
+	unsigned nwords, unsigned *data, unsigned crc);
 
-int target_erase(target_t *t);
+int target_erase(target_t *t, int blank_check);
+int target_can_erase_page(target_t *t);
+void target_erase_page(target_t *t, unsigned addr);
+int target_compare_page(target_t *t, unsigned addr, unsigned *data);
+int target_get_crc(target_t *t, unsigned addr, unsigned nbytes);
 void target_program_block(target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
+void target_submit(target_t *t, adapter_req_t *req);
+void target_sync(target_t *t);
+int target_can_queue(target_t *t);
 void target_program_devcfg(target_t *t, unsigned devcfg0,
         unsigned devcfg1, unsigned devcfg2, unsigned devcfg3);
 
@@ -0,0 +1,38 @@
+/*
+ * Trace of adapter operations in Chrome trace event format.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "adapter.h"
+
+/*
+ * Start writing the trace to the file.
+ * The trace is completed at exit.
+ */
+void trace_open(const char *filename);
+
+/*
+ * Begin and end of an operation. Operations may be nested.
+ * Category is "adapter" for calls into adapter_t,
+ * or "transport" for USB and serial transfers.
+ * Address and size are recorded when not zero.
+ */
+void trace_begin(const char *category, const char *name,
+    unsigned addr, unsigned nbytes);
+void trace_end(void);
+
+/*
+ * Wrap the adapter, so that every call is traced.
+ * Return the adapter itself when the trace is disabled.
+ */
+adapter_t *trace_adapter(adapter_t *a);
+
+#endif
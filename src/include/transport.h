@@ -0,0 +1,117 @@
+/*
+ * Transfers of adapters: tracing and statistics.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include "capture.h"
+
+/*
+ * Kinds of transport.
+ */
+enum {
+    TRANSPORT_BULK,                     /* USB bulk endpoints */
+    TRANSPORT_HID,                      /* USB HID reports */
+    TRANSPORT_SERIAL,                   /* Serial port */
+    NTRANSPORTS
+};
+
+/*
+ * Statistics are collected only when enabled.
+ */
+extern int transport_stats;
+
+/*
+ * Begin and end of a transfer in given direction.
+ * Result is number of bytes, 0 on timeout, or negative on error.
+ * A round trip lasts from the first write to the next successful read.
+ * The data are recorded, when capture is enabled.
+ */
+void transport_begin(int type, int is_read, unsigned nbytes);
+void transport_end(int type, int is_read, const unsigned char *data, int result);
+
+/*
+ * Count a retry of the protocol.
+ */
+void transport_retry(int type);
+
+/*
+ * Count user data, moved by an adapter call.
+ */
+void transport_payload(unsigned nbytes);
+
+/*
+ * Print summary of all transports, which were used.
+ */
+void transport_print_stats(void);
+
+#ifdef HIDAPI_H__
+/*
+ * Open a HID device.
+ * On replay, the device is taken from the capture file.
+ */
+static inline hid_device *transport_hid_open(unsigned short vid,
+    unsigned short pid, const wchar_t *serial)
+{
+    char name [16];
+    hid_device *dev;
+
+    sprintf(name, "%04x:%04x", vid, pid);
+    if (capture_replaying) {
+        /* Any non-null handle: it is never used. */
+        return capture_open(TRANSPORT_HID, name) ?
+            (hid_device*) &capture_replaying : 0;
+    }
+    dev = hid_open(vid, pid, serial);
+    if (dev)
+        capture_open(TRANSPORT_HID, name);
+    return dev;
+}
+
+/*
+ * Send a HID report.
+ * Return number of bytes, or -1 on error.
+ */
+static inline int transport_hid_write(hid_device *dev,
+    const unsigned char *data, size_t len)
+{
+    int n;
+
+    transport_begin(TRANSPORT_HID, 0, len);
+    if (capture_replaying)
+        n = capture_replay_transfer(TRANSPORT_HID, 0, (unsigned char*) data, len);
+    else
+        n = hid_write(dev, data, len);
+    transport_end(TRANSPORT_HID, 0, data, n);
+    return n;
+}
+
+/*
+ * Receive a HID report. Negative timeout means the default mode of the device.
+ * Return number of bytes, 0 on timeout, or -1 on error.
+ */
+static inline int transport_hid_read(hid_device *dev,
+    unsigned char *data, size_t len, int timeout_msec)
+{
+    int n;
+
+    transport_begin(TRANSPORT_HID, 1, len);
+    if (capture_replaying)
+        n = capture_replay_transfer(TRANSPORT_HID, 1, data, len);
+    else if (timeout_msec < 0)
+        n = hid_read(dev, data, len);
+    else
+        n = hid_read_timeout(dev, data, len, timeout_msec);
+    transport_end(TRANSPORT_HID, 1, data, n);
+    return n;
+}
+#endif
+
+#endif
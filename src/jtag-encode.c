@@ -0,0 +1,203 @@
+/*
+ * Encoding of JTAG packets for MPSSE and bitbang adapters.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include "jtag-encode.h"
+
+unsigned mpsse_encode(unsigned char *out,
+    unsigned tms_prolog_nbits, unsigned tms_prolog,
+    unsigned tdi_nbits, unsigned long long tdi,
+    int read_flag, mpsse_reply_t *reply)
+{
+    unsigned tms_epilog_nbits = 0, tms_epilog = 0;
+    unsigned n = 0;
+
+    if (tdi_nbits > 0) {
+        /* We have some data; add generic prologue TMS 1-0-0
+         * and epilogue TMS 1-0. */
+        tms_prolog |= 1 << tms_prolog_nbits;
+        tms_prolog_nbits += 3;
+        tms_epilog = 1;
+        tms_epilog_nbits = 2;
+    }
+
+    /* Prepare a packet of MPSSE commands. */
+    if (tms_prolog_nbits > 0) {
+        /* Prologue TMS, from 1 to 14 bits.
+         * 4b - Clock Data to TMS Pin (no Read) */
+        out [n++] = WTMS + BITMODE + CLKWNEG + LSB;
+        if (tms_prolog_nbits < 8) {
+            out [n++] = tms_prolog_nbits - 1;
+            out [n++] = tms_prolog;
+        } else {
+            out [n++] = 7 - 1;
+            out [n++] = tms_prolog & 0x7f;
+            out [n++] = WTMS + BITMODE + CLKWNEG + LSB;
+            out [n++] = tms_prolog_nbits - 7 - 1;
+            out [n++] = tms_prolog >> 7;
+        }
+    }
+    if (tdi_nbits > 0) {
+        /* Data, from 1 to 64 bits. */
+        if (tms_epilog_nbits > 0) {
+            /* Last bit should be accompanied with signal TMS=1. */
+            tdi_nbits--;
+        }
+        unsigned nbytes = tdi_nbits / 8;
+        unsigned last_byte_bits = tdi_nbits & 7;
+        if (read_flag) {
+            reply->high_byte_bits = last_byte_bits;
+            reply->fix_high_bit = 0;
+            reply->high_byte_mask = 0;
+            reply->bytes_per_word = nbytes;
+            if (reply->high_byte_bits > 0)
+                reply->bytes_per_word++;
+        }
+        if (nbytes > 0) {
+            /* Whole bytes.
+             * 39 - Clock Data Bytes In and Out LSB First
+             * 19 - Clock Data Bytes Out LSB First (no Read) */
+            out [n++] = read_flag ?
+                (WTDI + RTDO + CLKWNEG + LSB) :
+                (WTDI + CLKWNEG + LSB);
+            out [n++] = nbytes - 1;
+            out [n++] = (nbytes - 1) >> 8;
+            while (nbytes-- > 0) {
+                out [n++] = tdi;
+                tdi >>= 8;
+            }
+        }
+        if (last_byte_bits) {
+            /* Last partial byte.
+             * 3b - Clock Data Bits In and Out LSB First
+             * 1b - Clock Data Bits Out LSB First (no Read) */
+            out [n++] = read_flag ?
+                (WTDI + RTDO + BITMODE + CLKWNEG + LSB) :
+                (WTDI + BITMODE + CLKWNEG + LSB);
+            out [n++] = last_byte_bits - 1;
+            out [n++] = tdi;
+            tdi >>= last_byte_bits;
+            if (read_flag)
+                reply->high_byte_mask = 0xffULL << (reply->bytes_per_word - 1) * 8;
+        }
+        if (tms_epilog_nbits > 0) {
+            /* Last bit (actually two bits).
+             * 6b - Clock Data to TMS Pin with Read
+             * 4b - Clock Data to TMS Pin (no Read) */
+            tdi_nbits++;
+            out [n++] = read_flag ?
+                (WTMS + RTDO + BITMODE + CLKWNEG + LSB) :
+                (WTMS + BITMODE + CLKWNEG + LSB);
+            out [n++] = 1;
+            out [n++] = tdi << 7 | 1 | tms_epilog << 1;
+            tms_epilog_nbits--;
+            tms_epilog >>= 1;
+            if (read_flag) {
+                /* Last bit wil come in next byte.
+                 * Compute a mask for correction. */
+                reply->fix_high_bit = 0x40ULL << (reply->bytes_per_word * 8);
+                reply->bytes_per_word++;
+            }
+        }
+        if (read_flag)
+            reply->high_bit_mask = 1ULL << (tdi_nbits - 1);
+    }
+    if (tms_epilog_nbits > 0) {
+        /* Epiloque TMS, from 1 to 7 bits.
+         * 4b - Clock Data to TMS Pin (no Read) */
+        out [n++] = WTMS + BITMODE + CLKWNEG + LSB;
+        out [n++] = tms_epilog_nbits - 1;
+        out [n++] = tms_epilog;
+    }
+    return n;
+}
+
+/*
+ * TMS is a command of 0 to 14 bits length, sent LSB first. TDI = 0 throughout.
+ * If nTDI<>0 then send TMS = 1-0-0 (TDI = 0).
+ * Next we send out the TDI bits (up to 64, LSB first), with TMS=0 for n-1 bits;
+ * the last TDI bit should be accompanied with TMS = 1.
+ * If nTDI<>0 then send TMS = 1-0 (TDI = 0).
+ *
+ * NOTE: if read_flag == 1, then read TDO on last TMS bit and each of n-1 TDI bits.
+ *       if read_flag == 2, only read TDO on the last TMS bit (to just get PrAcc)
+ */
+unsigned bitbang_encode(unsigned char *out,
+    unsigned tms_nbits, unsigned tms,
+    unsigned tdi_nbits, unsigned long long tdi,
+    int read_flag, int compress, int spacers, bitbang_count_t *c)
+{
+    unsigned n = 0;
+    int i;
+
+    c->chars_to_read = 0;
+    c->pairs = 0;
+    c->count = 0;
+
+    for (i = tms_nbits; i > 0; i--) {           // for each of the n bits...
+        out [n++] = (tms & 1) + 'd';            // d, e, f, g
+        tms >>= 1;                              // shift TMS right one bit
+    }
+    c->count += tms_nbits;
+    c->pairs += tms_nbits;
+
+    if (spacers && (tms_nbits != 0))
+        out[n++] = '.';                         // spacer, ignored by programmer
+
+    if (tdi_nbits != 0) {                       // 1-0-0 if nTDI <> 0
+        if (compress) {                         // use compression: edd -> a, edD -> A
+            out[n++] = (read_flag ? 'A' : 'a');
+            c->count++;
+        }
+        else {                                  // compression flag turned off
+            out[n++] = 1 + 'd';
+            out[n++] = 0 + 'd';
+            out[n++] = 0 + (read_flag ? 'D' : 'd');
+            c->count += 3;
+        }
+        c->pairs += 3;
+        if (spacers)
+            out[n++] = '.';                     // spacer, ignored by programmer
+    }
+
+    i = tdi_nbits;
+    if (compress) {                             // while we can, package up lots of 4 TDI bits
+        for (; i > 4; i -= 4) {                 // make sure the last bit is NOT packaged
+            out[n++] = (read_flag == 1 ? 'I' : 'i') + (tdi & 0xF);
+            tdi >>= 4;
+            c->count++;
+            if (read_flag == 1) c->chars_to_read++;
+        }
+    }
+    for (; i > 0; i--) {                        // (send all/remaining bits as singles)
+        out[n++] = ((tdi & 1) << 1) + (i == 1) +    // TMS=0 for n-1 bits, then 1 on last bit
+             ((read_flag == 1 && i != 1) ?      // 0 = no read, 1 = normal read, 2 = oPrAcc read
+              'D' : 'd');                       // UC = read, LC = none, no read on last bit
+        tdi >>= 1;                              // shift TDI right one bit
+        c->count++;
+        if (read_flag == 1) c->chars_to_read++;
+    }
+    c->pairs += tdi_nbits;
+
+    if (tdi_nbits != 0) {                       // 1-0 if nTDI <> 0
+        if (spacers)
+            out[n++] = '.';                     // spacer, ignored by programmer
+
+        if (compress) {
+            out[n++] ='z';                      // use compression: ed -> z
+            c->count++;
+        }
+        else {                                  // compression flag turned off
+            out[n++] = 1 + 'd';
+            out[n++] = 0 + 'd';
+            c->count += 2;
+        }
+        c->pairs += 2;
+    }
+    return n;
+}
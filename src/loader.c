@@ -0,0 +1,448 @@
+/*
+ * Loader of firmware files in Intel HEX, Motorola SREC and ELF formats.
+ *
+ * Copyright (C) 2011-2014 Serge Vakulenko
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef MINGW32
+#   include <sys/mman.h>
+#endif
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   include <arm_neon.h>
+#endif
+
+#include "loader.h"
+#include "localize.h"
+#include "fatal.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * Value of every hex digit, or 0xf0 for a non-hex character.
+ */
+static const unsigned char nibble_tab[256] = {
+#define XX 0xf0
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+#undef XX
+};
+
+void loader_map(const char *filename, loader_file_t *file)
+{
+    struct stat st;
+    unsigned char *buf;
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        exit(1);
+    }
+    file->size = st.st_size;
+    file->mapped = 0;
+    if (file->size == 0) {
+        /* Empty file: nothing to map. */
+        file->data = (const unsigned char*) "";
+        close(fd);
+        return;
+    }
+#ifndef MINGW32
+    buf = mmap(0, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+        madvise(buf, file->size, MADV_SEQUENTIAL);
+#endif
+        file->data = buf;
+        file->mapped = 1;
+        close(fd);
+        return;
+    }
+#endif
+    /* Cannot map: read the whole file instead. */
+    buf = malloc(file->size);
+    if (! buf) {
+        fprintf(stderr, _("%s: out of memory\n"), filename);
+        exit(1);
+    }
+    for (done=0; done<file->size; done+=n) {
+        n = read(fd, buf + done, file->size - done);
+        if (n <= 0) {
+            perror(filename);
+            exit(1);
+        }
+    }
+    file->data = buf;
+    close(fd);
+}
+
+void loader_unmap(loader_file_t *file)
+{
+    if (file->size == 0)
+        return;
+#ifndef MINGW32
+    if (file->mapped)
+        munmap((void*) file->data, file->size);
+    else
+#endif
+        free((void*) file->data);
+    file->data = 0;
+    file->size = 0;
+}
+
+#if defined(__SSE2__)
+/*
+ * Convert 16 hex characters to nibble values.
+ * Clear bits in the valid mask for non-hex characters.
+ */
+static inline __m128i sse_nibbles(__m128i c, __m128i *valid)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i digit, letter, is_digit, is_letter;
+
+    digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                          _mm_set1_epi8('a'));
+    is_digit = _mm_cmpeq_epi8(_mm_subs_epu8(digit, _mm_set1_epi8(9)), zero);
+    is_letter = _mm_cmpeq_epi8(_mm_subs_epu8(letter, _mm_set1_epi8(5)), zero);
+    *valid = _mm_and_si128(*valid, _mm_or_si128(is_digit, is_letter));
+
+    return _mm_or_si128(_mm_and_si128(is_digit, digit),
+        _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+/*
+ * Decode 32 hex characters into 16 bytes.
+ */
+static inline int decode16(unsigned char *dst, const unsigned char *src)
+{
+    __m128i valid = _mm_set1_epi8(-1);
+    __m128i v0 = sse_nibbles(_mm_loadu_si128((const __m128i*) src), &valid);
+    __m128i v1 = sse_nibbles(_mm_loadu_si128((const __m128i*) (src + 16)), &valid);
+    const __m128i low = _mm_set1_epi16(0x00ff);
+
+    /* Every 16-bit lane holds the high nibble in the low byte. */
+    v0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0, low), 4),
+                      _mm_srli_epi16(v0, 8));
+    v1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, low), 4),
+                      _mm_srli_epi16(v1, 8));
+    _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(v0, v1));
+    return _mm_movemask_epi8(valid) == 0xffff;
+}
+#define HAVE_DECODE16
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+/*
+ * Convert 16 hex characters to nibble values.
+ * Clear bits in the valid mask for non-hex characters.
+ */
+static inline uint8x16_t neon_nibbles(uint8x16_t c, uint8x16_t *valid)
+{
+    uint8x16_t digit, letter, is_digit, is_letter;
+
+    digit = vsubq_u8(c, vdupq_n_u8('0'));
+    letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    is_digit = vcleq_u8(digit, vdupq_n_u8(9));
+    is_letter = vcleq_u8(letter, vdupq_n_u8(5));
+    *valid = vandq_u8(*valid, vorrq_u8(is_digit, is_letter));
+
+    return vbslq_u8(is_digit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+}
+
+/*
+ * Decode 32 hex characters into 16 bytes.
+ */
+static inline int decode16(unsigned char *dst, const unsigned char *src)
+{
+    uint8x16x2_t c = vld2q_u8(src);
+    uint8x16_t valid = vdupq_n_u8(0xff);
+    uint8x16_t hi = neon_nibbles(c.val[0], &valid);
+    uint8x16_t lo = neon_nibbles(c.val[1], &valid);
+    uint8x8_t m;
+
+    vst1q_u8(dst, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+
+    m = vand_u8(vget_low_u8(valid), vget_high_u8(valid));
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    return vget_lane_u8(m, 0) == 0xff;
+}
+#define HAVE_DECODE16
+#endif
+
+int loader_decode(unsigned char *dst, const unsigned char *src, unsigned nbytes)
+{
+    unsigned hi, lo, bad = 0;
+
+#ifdef HAVE_DECODE16
+    for (; nbytes >= 16; nbytes-=16, dst+=16, src+=32) {
+        if (! decode16(dst, src))
+            return 0;
+    }
+#endif
+    while (nbytes-- > 0) {
+        hi = nibble_tab[src[0]];
+        lo = nibble_tab[src[1]];
+        bad |= hi | lo;
+        *dst++ = hi << 4 | lo;
+        src += 2;
+    }
+    return (bad & 0xf0) == 0;
+}
+
+/*
+ * Find end of line.
+ */
+static inline const unsigned char *line_end(const unsigned char *p,
+    const unsigned char *end)
+{
+    const unsigned char *eol = memchr(p, '\n', end - p);
+
+    return eol ? eol : end;
+}
+
+/*
+ * Parse Intel HEX format.
+ */
+int loader_hex(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg)
+{
+    const unsigned char *p = file->data;
+    const unsigned char *end = p + file->size;
+    const unsigned char *eol;
+    unsigned char rec [256 + 5], sum;
+    unsigned high, bytes, len, i;
+
+    high = 0;
+    for (; p < end; p = eol) {
+        if (*p == '\n' || *p == '\r') {
+            eol = p + 1;
+            continue;
+        }
+        if (*p != ':')
+            return 0;
+        eol = line_end(p, end);
+        len = eol - p;
+
+        /* Decode and check the whole record at once. */
+        if (len < 11 || ! loader_decode(rec, p+1, 1)) {
+bad_record:
+            fprintf(stderr, _("%s: bad HEX record: %.*s\n"),
+                filename, (int) len, p);
+            exit(1);
+        }
+        bytes = rec[0];
+        if (len < bytes * 2 + 11) {
+            fprintf(stderr, _("%s: too short hex line\n"), filename);
+            exit(1);
+        }
+        if (! loader_decode(rec, p+1, bytes + 5))
+            goto bad_record;
+
+        sum = 0;
+        for (i=0; i<bytes+5; i++)
+            sum += rec[i];
+        if (sum != 0) {
+            fprintf(stderr, _("%s: bad HEX checksum\n"), filename);
+            exit(1);
+        }
+
+        switch (rec[3]) {
+        case 0:
+            /* Data. */
+            (*store)(arg, high << 16 | rec[1] << 8 | rec[2], rec + 4, bytes);
+            break;
+        case 1:
+            /* End of file. */
+            return 1;
+        case 4:
+            /* Extended address. */
+            if (bytes != 2) {
+                fprintf(stderr, _("%s: invalid HEX linear address record length\n"),
+                    filename);
+                exit(1);
+            }
+            high = rec[4] << 8 | rec[5];
+            break;
+        case 5:
+            /* Start address, ignore. */
+            break;
+        default:
+            fprintf(stderr, _("%s: unknown HEX record type: %d\n"),
+                filename, rec[3]);
+            exit(1);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Parse S record format.
+ */
+int loader_srec(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg)
+{
+    const unsigned char *p = file->data;
+    const unsigned char *end = p + file->size;
+    const unsigned char *eol;
+    unsigned char rec [256], sum;
+    unsigned address, bytes, alen, len, i;
+
+    for (; p < end; p = eol) {
+        if (*p == '\n' || *p == '\r') {
+            eol = p + 1;
+            continue;
+        }
+        if (*p != 'S')
+            return 0;
+        eol = line_end(p, end);
+        len = eol - p;
+        if (len >= 2 && (p[1] == '7' || p[1] == '8' || p[1] == '9'))
+            break;
+
+        /* Decode and check the whole record at once. */
+        if (len < 4 || ! loader_decode(rec, p+2, 1)) {
+bad_record:
+            fprintf(stderr, _("%s: bad SREC record: %.*s\n"),
+                filename, (int) len, p);
+            exit(1);
+        }
+        bytes = rec[0];
+        if (len < bytes * 2 + 4 || ! loader_decode(rec, p+2, bytes + 1))
+            goto bad_record;
+
+        sum = 0;
+        for (i=0; i<=bytes; i++)
+            sum += rec[i];
+        if (sum != 0xff) {
+            fprintf(stderr, _("%s: bad SREC checksum\n"), filename);
+            exit(1);
+        }
+
+        switch (p[1]) {
+        case '1': alen = 2; break;
+        case '2': alen = 3; break;
+        case '3': alen = 4; break;
+        default:
+            /* Header or count record, ignore. */
+            continue;
+        }
+        if (bytes < alen + 1)
+            goto bad_record;
+
+        address = 0;
+        for (i=1; i<=alen; i++)
+            address = (address << 8) | rec[i];
+        (*store)(arg, address, rec + 1 + alen, bytes - alen - 1);
+    }
+    return 1;
+}
+
+/*
+ * Fields of ELF file header and program header.
+ */
+#define EI_CLASS        4
+#define EI_DATA         5
+#define ELFCLASS32      1
+#define ELFDATA2LSB     1
+#define EM_MIPS         8
+#define PT_LOAD         1
+
+#define EH_MACHINE      18
+#define EH_PHOFF        28
+#define EH_PHENTSIZE    42
+#define EH_PHNUM        44
+#define EH_SIZE         52
+
+#define PH_TYPE         0
+#define PH_OFFSET       4
+#define PH_PADDR        12
+#define PH_FILESZ       16
+#define PH_SIZE         32
+
+static inline unsigned get16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline unsigned get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+/*
+ * Parse ELF format.
+ * Every loadable segment is passed to store() directly
+ * from the mapped file, at its load (physical) address.
+ */
+int loader_elf(const char *filename, const loader_file_t *file,
+    loader_store_t *store, void *arg)
+{
+    const unsigned char *hdr = file->data;
+    const unsigned char *ph;
+    unsigned phoff, phentsize, phnum, offset, nbytes, i;
+
+    if (file->size < EH_SIZE || memcmp(hdr, "\177ELF", 4) != 0)
+        return 0;
+    if (hdr[EI_CLASS] != ELFCLASS32 || hdr[EI_DATA] != ELFDATA2LSB ||
+        get16(hdr + EH_MACHINE) != EM_MIPS) {
+        fprintf(stderr, _("%s: not a 32-bit little-endian MIPS ELF file\n"),
+            filename);
+        exit(1);
+    }
+    phoff = get32(hdr + EH_PHOFF);
+    phentsize = get16(hdr + EH_PHENTSIZE);
+    phnum = get16(hdr + EH_PHNUM);
+    if (phentsize < PH_SIZE || phoff > file->size ||
+        phnum > (file->size - phoff) / phentsize) {
+        fprintf(stderr, _("%s: bad ELF program header\n"), filename);
+        exit(1);
+    }
+
+    for (i=0; i<phnum; i++) {
+        ph = hdr + phoff + i * phentsize;
+        if (get32(ph + PH_TYPE) != PT_LOAD)
+            continue;
+        offset = get32(ph + PH_OFFSET);
+        nbytes = get32(ph + PH_FILESZ);
+        if (nbytes == 0)
+            continue;
+        if (offset > file->size || nbytes > file->size - offset) {
+            fprintf(stderr, _("%s: ELF segment out of file\n"), filename);
+            exit(1);
+        }
+        (*store)(arg, get32(ph + PH_PADDR), hdr + offset, nbytes);
+    }
+    return 1;
+}
@@ -13,11 +13,17 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <ctype.h>
 #include <signal.h>
 #include <getopt.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#ifndef MINGW32
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include <time.h>
 #include <libgen.h>
 #include <locale.h>
@@ -27,29 +33,42 @@
 #include "localize.h"
 #include "adapter.h"
 #include "console.h"
+#include "loader.h"
+#include "image.h"
+#include "container.h"
+#include "cache.h"
+#include "crc16.h"
+#include "report.h"
+#include "trace.h"
+#include "transport.h"
+#include "capture.h"
 
 #include "config.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifndef GITVERSION
 #define GITVERSION         "2.1."GITCOUNT
 #endif
-#define MINBLOCKSZ      128
-#define FLASHV_BASE     0x9d000000
-#define BOOTV_BASE      0x9fc00000
 #define FLASHP_BASE     0x1d000000
 #define BOOTP_BASE      0x1fc00000
-#define FLASH_BYTES     (2048 * 1024)
-#define BOOT_BYTES      (80 * 1024)
+#define FLASH_BYTES     (16 * 1024 * 1024)    /* Max size of flash region */
+#define BOOT_BYTES      (4 * 1024 * 1024)     /* Max size of boot region */
+#define KSEG0(addr)     ((addr) | 0x80000000) /* Physical to virtual address */
 
-/* Macros for converting between hex and binary. */
-#define NIBBLE(x)       (isdigit(x) ? (x)-'0' : tolower(x)+10-'a')
-#define HEX(buffer)     ((NIBBLE((buffer)[0])<<4) + NIBBLE((buffer)[1]))
+/*
+ * Smallest row size of all families: the file is parsed
+ * before the target is known, and rows are merged later.
+ */
+#define PARSE_ROW_SIZE  128
+
+#define MAX_GANG        32      /* Max number of boards in gang mode */
+
+#define DAEMON_STATUS   "#status "  /* Last line of daemon reply */
 
 /* Data to write */
-unsigned char boot_data [BOOT_BYTES];
-unsigned char flash_data [FLASH_BYTES];
-unsigned char boot_dirty [BOOT_BYTES / MINBLOCKSZ];
-unsigned char flash_dirty [FLASH_BYTES / MINBLOCKSZ];
+image_t image;
 unsigned blocksz;               /* Size of flash memory block */
 unsigned boot_used;
 unsigned flash_used;
@@ -58,255 +77,161 @@ unsigned flash_bytes;
 unsigned devcfg_offset;         /* Offset of devcfg registers in boot data */
 int total_bytes;
 
-unsigned long open_retries = 1;
-unsigned long open_delay = 100;
 unsigned force;
 
-int quiet = 0;
-
 
-#define devcfg3 (*(unsigned*) &boot_data [devcfg_offset])
-#define devcfg2 (*(unsigned*) &boot_data [devcfg_offset + 4])
-#define devcfg1 (*(unsigned*) &boot_data [devcfg_offset + 8])
-#define devcfg0 (*(unsigned*) &boot_data [devcfg_offset + 12])
+#define devcfg3 image_read_word(&image, BOOTP_BASE + devcfg_offset)
+#define devcfg2 image_read_word(&image, BOOTP_BASE + devcfg_offset + 4)
+#define devcfg1 image_read_word(&image, BOOTP_BASE + devcfg_offset + 8)
+#define devcfg0 image_read_word(&image, BOOTP_BASE + devcfg_offset + 12)
 
 unsigned progress_count;
 int verify_only;
 int erase_only = 0;
 int skip_verify = 0;
-int debug_level;
+int incremental = 0;            /* Reprogram only changed pages */
+int use_cache = 0;              /* Skip programming of unchanged devices */
+int verify_policy;              /* How to verify the written data */
+int blank_check;                /* Skip erase when the chip is blank */
+int image_loaded;               /* Image is parsed before opening target */
+const char *gang_port [MAX_GANG]; /* Adapters for gang programming */
+int gang_count;
+const char *daemon_path;        /* Socket to serve as daemon */
+const char *connect_path;       /* Socket of the daemon to use */
+const char *report_file;        /* Write timing report in JSON format */
+const char *report_status = "failed";
+const char *trace_file;         /* Write trace of adapter operations */
+int bench_link;                 /* Measure speed of the link */
+const char *record_file;        /* Record adapter transfers */
+const char *replay_file;        /* Replay adapter transfers */
+cache_t cache;
+const char *compile_family;     /* Family name for compiling a container */
 int power_on;
 target_t *target;
 const char *target_port;        /* Optional name of target serial or USB port */
 int target_speed = 115200;      /* Baud rate for serial port */
-int alternate_speed = 115200;   /* Alternate speed for serial port */
 char *progname;
 const char *copyright;
 
 void *fix_time()
 {
-    static struct timeval t0;
+    static unsigned long long t0;
 
-    gettimeofday(&t0, 0);
+    t0 = report_clock();
     return &t0;
 }
 
 unsigned mseconds_elapsed(void *arg)
 {
-    struct timeval t1, *t0 = arg;
+    unsigned long long *t0 = arg;
     unsigned mseconds;
 
-    gettimeofday(&t1, 0);
-    mseconds = (t1.tv_sec - t0->tv_sec) * 1000 +
-        (t1.tv_usec - t0->tv_usec) / 1000;
+    mseconds = (report_clock() - *t0) / 1000000;
     if (mseconds < 1)
         mseconds = 1;
     return mseconds;
 }
 
-void store_data(unsigned address, unsigned byte, unsigned blocksz)
+/*
+ * Store the payload of one record.
+ * The address range is checked once for the whole record;
+ * data outside of the region is ignored.
+ */
+void store_record(void *arg, unsigned address,
+    const unsigned char *data, unsigned nbytes)
 {
-    unsigned offset;
+    unsigned base, limit;
 
-    if (address >= BOOTV_BASE && address < BOOTV_BASE + BOOT_BYTES) {
-        /* Boot code, virtual. */
-        offset = address - BOOTV_BASE;
-        boot_data [offset] = byte;
-        boot_used = 1;
-        boot_dirty [offset / blocksz] = 1;
-
-    } else if (address >= BOOTP_BASE && address < BOOTP_BASE + BOOT_BYTES) {
-        /* Boot code, physical. */
-        offset = address - BOOTP_BASE;
-        boot_data [offset] = byte;
+    if (address >= 0x80000000 && address < 0xC0000000) {
+        /* Virtual address in KSEG0 or KSEG1. */
+        address &= 0x1fffffff;
+    }
+    if (address - BOOTP_BASE < BOOT_BYTES ||
+        BOOTP_BASE - address < nbytes) {
+        /* Boot code. */
+        base = BOOTP_BASE;
+        limit = BOOTP_BASE + BOOT_BYTES;
         boot_used = 1;
-        boot_dirty [offset / blocksz] = 1;
 
-    } else if (address >= FLASHV_BASE && address < FLASHV_BASE + FLASH_BYTES) {
-        /* Main flash memory, virtual. */
-        offset = address - FLASHV_BASE;
-        flash_data [offset] = byte;
+    } else if (address - FLASHP_BASE < FLASH_BYTES ||
+        FLASHP_BASE - address < nbytes) {
+        /* Main flash memory. */
+        base = FLASHP_BASE;
+        limit = FLASHP_BASE + FLASH_BYTES;
         flash_used = 1;
-        flash_dirty [offset / blocksz] = 1;
 
-    } else if (address >= FLASHP_BASE && address < FLASHP_BASE + FLASH_BYTES) {
-        /* Main flash memory, physical. */
-        offset = address - FLASHP_BASE;
-        flash_data [offset] = byte;
-        flash_used = 1;
-        flash_dirty [offset / blocksz] = 1;
     } else {
         /* Ignore incorrect data. */
-        //fprintf(stderr, _("%08X: address out of flash memory\n"), address);
         return;
     }
-    total_bytes++;
+
+    if (address < base) {
+        /* Skip the head of record, below the region. */
+        nbytes -= base - address;
+        data += base - address;
+        address = base;
+    }
+    if (nbytes > limit - address)
+        nbytes = limit - address;
+    image_write(&image, address, data, nbytes);
+    total_bytes += nbytes;
 }
 
 /*
- * Read the S record file.
+ * Read the firmware file in container, ELF, HEX or SREC format.
  */
-int read_srec(char *filename, unsigned blocksz)
+int read_file(char *filename)
 {
-    FILE *fd;
-    unsigned char buf [256];
-    unsigned char *data;
-    unsigned address;
-    int i, bytes;
-
-    for (i = 0; i < FLASH_BYTES / MINBLOCKSZ; i++) {
-        flash_dirty[i] = 0;
-    }
-
-    for (i = 0; i < BOOT_BYTES / MINBLOCKSZ; i++) {
-        boot_dirty[i] = 0;
-    }
-
-    fd = fopen(filename, "r");
-    if (! fd) {
-        perror(filename);
-        exit(1);
-    }
-    while (fgets((char*) buf, sizeof(buf), fd)) {
-        if (buf[0] == '\n')
-            continue;
-        if (buf[0] != 'S') {
-            fclose(fd);
-            return 0;
-        }
-        if (buf[1] == '7' || buf[1] == '8' || buf[1] == '9')
-            break;
-
-        /* Starting an S-record.  */
-        if (! isxdigit(buf[2]) || ! isxdigit(buf[3])) {
-            fprintf(stderr, _("%s: bad SREC record: %s\n"), filename, buf);
-            exit(1);
-        }
-        bytes = HEX(buf + 2);
-
-        /* Ignore the checksum byte.  */
-        --bytes;
-
-        address = 0;
-        data = buf + 4;
-        switch (buf[1]) {
-        case '3':
-            address = HEX(data);
-            data += 2;
-            --bytes;
-            /* Fall through.  */
-        case '2':
-            address = (address << 8) | HEX(data);
-            data += 2;
-            --bytes;
-            /* Fall through.  */
-        case '1':
-            address = (address << 8) | HEX(data);
-            data += 2;
-            address = (address << 8) | HEX(data);
-            data += 2;
-            bytes -= 2;
-
-            while (bytes-- > 0) {
-                store_data(address++, HEX(data), blocksz);
-                data += 2;
-            }
-            break;
-        }
-    }
-    fclose(fd);
-    return 1;
+    loader_file_t file;
+    unsigned nbytes;
+    int read_ok;
+
+    loader_map(filename, &file);
+    read_ok = container_load(filename, &file, &image, store_record, 0, &nbytes);
+    if (read_ok)
+        total_bytes = nbytes;
+    if (! read_ok)
+        read_ok = loader_elf(filename, &file, store_record, 0);
+    if (! read_ok)
+        read_ok = loader_hex(filename, &file, store_record, 0);
+    if (! read_ok)
+        read_ok = loader_srec(filename, &file, store_record, 0);
+    loader_unmap(&file);
+    return read_ok;
 }
 
+#ifdef HAVE_PTHREAD
 /*
- * Read HEX file.
+ * The file is parsed on a separate thread, while the target is opened.
  */
-int read_hex(char *filename, unsigned blocksz)
-{
-    FILE *fd;
-    unsigned char buf [256], data[16], record_type, sum;
-    unsigned address, high;
-    int bytes, i;
+static pthread_t parse_thread;
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parse_cond = PTHREAD_COND_INITIALIZER;
+static unsigned parse_row_size;         /* Row size of target, 0 until known */
+static int parse_status;
 
-    for (i = 0; i < FLASH_BYTES / MINBLOCKSZ; i++) {
-        flash_dirty[i] = 0;
-    }
-
-    for (i = 0; i < BOOT_BYTES / MINBLOCKSZ; i++) {
-        boot_dirty[i] = 0;
-    }
+static void *parse_file(void *arg)
+{
+    unsigned addr;
 
-    fd = fopen(filename, "r");
-    if (! fd) {
-        perror(filename);
-        exit(1);
-    }
-    high = 0;
-    while (fgets((char*) buf, sizeof(buf), fd)) {
-        if (buf[0] == '\n')
-            continue;
-        if (buf[0] != ':') {
-            fclose(fd);
-            return 0;
-        }
-        if (! isxdigit(buf[1]) || ! isxdigit(buf[2]) ||
-            ! isxdigit(buf[3]) || ! isxdigit(buf[4]) ||
-            ! isxdigit(buf[5]) || ! isxdigit(buf[6]) ||
-            ! isxdigit(buf[7]) || ! isxdigit(buf[8])) {
-            fprintf(stderr, _("%s: bad HEX record: %s\n"), filename, buf);
-            exit(1);
-        }
-        record_type = HEX(buf+7);
-        if (record_type == 1) {
-            /* End of file. */
-                break;
-            }
-        if (record_type == 5) {
-            /* Start address, ignore. */
-            continue;
-        }
+    parse_status = read_file(arg);
 
-        bytes = HEX(buf+1);
-        if (strlen((char*) buf) < bytes * 2 + 11) {
-            fprintf(stderr, _("%s: too short hex line\n"), filename);
-            exit(1);
-        }
-        address = high << 16 | HEX(buf+3) << 8 | HEX(buf+5);
+    /* Wait for the target to be identified. */
+    pthread_mutex_lock(&parse_lock);
+    while (parse_row_size == 0)
+        pthread_cond_wait(&parse_cond, &parse_lock);
+    pthread_mutex_unlock(&parse_lock);
 
-        sum = 0;
-        for (i=0; i<bytes; ++i) {
-                data [i] = HEX(buf+9 + i + i);
-            sum += data [i];
-        }
-        sum += record_type + bytes + (address & 0xff) + (address >> 8 & 0xff);
-        if (sum != (unsigned char) - HEX(buf+9 + bytes + bytes)) {
-            fprintf(stderr, _("%s: bad HEX checksum\n"), filename);
-            exit(1);
-        }
+    if (parse_status) {
+        image_set_row_size(&image, parse_row_size);
 
-        if (record_type == 4) {
-            /* Extended address. */
-                if (bytes != 2) {
-                    fprintf(stderr, _("%s: invalid HEX linear address record length\n"),
-                        filename);
-                    exit(1);
-                }
-            high = data[0] << 8 | data[1];
-            continue;
-        }
-        if (record_type != 0) {
-                fprintf(stderr, _("%s: unknown HEX record type: %d\n"),
-                    filename, record_type);
-                exit(1);
-        }
-        //printf("%08x: %u bytes\n", address, bytes);
-        for (i=0; i<bytes; i++) {
-            store_data(address++, data [i], blocksz);
-        }
+        /* Precompute checksums of rows. */
+        for (addr=0; image_next_row(&image, &addr, 0xffffffff); addr+=parse_row_size)
+            image_row_crc(&image, addr);
     }
-    fclose(fd);
-    return 1;
+    return 0;
 }
+#endif
 
 void print_symbols(char symbol, int cnt)
 {
@@ -341,15 +266,33 @@ void interrupted(int signum)
     _exit(-1);
 }
 
-void do_probe()
+/*
+ * Write the timing report at exit, successful or not.
+ */
+static void write_report(void)
+{
+    if (report_file)
+        report_write_json(report_file, report_status);
+}
+
+/*
+ * Open and detect the device, unless it is kept open by the daemon.
+ */
+static void open_target(void)
 {
-    /* Open and detect the device. */
+    if (target)
+        return;
     atexit(quit);
     target = target_open(target_port, target_speed);
     if (! target) {
         fprintf(stderr, _("Error detecting device -- check cable!\n"));
         exit(1);
     }
+}
+
+void do_probe()
+{
+    open_target();
 
     if ((target->adapter->flags & AD_PROBE) == 0) {
         fprintf(stderr, _("Error: Target probe not supported.\n"));
@@ -370,77 +313,394 @@ void do_probe()
  */
 void program_block(target_t *mc, unsigned addr)
 {
-    unsigned char *data;
-    unsigned offset;
-
-    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
-    }
-    target_program_block(mc, addr, blocksz/4, (unsigned*) (data + offset));
+    target_program_block(mc, KSEG0(addr), blocksz/4,
+        (unsigned*) image_row(&image, addr));
 }
 
 int verify_block(target_t *mc, unsigned addr)
 {
-    unsigned char *data;
-    unsigned offset;
-
-    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
-    }
-    target_verify_block(mc, addr, blocksz/4, (unsigned*) (data + offset));
+    target_verify_block_crc(mc, KSEG0(addr), blocksz/4,
+        (unsigned*) image_row(&image, addr), image_row_crc(&image, addr));
     return 1;
 }
 
-void do_erase()
+/*
+ * Verification policies.
+ */
+enum {
+    VERIFY_DEFAULT,                     /* Cheapest supported by adapter */
+    VERIFY_READBACK,                    /* Read all data back */
+    VERIFY_ROW,                         /* Checksum of every row */
+    VERIFY_EXTENT,                      /* Checksum of contiguous rows */
+    VERIFY_SAMPLE,                      /* Checksum of every 8th row */
+};
+
+static const char *verify_policy_name[] = {
+    "default", "readback", "row", "extent", "sample", 0
+};
+
+#define SAMPLE_RATE     8
+
+/*
+ * Verify rows of the region, according to the policy.
+ * Mismatching extents are rechecked by rows, to locate the error.
+ */
+static void verify_region(unsigned base, unsigned limit, unsigned step,
+    int devcfg_only)
 {
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
+    unsigned devcfg_row = (BOOTP_BASE + devcfg_offset) & ~(blocksz - 1);
+    unsigned addr, start, row, crc, flash_crc, nrows = 0;
+
+    for (addr=base; image_next_row(&image, &addr, limit); ) {
+        if (addr == devcfg_row || devcfg_only) {
+            /* Configuration words are masked on read. */
+            if (addr == devcfg_row)
+                verify_block(target, addr);
+            progress(step);
+            addr += blocksz;
+            continue;
+        }
+        switch (verify_policy) {
+        case VERIFY_READBACK:
+            if (target->adapter->read_data)
+                target_readback_block(target, KSEG0(addr), blocksz/4,
+                    (unsigned*) image_row(&image, addr));
+            else
+                target_verify_block(target, KSEG0(addr), blocksz/4,
+                    (unsigned*) image_row(&image, addr));
+            break;
+        case VERIFY_SAMPLE:
+            if (nrows++ % SAMPLE_RATE != 0)
+                break;
+            /* fall through */
+        case VERIFY_ROW:
+            verify_block(target, addr);
+            break;
+        case VERIFY_EXTENT:
+            /* Find the end of contiguous rows. */
+            start = addr;
+            crc = CRC16_PE_SEED;
+            for (;;) {
+                crc = crc16(crc, image_row(&image, addr), blocksz);
+                if (addr + blocksz >= limit || addr + blocksz == devcfg_row ||
+                    ! image_row(&image, addr + blocksz))
+                    break;
+                addr += blocksz;
+                progress(step);
+            }
+            flash_crc = target_get_crc(target, KSEG0(start), addr + blocksz - start);
+            if (flash_crc != crc) {
+                /* Locate the mismatch. */
+                for (row=start; row<=addr; row+=blocksz)
+                    verify_block(target, row);
+
+                /* All rows match: check the extent once again. */
+                flash_crc = target_get_crc(target, KSEG0(start), addr + blocksz - start);
+                if (flash_crc != crc) {
+                    conprintf(_("\nchecksum failed at addresses %08X-%08X: file=%04X, mem=%04X\n"),
+                        KSEG0(start), KSEG0(addr + blocksz - 1), crc, flash_crc);
+                    exit(1);
+                }
+            }
+            break;
+        }
+        progress(step);
+        addr += blocksz;
+    }
+}
+
+/*
+ * Queue of adapter requests: rows are programmed and verified
+ * in one pass, the checksum of a row is requested while
+ * the next row is programmed.
+ */
+static adapter_req_t queue [2*AQ_DEPTH];
+static unsigned queue_count;
+static unsigned queue_prev_row = ~0;
+
+static void row_verified(adapter_req_t *req)
+{
+    unsigned crc = image_row_crc(&image, req->addr);
+
+    if (req->result != crc) {
+        conprintf(_("\nchecksum failed at address %08X: file=%04X, mem=%04X\n"),
+            KSEG0(req->addr), crc, req->result);
         exit(1);
     }
+}
+
+static void queue_request(int op, unsigned addr)
+{
+    adapter_req_t *req = &queue[queue_count++ % (2*AQ_DEPTH)];
+
+    memset(req, 0, sizeof(*req));
+    req->op = op;
+    req->addr = KSEG0(addr);
+    req->nwords = blocksz / 4;
+    req->data = (unsigned*) image_row(&image, addr);
+    if (op == AQ_GET_CRC)
+        req->done = row_verified;
+    target_submit(target, req);
+}
+
+/*
+ * Program a row, and request checksum of the previous one.
+ * The row with configuration words is verified by readback later.
+ */
+static void program_block_queued(unsigned addr)
+{
+    if (addr == ((BOOTP_BASE + devcfg_offset) & ~(blocksz - 1))) {
+        target_sync(target);
+        program_block(target, addr);
+        return;
+    }
+    queue_request(AQ_PROGRAM_ROW, addr);
+    if (queue_prev_row != ~0)
+        queue_request(AQ_GET_CRC, queue_prev_row);
+    queue_prev_row = addr;
+
+    /* Compute the checksum while the PE is busy. */
+    image_row_crc(&image, addr);
+}
+
+static void queue_finish(void)
+{
+    if (queue_prev_row != ~0)
+        queue_request(AQ_GET_CRC, queue_prev_row);
+    queue_prev_row = ~0;
+    target_sync(target);
+}
+
+/*
+ * Clear the highest bit of a configuration word in boot memory.
+ */
+static void clear_devsign(unsigned addr)
+{
+    unsigned char *row = image_row(&image, addr);
+    unsigned char byte;
+
+    if (row) {
+        byte = row[addr & (blocksz - 1)] & 0x7f;
+        image_write(&image, addr, &byte, 1);
+    }
+}
+
+/*
+ * Verify DEVCFGx values.
+ */
+static void check_devcfg(void)
+{
+    if (boot_used && !force) {
+        if (devcfg0 == 0xffffffff) {
+            fprintf(stderr, _("DEVCFG values are missing -- check your HEX file!\n"));
+            exit(1);
+        }
+        if (devcfg_offset == 0xffc0) {
+            /* For MZ family, clear bits DEVSIGN0[31] and ADEVSIGN0[31]. */
+            clear_devsign(BOOTP_BASE + 0xFFEF);
+            clear_devsign(BOOTP_BASE + 0xFF6F);
+        }
+    }
+}
+
+/*
+ * Program only the pages of flash memory, which differ from the image.
+ * Pages without data in the image are left untouched.
+ * Return the number of reprogrammed pages.
+ */
+static unsigned program_changed_pages(unsigned base, unsigned nbytes,
+    unsigned *npages)
+{
+    unsigned page_size = target_page_size(target);
+    unsigned page, addr, nchanged = 0;
+    unsigned char *row, data [page_size];
+
+    for (page=base; image_next_row(&image, &page, base + nbytes); page+=page_size) {
+        page &= ~(page_size - 1);
+        ++*npages;
+
+        /* Gather the page contents, erased rows are 0xff. */
+        for (addr=0; addr<page_size; addr+=blocksz) {
+            row = image_row(&image, page + addr);
+            if (row)
+                memcpy(data + addr, row, blocksz);
+            else
+                memset(data + addr, 0xff, blocksz);
+        }
+        if (target_compare_page(target, KSEG0(page), (unsigned*) data)) {
+            putchar('.');
+            fflush(stdout);
+            continue;
+        }
+
+        target_erase_page(target, KSEG0(page));
+        for (addr=page; image_next_row(&image, &addr, page + page_size); addr+=blocksz)
+            program_block(target, addr);
+        if (! skip_verify) {
+            for (addr=page; image_next_row(&image, &addr, page + page_size); addr+=blocksz)
+                verify_block(target, addr);
+        }
+        putchar('#');
+        fflush(stdout);
+        nchanged++;
+    }
+    return nchanged;
+}
+
+/*
+ * Update flash memory page by page, comparing checksums
+ * of the image with the target contents.
+ */
+static unsigned do_update(void)
+{
+    unsigned npages = 0, nchanged = 0, msec;
+    void *t0;
+
+    t0 = fix_time();
+    if (flash_used) {
+        conprintf(_(" Update flash: "));
+        report_begin(PHASE_PROGRAM);
+        nchanged += program_changed_pages(FLASHP_BASE, flash_bytes, &npages);
+        report_end(PHASE_PROGRAM);
+        conprintf(_(" done\n"));
+    }
+    if (boot_used) {
+        conprintf(_("  Update boot: "));
+        report_begin(PHASE_BOOT);
+        nchanged += program_changed_pages(BOOTP_BASE, boot_bytes, &npages);
+        report_end(PHASE_BOOT);
+        conprintf(_(" done\n"));
+    }
+    conprintf(_("        Pages: %u checked, %u changed, %u kbytes skipped\n"),
+        npages, nchanged, (npages - nchanged) * target_page_size(target) / 1024);
+    msec = mseconds_elapsed(t0);
+    conprintf(_("  Update time: %u msec\n"), msec);
+    return msec;
+}
+
+/*
+ * Find the range of rows with data in the given region.
+ */
+static void get_span(cache_span_t *span, unsigned base, unsigned nbytes)
+{
+    unsigned addr = base;
+
+    memset(span, 0, sizeof(*span));
+    if (! image_next_row(&image, &addr, base + nbytes))
+        return;
+    span->base = addr;
+    for (; image_next_row(&image, &addr, base + nbytes); addr+=blocksz)
+        span->nbytes = addr + blocksz - span->base;
+}
+
+static int span_matches(const cache_span_t *span)
+{
+    if (span->nbytes == 0)
+        return 1;
+    return target_get_crc(target, KSEG0(span->base), span->nbytes) == (int) span->crc;
+}
+
+/*
+ * Check whether the device already holds the image,
+ * programmed by one of previous sessions.
+ * Executive must be loaded.
+ */
+static int cache_check(cache_entry_t *entry)
+{
+    cache_entry_t *cached;
+
+    cache_load(&cache, 0);
+    memset(entry, 0, sizeof(*entry));
+    entry->cpuid = target_idcode(target);
+    entry->hash = image_hash(&image);
+
+    cached = cache_find(&cache, entry->cpuid, entry->hash);
+    if (cached && span_matches(&cached->flash) && span_matches(&cached->boot)) {
+        *entry = *cached;
+        cache.hits++;
+        cache.saved_msec += entry->msec;
+        conprintf(_("        Cache: hit, %u msec saved\n"), entry->msec);
+        cache_add(&cache, entry);
+        return 1;
+    }
+    cache.misses++;
+    conprintf(_("        Cache: miss\n"));
+    return 0;
+}
+
+/*
+ * Remember the checksums of the programmed device.
+ */
+static void cache_record(cache_entry_t *entry, unsigned msec)
+{
+    get_span(&entry->flash, FLASHP_BASE, flash_bytes);
+    get_span(&entry->boot, BOOTP_BASE, boot_bytes);
+    if (entry->flash.nbytes > 0)
+        entry->flash.crc = target_get_crc(target, KSEG0(entry->flash.base),
+            entry->flash.nbytes);
+    if (entry->boot.nbytes > 0)
+        entry->boot.crc = target_get_crc(target, KSEG0(entry->boot.base),
+            entry->boot.nbytes);
+    entry->msec = msec;
+    cache_add(&cache, entry);
+}
+
+static void cache_report(void)
+{
+    cache_save(&cache);
+    conprintf(_("   Cache hits: %u, misses: %u, %lu seconds saved in total\n"),
+        cache.hits, cache.misses, cache.saved_msec / 1000);
+    cache_free(&cache);
+}
+
+/*
+ * Print the JTAG clock, when the adapter has chosen one.
+ */
+static void print_jtag_clock(void)
+{
+    const char *how;
+    unsigned khz = report_get_jtag_clock(&how);
+
+    if (khz)
+        conprintf(_("   JTAG clock: %u kHz, %s\n"), khz, how);
+}
+
+void do_erase()
+{
+    open_target();
 
     if ((target->adapter->flags & AD_ERASE) == 0) {
         fprintf(stderr, _("Error: Target erase not supported.\n"));
         exit(1);
     }
 
-    target_erase(target);
+    report_begin(PHASE_ERASE);
+    target_erase(target, 0);
+    report_end(PHASE_ERASE);
 }
 
 void do_program(char *filename)
 {
-    unsigned addr;
+    unsigned addr, cfg[4], msec = 0;
     int progress_len, progress_step, boot_progress_len;
+    int cache_hit = 0, overlap;
+    cache_entry_t entry;
+    unsigned long long t_erase = 0, t_verify = 0;
     void *t0;
 
-    /* Open and detect the device. */
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
-        exit(1);
+#ifdef HAVE_PTHREAD
+    if (! image_loaded) {
+        /* Start parsing the file. */
+        image_init(&image, PARSE_ROW_SIZE);
+        parse_row_size = 0;
+        if (pthread_create(&parse_thread, 0, parse_file, filename) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+#endif
+
+    open_target();
 
     if ((target->adapter->flags & AD_WRITE) == 0) {
         fprintf(stderr, _("Error: Target write not supported.\n"));
@@ -454,81 +714,123 @@ void do_program(char *filename)
     } else {
         blocksz = target_block_size(target);
     }
+    if (image_loaded) {
+        /* Already parsed by gang master. */
+        image_set_row_size(&image, blocksz);
+    } else {
+#ifdef HAVE_PTHREAD
+        /* Let the parser merge rows. */
+        pthread_mutex_lock(&parse_lock);
+        parse_row_size = blocksz;
+        pthread_cond_signal(&parse_cond);
+        pthread_mutex_unlock(&parse_lock);
+#else
+        image_init(&image, blocksz);
+#endif
+    }
     devcfg_offset = target_devcfg_offset(target);
     conprintf(_("    Processor: %s\n"), target_cpu_name(target));
     conprintf(_(" Flash memory: %d kbytes\n"), flash_bytes / 1024);
     if (boot_bytes > 0)
         conprintf(_("  Boot memory: %d kbytes\n"), boot_bytes / 1024);
 
-
-
-        int read_ok = read_hex(filename, blocksz);
-        if (!read_ok) {
-            read_ok = read_srec(filename, blocksz);
-        }
-        if (!read_ok) {
+    if (! image_loaded) {
+#ifdef HAVE_PTHREAD
+        pthread_join(parse_thread, 0);
+        if (! parse_status) {
+#else
+        if (! read_file(filename)) {
+#endif
             fprintf(stderr, _("%s: bad file format\n"), filename);
             exit(1);
         }
-
+    }
 
     conprintf(_("         Data: %d bytes\n"), total_bytes);
 
-    /* Verify DEVCFGx values. */
-    if (boot_used && !force) {
-        if (devcfg0 == 0xffffffff) {
-            fprintf(stderr, _("DEVCFG values are missing -- check your HEX file!\n"));
-            exit(1);
+    check_devcfg();
+
+    if (use_cache && ! verify_only) {
+        if (target->adapter->get_crc) {
+            target_use_executive(target);
+            cache_hit = cache_check(&entry);
+        } else {
+            conprintf(_("Checksums not supported by adapter, cache disabled\n"));
+            use_cache = 0;
         }
-        if (devcfg_offset == 0xffc0) {
-            /* For MZ family, clear bits DEVSIGN0[31] and ADEVSIGN0[31]. */
-            boot_data[0xFFEF] &= 0x7f;
-            boot_data[0xFF6F] &= 0x7f;
+    }
+
+    if (incremental && ! verify_only && ! cache_hit) {
+        if (target_can_erase_page(target) &&
+            (! boot_used || image_row(&image, BOOTP_BASE + devcfg_offset))) {
+            target_use_executive(target);
+            msec = do_update();
+            if (use_cache) {
+                cache_record(&entry, msec);
+                cache_report();
+            }
+            return;
         }
+        conprintf(_("Page update not supported, programming whole chip\n"));
     }
 
-    if (! verify_only) {
+    if (! verify_only && ! cache_hit) {
         /* Erase flash. */
-        target_erase(target);
+        t_erase = report_clock();
+        report_begin(PHASE_ERASE);
+        target_erase(target, blank_check);
+        report_end(PHASE_ERASE);
+        msec = mseconds_elapsed(&t_erase);
     }
     target_use_executive(target);
 
     /* Compute length of progress indicator for flash memory. */
-    for (progress_step=1; ; progress_step<<=1) {
-        progress_len = 0;
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz])
-                progress_len++;
-        }
-        if (progress_len / progress_step < 64) {
-            progress_len /= progress_step;
-            if (progress_len < 1)
-                progress_len = 1;
-            break;
-        }
-    }
+    progress_len = image_nrows(&image, FLASHP_BASE, FLASHP_BASE + flash_bytes);
+    for (progress_step=1; progress_len / progress_step >= 64; progress_step<<=1)
+        continue;
+    progress_len /= progress_step;
+    if (progress_len < 1)
+        progress_len = 1;
 
     /* Compute length of progress indicator for boot memory. */
-    boot_progress_len = 1;
-    for (addr=0; addr<boot_bytes; addr+=blocksz) {
-        if (boot_dirty [addr / blocksz])
-            boot_progress_len++;
-    }
+    boot_progress_len = 1 +
+        image_nrows(&image, BOOTP_BASE, BOOTP_BASE + boot_bytes);
+
+    /* Select the cheapest verification, supported by the adapter. */
+    if (! target->adapter->get_crc) {
+        if (verify_policy != VERIFY_DEFAULT && verify_policy != VERIFY_READBACK)
+            fprintf(stderr, _("Warning: checksums not supported by adapter, verify policy '%s' replaced by readback\n"),
+                verify_policy_name[verify_policy]);
+        else if (verify_policy == VERIFY_READBACK && ! target->adapter->read_data)
+            fprintf(stderr, _("Warning: readback not supported by adapter, using its own verification\n"));
+        verify_policy = VERIFY_READBACK;
+    } else if (verify_policy == VERIFY_DEFAULT)
+        verify_policy = VERIFY_EXTENT;
+
+    /* Verify rows while programming, when the adapter allows. */
+    overlap = ! verify_only && ! cache_hit && ! skip_verify &&
+        verify_policy == VERIFY_ROW && target_can_queue(target);
 
     progress_count = 0;
     t0 = fix_time();
-    if (! verify_only) {
+    if (! verify_only && ! cache_hit) {
         if (flash_used) {
             conprintf(_("Program flash: "));
             print_symbols('.', progress_len);
             print_symbols('\b', progress_len);
             fflush(stdout);
-            for (addr=0; addr<flash_bytes; addr+=blocksz) {
-                if (flash_dirty [addr / blocksz]) {
-                    program_block(target, addr + FLASHV_BASE);
-                    progress(progress_step);
-                }
+            report_begin(PHASE_PROGRAM);
+            for (addr=FLASHP_BASE; image_next_row(&image, &addr,
+              FLASHP_BASE + flash_bytes); addr+=blocksz) {
+                if (overlap)
+                    program_block_queued(addr);
+                else
+                    program_block(target, addr);
+                progress(progress_step);
             }
+            if (overlap)
+                queue_finish();
+            report_end(PHASE_PROGRAM);
             conprintf(_("# done\n"));
         }
         if (boot_used) {
@@ -536,33 +838,43 @@ void do_program(char *filename)
             print_symbols('.', boot_progress_len);
             print_symbols('\b', boot_progress_len);
             fflush(stdout);
-            for (addr=0; addr<boot_bytes; addr+=blocksz) {
-                if (boot_dirty [addr / blocksz]) {
-                    program_block(target, addr + BOOTV_BASE);
-                    progress(1);
-                }
+            report_begin(PHASE_BOOT);
+            for (addr=BOOTP_BASE; image_next_row(&image, &addr,
+              BOOTP_BASE + boot_bytes); addr+=blocksz) {
+                if (overlap)
+                    program_block_queued(addr);
+                else
+                    program_block(target, addr);
+                progress(1);
             }
+            if (overlap)
+                queue_finish();
+            report_end(PHASE_BOOT);
             conprintf(_("# done      \n"));
-            if (! boot_dirty [devcfg_offset / blocksz]) {
+            if (! image_row(&image, BOOTP_BASE + devcfg_offset)) {
                 /* Write chip configuration. */
-                target_program_devcfg(target,
-                    devcfg0, devcfg1, devcfg2, devcfg3);
-                boot_dirty [devcfg_offset / blocksz] = 1;
+                cfg[0] = devcfg3;
+                cfg[1] = devcfg2;
+                cfg[2] = devcfg1;
+                cfg[3] = devcfg0;
+                report_begin(PHASE_DEVCFG);
+                target_program_devcfg(target, cfg[3], cfg[2], cfg[1], cfg[0]);
+                report_end(PHASE_DEVCFG);
+                image_write(&image, BOOTP_BASE + devcfg_offset, cfg, sizeof(cfg));
             }
         }
+        msec += mseconds_elapsed(t0);
     }
-    if (flash_used && !skip_verify) {
+    if (! skip_verify && (flash_used || boot_used))
+        t_verify = report_clock();
+    if (flash_used && !skip_verify && !overlap) {
         conprintf(_(" Verify flash: "));
         print_symbols('.', progress_len);
         print_symbols('\b', progress_len);
         fflush(stdout);
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz]) {
-                progress(progress_step);
-                if (! verify_block(target, addr + FLASHV_BASE))
-                    exit(0);
-            }
-        }
+        report_begin(PHASE_VERIFY);
+        verify_region(FLASHP_BASE, FLASHP_BASE + flash_bytes, progress_step, 0);
+        report_end(PHASE_VERIFY);
         conprintf(_(" done\n"));
     }
     if (boot_used && !skip_verify) {
@@ -570,18 +882,180 @@ void do_program(char *filename)
         print_symbols('.', boot_progress_len);
         print_symbols('\b', boot_progress_len);
         fflush(stdout);
-        for (addr=0; addr<boot_bytes; addr+=blocksz) {
-            if (boot_dirty [addr / blocksz]) {
-                progress(1);
-                if (! verify_block(target, addr + BOOTV_BASE))
-                    exit(0);
-            }
-        }
+        report_begin(PHASE_VERIFY);
+        verify_region(BOOTP_BASE, BOOTP_BASE + boot_bytes, 1, overlap);
+        report_end(PHASE_VERIFY);
         conprintf(_(" done       \n"));
     }
-    if (boot_used || flash_used)
+    if (! skip_verify && ! overlap && (flash_used || boot_used))
+        conprintf(_("  Verify time: %u msec, %s\n"), mseconds_elapsed(&t_verify),
+            verify_policy_name[verify_policy]);
+    if ((boot_used || flash_used) && ! cache_hit)
         conprintf(_(" Program rate: %ld bytes per second\n"),
             total_bytes * 1000L / mseconds_elapsed(t0));
+    print_jtag_clock();
+    if (use_cache) {
+        if (! cache_hit)
+            cache_record(&entry, msec);
+        cache_report();
+    }
+}
+
+#ifndef MINGW32
+/*
+ * Program several boards at once.
+ * The file is parsed once, and every board is driven by a child process,
+ * which shares the image with the parent.
+ * Output of every child is collected into a log, and the last line
+ * of the log is shown in the result table.
+ */
+void do_gang(char *filename)
+{
+    struct {
+        pid_t       pid;
+        FILE        *log;
+        int         status;
+        unsigned    msec;
+        char        message [80];
+    } board [MAX_GANG];
+    struct timeval t0, t1;
+    char line [256], message [256], capture [256];
+    unsigned msec;
+    int i, nok, running, status;
+    pid_t pid;
+
+    image_init(&image, PARSE_ROW_SIZE);
+    if (! read_file(filename)) {
+        fprintf(stderr, _("%s: bad file format\n"), filename);
+        exit(1);
+    }
+    image_loaded = 1;
+    conprintf(_("         Data: %d bytes\n"), total_bytes);
+    conprintf(_("         Gang: %d boards\n"), gang_count);
+    fflush(stdout);
+    fflush(stderr);
+
+    gettimeofday(&t0, 0);
+    for (i=0; i<gang_count; i++) {
+        board[i].log = tmpfile();
+        if (! board[i].log) {
+            perror("tmpfile");
+            exit(1);
+        }
+        board[i].message[0] = 0;
+        board[i].pid = fork();
+        if (board[i].pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (board[i].pid == 0) {
+            /* Child: program one board. */
+            dup2(fileno(board[i].log), 1);
+            dup2(fileno(board[i].log), 2);
+            target_port = gang_port[i];
+            if (report_file) {
+                /* Separate report for every board. */
+                snprintf(line, sizeof(line), "%s.%d", report_file, i+1);
+                report_file = line;
+            }
+            if (trace_file) {
+                snprintf(message, sizeof(message), "%s.%d", trace_file, i+1);
+                trace_open(message);
+            }
+            if (record_file || replay_file) {
+                snprintf(capture, sizeof(capture), "%s.%d",
+                    record_file ? record_file : replay_file, i+1);
+                if (record_file)
+                    capture_record(capture);
+                else
+                    capture_replay(capture);
+            }
+            do_program(filename);
+            report_status = "ok";
+            quit();
+            exit(0);
+        }
+    }
+
+    /* Reports are written by children. */
+    report_file = 0;
+
+    /* Wait for all boards. */
+    for (running=gang_count; running>0; running--) {
+        pid = wait(&status);
+        if (pid < 0) {
+            perror("wait");
+            exit(1);
+        }
+        gettimeofday(&t1, 0);
+        for (i=0; i<gang_count; i++) {
+            if (board[i].pid == pid)
+                break;
+        }
+        if (i == gang_count)
+            continue;
+        board[i].status = status;
+        board[i].msec = (t1.tv_sec - t0.tv_sec) * 1000 +
+            (t1.tv_usec - t0.tv_usec) / 1000;
+
+        /* Keep the last line of the log. */
+        rewind(board[i].log);
+        while (fgets(line, sizeof(line), board[i].log)) {
+            line[strcspn(line, "\r\n")] = 0;
+            if (line[0])
+                snprintf(board[i].message, sizeof(board[i].message), "%.*s",
+                    (int) sizeof(board[i].message) - 1, line);
+        }
+        fclose(board[i].log);
+    }
+    msec = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+    if (msec < 1)
+        msec = 1;
+
+    /* Print results. */
+    printf(_("\nBoard Adapter                        Result   Time, msec\n"));
+    nok = 0;
+    for (i=0; i<gang_count; i++) {
+        int ok = WIFEXITED(board[i].status) && WEXITSTATUS(board[i].status) == 0;
+
+        printf("%-5d %-30s %-8s %-10u %s\n", i+1, gang_port[i],
+            ok ? _("ok") : _("FAILED"), board[i].msec,
+            ok ? "" : board[i].message);
+        nok += ok;
+    }
+    printf(_("Total: %d of %d boards programmed in %u msec, %lu bytes per second\n"),
+        nok, gang_count, msec, (unsigned long) total_bytes * nok * 1000 / msec);
+    if (nok != gang_count)
+        exit(1);
+}
+#endif
+
+/*
+ * Compile the firmware file into a container.
+ */
+void do_compile(char *filename, char *outname)
+{
+    const family_t *family;
+
+    family = target_find_family(compile_family);
+    if (! family) {
+        fprintf(stderr, _("%s: unknown family\n"), compile_family);
+        exit(1);
+    }
+    blocksz = family->bytes_per_row;
+    devcfg_offset = family->devcfg_offset;
+    image_init(&image, blocksz);
+
+    if (! read_file(filename)) {
+        fprintf(stderr, _("%s: bad file format\n"), filename);
+        exit(1);
+    }
+    conprintf(_("         Data: %d bytes\n"), total_bytes);
+    check_devcfg();
+
+    container_write(outname, &image, family, total_bytes);
+    conprintf(_("    Container: %u rows of %u bytes\n"),
+        image_nrows(&image, 0, 0xffffffff), blocksz);
 }
 
 void do_read(char *filename, unsigned base, unsigned nbytes)
@@ -600,13 +1074,7 @@ void do_read(char *filename, unsigned base, unsigned nbytes)
     /* Use 1kbyte blocks. */
     blocksz = 1024;
 
-    /* Open and detect the device. */
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
-        exit(1);
-    }
+    open_target();
 
     if ((target->adapter->flags & AD_READ) == 0) {
         fprintf(stderr, _("Error: Target read not supported.\n"));
@@ -626,6 +1094,7 @@ void do_read(char *filename, unsigned base, unsigned nbytes)
 
     progress_count = 0;
     t0 = fix_time();
+    report_begin(PHASE_READ);
     for (addr=base; addr-base<nbytes; addr+=blocksz) {
         progress(progress_step);
         target_read_block(target, addr, blocksz/4, data);
@@ -634,12 +1103,113 @@ void do_read(char *filename, unsigned base, unsigned nbytes)
             exit(1);
         }
     }
+    report_end(PHASE_READ);
     conprintf(_("# done\n"));
     conprintf(_("         Rate: %ld bytes per second\n"),
         nbytes * 1000L / mseconds_elapsed(t0));
+    print_jtag_clock();
     fclose(fd);
 }
 
+/*
+ * Measure the speed of the link to the target, without touching flash.
+ * The score is inverse to the time of a reference session:
+ * minimal commands, PE load, reading and checksumming fixed regions.
+ */
+#define BENCH_ROUNDS        100             /* Minimal commands */
+#define BENCH_READ_BYTES    (64 * 1024)     /* Region for PE_READ */
+#define BENCH_CRC_BYTES     (256 * 1024)    /* Region for PE_GET_CRC */
+
+static unsigned long long rate(unsigned long long nbytes, unsigned long long nsec)
+{
+    return nsec ? nbytes * 1000000000ULL / nsec : 0;
+}
+
+void do_bench_link()
+{
+    adapter_t *a;
+    unsigned i, addr, nbytes, data [256];
+    unsigned long long t0, latency = 0, pe_load = 0, read = 0, crc = 0, tune;
+    unsigned pe_bytes = 0, read_bytes = 0, crc_bytes = 0;
+    int complete = 1;
+
+    open_target();
+    a = target->adapter;
+    conprintf(_("      Adapter: %s\n"), a->name ? a->name : _("unknown"));
+    conprintf(_("    Processor: %s\n"), target_cpu_name(target));
+
+    /* Round trip of a minimal command, before the PE is started. */
+    t0 = report_clock();
+    for (i=0; i<BENCH_ROUNDS; i++)
+        a->get_idcode(a);
+    latency = (report_clock() - t0) / BENCH_ROUNDS;
+    conprintf(_("   Round trip: %llu usec\n"), latency / 1000);
+
+    /* Write into RAM: download of the PE.
+     * Tuning of the adapter clock is timed apart. */
+    if (a->load_executive && target->family->pe_nwords != 0) {
+        pe_bytes = target->family->pe_nwords * 4;
+        report_enabled = 1;
+        tune = report_phase(PHASE_CLOCK_TUNE)->wall_nsec;
+        t0 = report_clock();
+        target_use_executive(target);
+        pe_load = report_clock() - t0;
+        tune = report_phase(PHASE_CLOCK_TUNE)->wall_nsec - tune;
+        pe_load -= tune;
+        conprintf(_("    RAM write: %u bytes in %llu msec, %llu bytes/sec\n"),
+            pe_bytes, pe_load / 1000000, rate(pe_bytes, pe_load));
+        if (tune != 0)
+            conprintf(_(" Clock tuning: %llu msec\n"), tune / 1000000);
+    } else {
+        conprintf(_("    RAM write: not supported\n"));
+        complete = 0;
+    }
+
+    if (a->read_data) {
+        read_bytes = BENCH_READ_BYTES;
+        if (read_bytes > target->flash_bytes)
+            read_bytes = target->flash_bytes;
+        t0 = report_clock();
+        for (addr=0; addr<read_bytes; addr+=nbytes) {
+            nbytes = read_bytes - addr;
+            if (nbytes > sizeof(data))
+                nbytes = sizeof(data);
+            target_read_block(target, target->flash_addr + addr, nbytes/4, data);
+        }
+        read = report_clock() - t0;
+        conprintf(_("   Flash read: %u bytes in %llu msec, %llu bytes/sec\n"),
+            read_bytes, read / 1000000, rate(read_bytes, read));
+    } else {
+        conprintf(_("   Flash read: not supported\n"));
+        complete = 0;
+    }
+
+    if (a->get_crc) {
+        crc_bytes = BENCH_CRC_BYTES;
+        if (crc_bytes > target->flash_bytes)
+            crc_bytes = target->flash_bytes;
+        t0 = report_clock();
+        target_get_crc(target, target->flash_addr, crc_bytes);
+        crc = report_clock() - t0;
+        conprintf(_("     Checksum: %u bytes in %llu msec, %llu bytes/sec\n"),
+            crc_bytes, crc / 1000000, rate(crc_bytes, crc));
+    } else {
+        conprintf(_("     Checksum: not supported\n"));
+        complete = 0;
+    }
+
+    if (! complete) {
+        conprintf(_("        Score: not comparable, some operations not supported\n"));
+        return;
+    }
+
+    /* Scale to the full reference regions. */
+    t0 = latency * BENCH_ROUNDS + pe_load +
+        read * (BENCH_READ_BYTES / read_bytes) +
+        crc * (BENCH_CRC_BYTES / crc_bytes);
+    conprintf(_("        Score: %llu\n"), 100000000000ULL / t0);
+}
+
 /*
  * Print copying part of license
  */
@@ -686,6 +1256,192 @@ static void gpl_show_warranty(void)
     printf("\n");
 }
 
+#ifndef MINGW32
+/*
+ * Forget the image of a previous daemon command.
+ */
+static void reset_image(void)
+{
+    image_free(&image);
+    total_bytes = 0;
+    boot_used = 0;
+    flash_used = 0;
+}
+
+/*
+ * Execute one command of the daemon.
+ * Return the status for the client: 0 on success.
+ */
+static int daemon_command(int argc, char **argv)
+{
+    reset_image();
+    if (argc == 1 && strcmp(argv[0], "probe") == 0) {
+        do_probe();
+    } else if (argc == 1 && strcmp(argv[0], "erase") == 0) {
+        do_erase();
+    } else if (argc == 2 && strcmp(argv[0], "program") == 0) {
+        verify_only = 0;
+        do_program(argv[1]);
+    } else if (argc == 2 && strcmp(argv[0], "verify") == 0) {
+        verify_only = 1;
+        do_program(argv[1]);
+        verify_only = 0;
+    } else if (argc == 4 && strcmp(argv[0], "read") == 0) {
+        do_read(argv[1], strtoul(argv[2], 0, 0), strtoul(argv[3], 0, 0));
+    } else {
+        fprintf(stderr, _("%s: unknown command\n"), argc > 0 ? argv[0] : "");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Keep the adapter open and the executive loaded,
+ * and execute commands from a local socket.
+ * Each connection gives one command line, like "program file.hex",
+ * and receives the output of the command.
+ * Fatal errors still terminate the daemon.
+ */
+void do_daemon(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock, conn, saved_out, saved_err, argc, status;
+    char line [1024], *argv [8];
+    FILE *in;
+
+    open_target();
+    conprintf(_("    Processor: %s (id %08X)\n"), target_cpu_name(target),
+        target_idcode(target));
+    if (target->adapter->flags & AD_WRITE)
+        target_use_executive(target);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 4) < 0) {
+        perror(path);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    conprintf(_("    Listening: %s\n"), path);
+
+    for (;;) {
+        conn = accept(sock, 0, 0);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            exit(1);
+        }
+        in = fdopen(dup(conn), "r");
+        if (! in || ! fgets(line, sizeof(line), in)) {
+            if (in)
+                fclose(in);
+            close(conn);
+            continue;
+        }
+        fclose(in);
+        for (argc=0; argc<8; argc++) {
+            argv[argc] = strtok(argc ? 0 : line, " \t\r\n");
+            if (! argv[argc])
+                break;
+        }
+        if (argc == 1 && strcmp(argv[0], "quit") == 0) {
+            close(conn);
+            break;
+        }
+
+        /* Send output of the command to the client. */
+        fflush(stdout);
+        fflush(stderr);
+        saved_out = dup(1);
+        saved_err = dup(2);
+        dup2(conn, 1);
+        dup2(conn, 2);
+        status = daemon_command(argc, argv);
+        printf("%s%d\n", DAEMON_STATUS, status);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, 1);
+        dup2(saved_err, 2);
+        close(saved_out);
+        close(saved_err);
+        close(conn);
+    }
+    close(sock);
+    unlink(path);
+}
+
+/*
+ * Send a command to the daemon and print the reply.
+ * Return the exit status of the command.
+ */
+int do_connect(const char *path, const char *command)
+{
+    struct sockaddr_un addr;
+    char line [1024];
+    int sock, status = 1;
+    FILE *in;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    snprintf(line, sizeof(line), "%s\n", command);
+    if (write(sock, line, strlen(line)) != strlen(line)) {
+        perror(path);
+        exit(1);
+    }
+    in = fdopen(sock, "r");
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, DAEMON_STATUS, strlen(DAEMON_STATUS)) == 0) {
+            status = atoi(line + strlen(DAEMON_STATUS));
+            continue;
+        }
+        fputs(line, stdout);
+    }
+    fclose(in);
+    if (status != 0)
+        fprintf(stderr, _("%s: command failed\n"), path);
+    return status;
+}
+
+/*
+ * Get absolute path of a file, for the daemon.
+ */
+static const char *full_path(const char *filename)
+{
+    static char buf [2][1024];
+    static int n;
+    char cwd [1024];
+
+    n ^= 1;
+    if (filename[0] == '/' || ! getcwd(cwd, sizeof(cwd)))
+        return filename;
+    if (snprintf(buf[n], sizeof(buf[n]), "%s/%s", cwd, filename) >=
+        (int) sizeof(buf[n])) {
+        fprintf(stderr, _("%s: file name too long\n"), filename);
+        exit(1);
+    }
+    return buf[n];
+}
+#endif
+
 int main(int argc, char **argv)
 {
     int ch, read_mode = 0;
@@ -696,6 +1452,18 @@ int main(int argc, char **argv)
         { "copying",     0, 0, 'C' },
         { "version",     0, 0, 'V' },
         { "skip-verify", 0, 0, 'S' },
+        { "incremental", 0, 0, 'i' },
+        { "cache",       0, 0, 'k' },
+        { "verify",      1, 0, 'P' },
+        { "blank-check", 0, 0, 'z' },
+        { "daemon",      1, 0, 'L' },
+        { "connect",     1, 0, 'l' },
+        { "report",      1, 0, 'J' },
+        { "trace",       1, 0, 'T' },
+        { "stats",       0, 0, 'X' },
+        { "bench-link",  0, 0, 'Y' },
+        { "record",      1, 0, 'K' },
+        { "replay",      1, 0, 'M' },
         { NULL,          0, 0, 0 },
     };
 
@@ -723,7 +1491,7 @@ int main(int argc, char **argv)
 #endif
     signal(SIGTERM, interrupted);
 
-    while ((ch = getopt_long(argc, argv, "qfvDhrpeCVWSd:b:B:R:o:",
+    while ((ch = getopt_long(argc, argv, "qfvDhrpeikzCVWSc:d:b:B:R:o:P:",
       long_options, 0)) != -1) {
         switch (ch) {
         case 'o':
@@ -752,6 +1520,14 @@ int main(int argc, char **argv)
             continue;
         case 'd':
             target_port = optarg;
+            if (gang_count >= MAX_GANG) {
+                fprintf(stderr, _("Too many adapters, max %d\n"), MAX_GANG);
+                exit(1);
+            }
+            gang_port[gang_count++] = optarg;
+            continue;
+        case 'c':
+            compile_family = optarg;
             continue;
 #ifdef ENABLE_SERIAL
         case 'b':
@@ -787,9 +1563,56 @@ int main(int argc, char **argv)
         case 'S':
             ++skip_verify;
             continue;
+        case 'i':
+            ++incremental;
+            continue;
+        case 'k':
+            ++use_cache;
+            continue;
+        case 'z':
+            ++blank_check;
+            continue;
+        case 'L':
+            daemon_path = optarg;
+            continue;
+        case 'l':
+            connect_path = optarg;
+            continue;
+        case 'P':
+            for (verify_policy=0; verify_policy_name[verify_policy]; verify_policy++)
+                if (strcasecmp(optarg, verify_policy_name[verify_policy]) == 0)
+                    break;
+            if (! verify_policy_name[verify_policy]) {
+                fprintf(stderr, _("%s: unknown verify policy\n"), optarg);
+                exit(1);
+            }
+            continue;
         case 'R':
             open_retries = strtoul(optarg, 0, 0);
             continue;
+        case 'J':
+            if (strncasecmp(optarg, "json", 4) != 0 ||
+                (optarg[4] != 0 && optarg[4] != ':')) {
+                fprintf(stderr, _("%s: unknown report format\n"), optarg);
+                exit(1);
+            }
+            report_file = optarg[4] ? optarg + 5 : "pic32prog-report.json";
+            continue;
+        case 'T':
+            trace_file = optarg;
+            continue;
+        case 'X':
+            ++transport_stats;
+            continue;
+        case 'Y':
+            ++bench_link;
+            continue;
+        case 'K':
+            record_file = optarg;
+            continue;
+        case 'M':
+            replay_file = optarg;
+            continue;
         }
 usage:
         printf("%s.\n\n", copyright);
@@ -802,22 +1625,37 @@ usage:
         printf("\nWrite flash memory:\n");
         printf("       pic32prog [-v] file.srec\n");
         printf("       pic32prog [-v] file.hex\n");
+        printf("       pic32prog [-v] file.elf\n");
         printf("\nRead memory:\n");
         printf("       pic32prog -r file.bin address length\n");
+#ifndef MINGW32
+        printf("\nServe commands, keeping the adapter open:\n");
+        printf("       pic32prog --daemon=socket\n");
+        printf("       pic32prog --connect=socket [-v] [-e] [-r] [args...]\n");
+#endif
+        printf("\nCompile into a container:\n");
+        printf("       pic32prog -c family file.hex file.p32\n");
         printf("\nArgs:\n");
         printf("       file.srec           Code file in SREC format\n");
         printf("       file.hex            Code file in Intel HEX format\n");
+        printf("       file.elf            Code file in ELF format\n");
         printf("       file.bin            Code file in binary format\n");
+        printf("       file.p32            Precompiled image container\n");
         printf("       -q                  Reduce output noise\n");
         printf("       -f                  Force program (bypass DEVCFG check)\n");
         printf("       -v                  Verify only\n");
         printf("       -r                  Read mode\n");
-        printf("       -d device           Use specified serial or USB device\n");
+        printf("       -c family           Compile for family: mx1, mx3, xlp or mz\n");
+        printf("       -d device           Use specified serial or USB device;\n");
+        printf("                           repeat to program several boards at once\n");
 #ifdef ENABLE_SERIAL
         printf("       -b baudrate         Serial speed, default 115200\n");
         printf("       -B alt_baud         Request an alternative baud rate\n");
 #endif
         printf("       -e                  Erase chip\n");
+        printf("       -i, --incremental   Reprogram only the changed pages\n");
+        printf("       -k, --cache         Skip programming when the device already has this image\n");
+        printf("       -z, --blank-check   Skip erase when the chip is already blank\n");
         printf("       -p                  Leave board powered on\n");
         printf("       -D                  Debug mode\n");
         printf("       -h, --help          Print this help message\n");
@@ -825,8 +1663,17 @@ usage:
         printf("       -C, --copying       Print copying information\n");
         printf("       -W, --warranty      Print warranty information\n");
         printf("       -S, --skip-verify   Skip the write verification step\n");
+        printf("       -P, --verify=policy Verify by: readback, row, extent or sample\n");
         printf("       -R,                 Retry opening the port this number of times\n");
         printf("       -o millis           Insert a delay after opening the target\n");
+        printf("       --report=json[:file] Write timing of all phases, default\n");
+        printf("                           file is pic32prog-report.json\n");
+        printf("       --trace=file        Write trace of adapter operations,\n");
+        printf("                           for chrome://tracing or Perfetto\n");
+        printf("       --stats             Print transfer statistics at close\n");
+        printf("       --bench-link        Measure speed of the adapter and target link\n");
+        printf("       --record=file       Save all adapter transfers into file\n");
+        printf("       --replay=file       Run against saved transfers instead of hardware\n");
         printf("\n");
         printf("Available protocols:\n");
 #ifdef ENABLE_AN1388 
@@ -843,6 +1690,7 @@ usage:
 #endif
 #ifdef ENABLE_MPSSE
         printf("        MPSSE\n");
+        printf("        Simulated target (-d sim:mx1|xlp|mx3|mz|CHIP[,param=value...])\n");
 #endif
 #ifdef ENABLE_PICKIT2
         printf("        PICkit2 and PICkit3 with Scripting Firmware (-d pickit2)\n");
@@ -861,20 +1709,73 @@ usage:
     argv += optind;
 
     conprintf(_("Programmer for Microchip PIC32 microcontrollers, Version %s\n"), GITVERSION);
-    memset(boot_data, ~0, BOOT_BYTES);
-    memset(flash_data, ~0, FLASH_BYTES);
 
+    if (report_file) {
+        report_enabled = 1;
+        atexit(write_report);
+    }
+    if (trace_file && gang_count <= 1)
+        trace_open(trace_file);
+    if (record_file && replay_file) {
+        fprintf(stderr, _("Options --record and --replay are exclusive\n"));
+        exit(1);
+    }
+    if (gang_count <= 1) {
+        if (record_file)
+            capture_record(record_file);
+        else if (replay_file)
+            capture_replay(replay_file);
+    }
+
+#ifndef MINGW32
+    if (daemon_path) {
+        if (argc != 0)
+            goto usage;
+        do_daemon(daemon_path);
+        report_status = "ok";
+        quit();
+        return 0;
+    }
+    if (connect_path) {
+        char command [3000];
+
+        if (argc == 0)
+            strcpy(command, erase_only ? "erase" : "probe");
+        else if (argc == 1)
+            snprintf(command, sizeof(command), "%s %s",
+                verify_only ? "verify" : "program", full_path(argv[0]));
+        else if (argc == 3 && read_mode)
+            snprintf(command, sizeof(command), "read %s %s %s",
+                full_path(argv[0]), argv[1], argv[2]);
+        else
+            goto usage;
+        return do_connect(connect_path, command);
+    }
+#endif
     switch (argc) {
     case 0:
-        if (erase_only > 0) {
+        if (bench_link) {
+            do_bench_link();
+        } else if (erase_only > 0) {
             do_erase();
         } else {
             do_probe();
         }
         break;
     case 1: {
+#ifndef MINGW32
+        if (gang_count > 1) {
+            do_gang(argv[0]);
+            break;
+        }
+#endif
         do_program(argv[0]);
         } break;
+    case 2:
+        if (! compile_family)
+            goto usage;
+        do_compile(argv[0], argv[1]);
+        break;
     case 3:
         if (! read_mode)
             goto usage;
@@ -885,6 +1786,7 @@ usage:
     default:
         goto usage;
     }
+    report_status = "ok";
     quit();
     return 0;
 }
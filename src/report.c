@@ -0,0 +1,181 @@
+/*
+ * Timing of programming phases.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "report.h"
+#include "transport.h"
+#include "localize.h"
+
+#define MAX_DEPTH       8               /* Max nesting of phases */
+
+int report_enabled;
+
+static phase_stat_t phase [NPHASES];
+static int stack [MAX_DEPTH];           /* Active phases, innermost last */
+static int depth;
+static unsigned long long mark_wall;    /* Time of last phase change */
+static unsigned long long mark_cpu;
+static unsigned long long start_wall;   /* Time of the first phase */
+static const char *target_name;
+static unsigned target_cpuid;
+static unsigned jtag_khz;
+static const char *jtag_how;            /* Default, tuned or cached */
+
+static const char *phase_name [NPHASES] = {
+    "open", "idcode", "serial_exec", "pe_load", "erase",
+    "program", "boot_program", "devcfg", "verify", "read",
+    "clock_tune",
+};
+
+unsigned long long report_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/*
+ * CPU time of the calling thread, or of the whole process.
+ */
+static unsigned long long cpu_clock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * Charge the time since the last change to the innermost phase.
+ */
+static void account(void)
+{
+    unsigned long long wall = report_clock();
+    unsigned long long cpu = cpu_clock();
+
+    if (depth > 0) {
+        phase[stack[depth-1]].wall_nsec += wall - mark_wall;
+        phase[stack[depth-1]].cpu_nsec += cpu - mark_cpu;
+    } else if (start_wall == 0) {
+        start_wall = wall;
+    }
+    mark_wall = wall;
+    mark_cpu = cpu;
+}
+
+void report_begin(int p)
+{
+    if (! report_enabled)
+        return;
+    account();
+    if (depth < MAX_DEPTH)
+        stack[depth++] = p;
+    phase[p].count++;
+}
+
+void report_end(int p)
+{
+    if (! report_enabled)
+        return;
+    account();
+    if (depth > 0 && stack[depth-1] == p)
+        depth--;
+}
+
+const phase_stat_t *report_phase(int p)
+{
+    account();
+    return &phase[p];
+}
+
+void report_io(unsigned nbytes)
+{
+    transport_payload(nbytes);
+    if (! report_enabled || depth == 0)
+        return;
+    phase[stack[depth-1]].nbytes += nbytes;
+    phase[stack[depth-1]].ntransactions++;
+}
+
+void report_target(const char *cpu_name, unsigned cpuid)
+{
+    target_name = cpu_name;
+    target_cpuid = cpuid;
+}
+
+void report_jtag_clock(unsigned khz, const char *how)
+{
+    jtag_khz = khz;
+    jtag_how = how;
+}
+
+unsigned report_get_jtag_clock(const char **how)
+{
+    if (how)
+        *how = jtag_how;
+    return jtag_khz;
+}
+
+void report_write_json(const char *filename, const char *status)
+{
+    unsigned long long wall, cpu, wait;
+    FILE *fd;
+    int i;
+
+    fd = fopen(filename, "w");
+    if (! fd) {
+        perror(filename);
+        fprintf(stderr, _("Warning: report not written\n"));
+        return;
+    }
+    fprintf(fd, "{\n");
+    fprintf(fd, "  \"status\": \"%s\",\n", status);
+    if (target_name) {
+        fprintf(fd, "  \"processor\": \"%s\",\n", target_name);
+        fprintf(fd, "  \"cpuid\": \"%08x\",\n", target_cpuid);
+    }
+    if (jtag_khz)
+        fprintf(fd, "  \"jtag_khz\": %u,\n", jtag_khz);
+    fprintf(fd, "  \"total_usec\": %llu,\n",
+        start_wall ? (report_clock() - start_wall) / 1000 : 0);
+    fprintf(fd, "  \"phases\": {\n");
+    for (i=0; i<NPHASES; i++) {
+        wall = phase[i].wall_nsec / 1000;
+        cpu = phase[i].cpu_nsec / 1000;
+        wait = (wall > cpu) ? wall - cpu : 0;
+        fprintf(fd, "    \"%s\": { \"count\": %u, \"wall_usec\": %llu, "
+            "\"cpu_usec\": %llu, \"wait_usec\": %llu, \"bytes\": %llu, "
+            "\"transactions\": %lu }%s\n", phase_name[i], phase[i].count,
+            wall, cpu, wait, phase[i].nbytes, phase[i].ntransactions,
+            (i < NPHASES-1) ? "," : "");
+    }
+    fprintf(fd, "  }\n");
+    fprintf(fd, "}\n");
+    if (fclose(fd) != 0) {
+        perror(filename);
+        fprintf(stderr, _("Warning: report not written\n"));
+    }
+}
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include "adapter.h"
 #include "console.h"
+#include "transport.h"
 
 #if defined(__WIN32__) || defined(WIN32)
     #include <windows.h>
@@ -148,7 +149,7 @@ int serial_speed_valid(int bps)
  * Send data to device.
  * Return number of bytes, or -1 on error.
  */
-int serial_write(unsigned char *data, int len)
+static int write_port(unsigned char *data, int len)
 {
 #if defined(__WIN32__) || defined(WIN32)
     DWORD written;
@@ -165,7 +166,7 @@ int serial_write(unsigned char *data, int len)
  * Receive data from device.
  * Return number of bytes, or -1 on error.
  */
-int serial_read(unsigned char *data, int len, int timeout_msec)
+static int read_port(unsigned char *data, int len, int timeout_msec)
 {
 #if defined(__WIN32__) || defined(WIN32)
     DWORD got;
@@ -226,6 +227,32 @@ again:
     return got;
 }
 
+int serial_write(unsigned char *data, int len)
+{
+    int n;
+
+    transport_begin(TRANSPORT_SERIAL, 0, len);
+    if (capture_replaying)
+        n = capture_replay_transfer(TRANSPORT_SERIAL, 0, data, len);
+    else
+        n = write_port(data, len);
+    transport_end(TRANSPORT_SERIAL, 0, data, n);
+    return n;
+}
+
+int serial_read(unsigned char *data, int len, int timeout_msec)
+{
+    int n;
+
+    transport_begin(TRANSPORT_SERIAL, 1, len);
+    if (capture_replaying)
+        n = capture_replay_transfer(TRANSPORT_SERIAL, 1, data, len);
+    else
+        n = read_port(data, len, timeout_msec);
+    transport_end(TRANSPORT_SERIAL, 1, data, n);
+    return n;
+}
+
 /* Blocking read of len data */
 
 int serial_read_full(unsigned char *data, int len, int timeout_msec) {
@@ -239,6 +266,7 @@ int serial_read_full(unsigned char *data, int len, int timeout_msec) {
     while (remaining > 0) {
         retries++;
         if (retries >= 100) return -1;
+        transport_retry(TRANSPORT_SERIAL);
         numRead = serial_read(buf, len, timeout_msec);
         buf += numRead;
         remaining -= numRead;
@@ -251,6 +279,8 @@ int serial_read_full(unsigned char *data, int len, int timeout_msec) {
  */
 void serial_close()
 {
+    if (capture_replaying)
+        return;
 #if defined(__WIN32__) || defined(WIN32)
     SetCommState(fd, &saved_mode);
     CloseHandle(fd);
@@ -272,6 +302,10 @@ int serial_open(const char *devname, int baud_rate)
     struct termios new_mode;
 #endif
 
+    /* On replay, any port name matches the capture. */
+    if (capture_replaying)
+        return capture_open(TRANSPORT_SERIAL, 0) ? 0 : -1;
+
 #if defined(__WIN32__) || defined(WIN32)
     /* Check for the Windows device syntax and bend a DOS device
      * into that syntax to allow higher COM numbers than 9
@@ -360,6 +394,7 @@ int serial_open(const char *devname, int baud_rate)
     if (flags >= 0)
         fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
 #endif
+    capture_open(TRANSPORT_SERIAL, devname);
     return 0;
 }
 
@@ -375,6 +410,9 @@ int serial_baud(int baud_rate)
     struct termios new_mode;
 #endif
 
+    if (capture_replaying)
+        return 0;
+
 #if defined(__WIN32__) || defined(WIN32)
     /* Set serial attributes */
     new_mode = saved_mode;
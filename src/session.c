@@ -0,0 +1,512 @@
+/*
+ * Library interface to the PIC32 flash programmer.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libpic32prog.h"
+#include "target.h"
+#include "adapter.h"
+#include "console.h"
+#include "loader.h"
+#include "image.h"
+#include "container.h"
+#include "localize.h"
+#include "fatal.h"
+
+#include "config.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define FLASHP_BASE     0x1d000000
+#define BOOTP_BASE      0x1fc00000
+#define FLASH_BYTES     (16 * 1024 * 1024)    /* Max size of flash region */
+#define BOOT_BYTES      (4 * 1024 * 1024)     /* Max size of boot region */
+#define KSEG0(addr)     ((addr) | 0x80000000) /* Physical to virtual address */
+
+#define READ_BYTES      1024                  /* Block size for reading */
+
+struct _pic32_session_t {
+    target_t        *target;
+    image_t         image;              /* Data of the last file */
+    unsigned        blocksz;            /* Size of flash memory row */
+    unsigned        devcfg_offset;      /* Offset of devcfg registers in boot data */
+    int             boot_used;
+    int             flash_used;
+    unsigned        total_bytes;        /* Size of data in the file */
+    int             flags;              /* Flags of pic32_program() */
+    int             error;              /* Error code for a fatal error in current step */
+    loader_file_t   file;               /* File being loaded */
+    int             file_mapped;        /* The file is mapped */
+    int             dead;               /* Adapter closed after a fatal error */
+
+    pic32_progress_t *progress;
+    pic32_done_t    *done;
+    void            *arg;
+    unsigned        ndone;              /* Bytes processed */
+    unsigned        ntotal;             /* Bytes to process */
+};
+
+/*
+ * Step of a session operation.
+ */
+typedef int step_t(pic32_session_t *s, const void *arg);
+
+#ifdef HAVE_PTHREAD
+/* Adapters are searched one session at a time. */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Close the adapter, left in unknown state by a fatal error.
+ * Errors while closing are ignored.
+ */
+static void session_abandon(pic32_session_t *s)
+{
+    jmp_buf env, *saved;
+    adapter_t *adapter = s->target->adapter;
+
+    s->dead = 1;
+    s->target->adapter = 0;
+    saved = fatal_catch(&env);
+    if (adapter && setjmp(env) == 0)
+        adapter->close(adapter, 0);
+    fatal_catch(saved);
+}
+
+/*
+ * Run the operation, catching fatal errors.
+ * A fatal error returns the error code of the current step.
+ * Unless the error is in the file, the adapter could be stopped
+ * in the middle of a transfer: it is closed, and all following
+ * operations of the session fail.
+ */
+static int session_run(pic32_session_t *s, step_t *step, const void *arg)
+{
+    jmp_buf env, *saved;
+    int status;
+
+    if (s->dead) {
+        status = PIC32_ERR_ADAPTER;
+        if (s->done)
+            s->done(s->arg, status);
+        return status;
+    }
+    saved = fatal_catch(&env);
+    if (setjmp(env) != 0) {
+        status = s->error;
+        if (s->file_mapped) {
+            /* Fatal error while loading the file. */
+            loader_unmap(&s->file);
+            s->file_mapped = 0;
+        }
+        if (status != PIC32_ERR_FILE && status != PIC32_ERR_FORMAT &&
+            s->target)
+            s->dead = 1;
+    } else {
+        s->error = PIC32_ERR_ADAPTER;
+        status = (*step)(s, arg);
+    }
+    fatal_catch(saved);
+    if (s->dead)
+        session_abandon(s);
+    if (s->done)
+        s->done(s->arg, status);
+    return status;
+}
+
+static void advance(pic32_session_t *s, unsigned nbytes)
+{
+    s->ndone += nbytes;
+    if (s->progress)
+        s->progress(s->arg, s->ndone, s->ntotal);
+}
+
+/*
+ * Store the payload of one record.
+ * Data outside of flash and boot regions is ignored.
+ */
+static void store_record(void *arg, unsigned address,
+    const unsigned char *data, unsigned nbytes)
+{
+    pic32_session_t *s = arg;
+    unsigned base, limit;
+
+    if (address >= 0x80000000 && address < 0xC0000000) {
+        /* Virtual address in KSEG0 or KSEG1. */
+        address &= 0x1fffffff;
+    }
+    if (address - BOOTP_BASE < BOOT_BYTES ||
+        BOOTP_BASE - address < nbytes) {
+        base = BOOTP_BASE;
+        limit = BOOTP_BASE + BOOT_BYTES;
+        s->boot_used = 1;
+
+    } else if (address - FLASHP_BASE < FLASH_BYTES ||
+        FLASHP_BASE - address < nbytes) {
+        base = FLASHP_BASE;
+        limit = FLASHP_BASE + FLASH_BYTES;
+        s->flash_used = 1;
+
+    } else {
+        return;
+    }
+
+    if (address < base) {
+        /* Skip the head of record, below the region. */
+        nbytes -= base - address;
+        data += base - address;
+        address = base;
+    }
+    if (nbytes > limit - address)
+        nbytes = limit - address;
+    image_write(&s->image, address, data, nbytes);
+    s->total_bytes += nbytes;
+}
+
+/*
+ * Clear the highest bit of a configuration word in boot memory.
+ */
+static void clear_devsign(pic32_session_t *s, unsigned addr)
+{
+    unsigned char *row = image_row(&s->image, addr);
+    unsigned char byte;
+
+    if (row) {
+        byte = row[addr & (s->blocksz - 1)] & 0x7f;
+        image_write(&s->image, addr, &byte, 1);
+    }
+}
+
+/*
+ * Read the firmware file into the session image.
+ */
+static int load_file(pic32_session_t *s, const char *filename)
+{
+    loader_file_t *file = &s->file;
+    unsigned nbytes;
+    int read_ok;
+
+    image_free(&s->image);
+    image_init(&s->image, s->blocksz);
+    s->boot_used = 0;
+    s->flash_used = 0;
+    s->total_bytes = 0;
+
+    s->error = PIC32_ERR_FILE;
+    loader_map(filename, file);
+    s->file_mapped = 1;
+
+    s->error = PIC32_ERR_FORMAT;
+    read_ok = container_load(filename, file, &s->image, store_record, s, &nbytes);
+    if (read_ok)
+        s->total_bytes = nbytes;
+    if (! read_ok)
+        read_ok = loader_elf(filename, file, store_record, s);
+    if (! read_ok)
+        read_ok = loader_hex(filename, file, store_record, s);
+    if (! read_ok)
+        read_ok = loader_srec(filename, file, store_record, s);
+    s->file_mapped = 0;
+    loader_unmap(file);
+    if (! read_ok)
+        return PIC32_ERR_FORMAT;
+
+    if (s->boot_used && ! (s->flags & PIC32_FORCE)) {
+        if (image_read_word(&s->image, BOOTP_BASE + s->devcfg_offset + 12) == 0xffffffff)
+            return PIC32_ERR_FORMAT;
+        if (s->devcfg_offset == 0xffc0) {
+            /* For MZ family, clear bits DEVSIGN0[31] and ADEVSIGN0[31]. */
+            clear_devsign(s, BOOTP_BASE + 0xFFEF);
+            clear_devsign(s, BOOTP_BASE + 0xFF6F);
+        }
+    }
+    s->error = PIC32_ERR_ADAPTER;
+    return PIC32_OK;
+}
+
+/*
+ * Compare all rows of the image with flash memory.
+ */
+static void verify_image(pic32_session_t *s)
+{
+    unsigned addr;
+
+    s->error = PIC32_ERR_VERIFY;
+    for (addr=0; image_next_row(&s->image, &addr, 0xffffffff); addr+=s->blocksz) {
+        target_verify_block_crc(s->target, KSEG0(addr), s->blocksz/4,
+            (unsigned*) image_row(&s->image, addr),
+            image_row_crc(&s->image, addr));
+        advance(s, s->blocksz);
+    }
+    s->error = PIC32_ERR_ADAPTER;
+}
+
+/*
+ * Arguments of pic32_open().
+ */
+typedef struct {
+    const char      *port;
+    int             baud_rate;
+} open_args_t;
+
+static int step_open(pic32_session_t *s, const void *arg)
+{
+    const open_args_t *o = arg;
+    target_t *t;
+
+    s->error = PIC32_ERR_NO_TARGET;
+    t = target_alloc();
+    s->target = t;
+    target_connect(t, o->port, o->baud_rate);
+    if (t->adapter->block_override != 0)
+        s->blocksz = t->adapter->block_override;
+    else
+        s->blocksz = target_block_size(t);
+    s->devcfg_offset = target_devcfg_offset(t);
+    image_init(&s->image, s->blocksz);
+    return PIC32_OK;
+}
+
+pic32_session_t *pic32_open(const char *port, int baud_rate, int *error)
+{
+    pic32_session_t *s;
+    open_args_t o;
+    int status;
+
+    s = calloc(1, sizeof(*s));
+    if (! s) {
+        if (error)
+            *error = PIC32_ERR_NOMEM;
+        return 0;
+    }
+    o.port = port;
+    o.baud_rate = baud_rate;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&open_lock);
+#endif
+    status = session_run(s, step_open, &o);
+    if (status != PIC32_OK)
+        free(s->target);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&open_lock);
+#endif
+    if (status != PIC32_OK) {
+        free(s);
+        s = 0;
+    }
+    if (error)
+        *error = status;
+    return s;
+}
+
+static int step_close(pic32_session_t *s, const void *arg)
+{
+    target_close(s->target, *(const int*) arg);
+    return PIC32_OK;
+}
+
+void pic32_close(pic32_session_t *s, int power_on)
+{
+    if (! s)
+        return;
+    s->done = 0;
+    if (! s->dead)
+        session_run(s, step_close, &power_on);
+    free(s->target);
+    image_free(&s->image);
+    free(s);
+}
+
+void pic32_set_callbacks(pic32_session_t *s, pic32_progress_t *progress,
+    pic32_done_t *done, void *arg)
+{
+    s->progress = progress;
+    s->done = done;
+    s->arg = arg;
+}
+
+void pic32_set_verbosity(int level)
+{
+    quiet = (level < 0);
+    debug_level = (level > 0) ? level : 0;
+}
+
+const char *pic32_cpu_name(pic32_session_t *s)
+{
+    return target_cpu_name(s->target);
+}
+
+unsigned pic32_cpuid(pic32_session_t *s)
+{
+    return target_idcode(s->target);
+}
+
+unsigned pic32_flash_bytes(pic32_session_t *s)
+{
+    return target_flash_bytes(s->target);
+}
+
+unsigned pic32_boot_bytes(pic32_session_t *s)
+{
+    return target_boot_bytes(s->target);
+}
+
+static int step_erase(pic32_session_t *s, const void *arg)
+{
+    if ((s->target->adapter->flags & AD_ERASE) == 0)
+        return PIC32_ERR_UNSUPPORTED;
+    target_erase(s->target, 0);
+    return PIC32_OK;
+}
+
+int pic32_erase(pic32_session_t *s)
+{
+    return session_run(s, step_erase, 0);
+}
+
+static int step_program(pic32_session_t *s, const void *filename)
+{
+    target_t *t = s->target;
+    unsigned addr, nrows, cfg[4];
+    int status;
+
+    if ((t->adapter->flags & AD_WRITE) == 0)
+        return PIC32_ERR_UNSUPPORTED;
+    status = load_file(s, filename);
+    if (status != PIC32_OK)
+        return status;
+
+    nrows = image_nrows(&s->image, FLASHP_BASE, FLASHP_BASE + target_flash_bytes(t)) +
+        image_nrows(&s->image, BOOTP_BASE, BOOTP_BASE + target_boot_bytes(t));
+    s->ndone = 0;
+    s->ntotal = nrows * s->blocksz;
+    if (! (s->flags & PIC32_NO_VERIFY))
+        s->ntotal += image_nrows(&s->image, 0, 0xffffffff) * s->blocksz;
+
+    target_erase(t, (s->flags & PIC32_BLANK_CHECK) != 0);
+    target_use_executive(t);
+
+    for (addr=FLASHP_BASE; image_next_row(&s->image, &addr,
+      FLASHP_BASE + target_flash_bytes(t)); addr+=s->blocksz) {
+        target_program_block(t, KSEG0(addr), s->blocksz/4,
+            (unsigned*) image_row(&s->image, addr));
+        advance(s, s->blocksz);
+    }
+    for (addr=BOOTP_BASE; image_next_row(&s->image, &addr,
+      BOOTP_BASE + target_boot_bytes(t)); addr+=s->blocksz) {
+        target_program_block(t, KSEG0(addr), s->blocksz/4,
+            (unsigned*) image_row(&s->image, addr));
+        advance(s, s->blocksz);
+    }
+    if (s->boot_used && ! image_row(&s->image, BOOTP_BASE + s->devcfg_offset)) {
+        /* Write chip configuration. */
+        for (addr=0; addr<4; addr++)
+            cfg[addr] = image_read_word(&s->image,
+                BOOTP_BASE + s->devcfg_offset + addr*4);
+        target_program_devcfg(t, cfg[3], cfg[2], cfg[1], cfg[0]);
+        image_write(&s->image, BOOTP_BASE + s->devcfg_offset, cfg, sizeof(cfg));
+        if (! (s->flags & PIC32_NO_VERIFY))
+            s->ntotal += s->blocksz;
+    }
+
+    if (! (s->flags & PIC32_NO_VERIFY))
+        verify_image(s);
+    return PIC32_OK;
+}
+
+int pic32_program(pic32_session_t *s, const char *filename, int flags)
+{
+    s->flags = flags;
+    return session_run(s, step_program, filename);
+}
+
+static int step_verify(pic32_session_t *s, const void *filename)
+{
+    int status;
+
+    if ((s->target->adapter->flags & AD_READ) == 0)
+        return PIC32_ERR_UNSUPPORTED;
+    status = load_file(s, filename);
+    if (status != PIC32_OK)
+        return status;
+
+    s->ndone = 0;
+    s->ntotal = image_nrows(&s->image, 0, 0xffffffff) * s->blocksz;
+    target_use_executive(s->target);
+    verify_image(s);
+    return PIC32_OK;
+}
+
+int pic32_verify(pic32_session_t *s, const char *filename)
+{
+    s->flags = PIC32_FORCE;
+    return session_run(s, step_verify, filename);
+}
+
+/*
+ * Arguments of pic32_read().
+ */
+typedef struct {
+    unsigned        addr;
+    unsigned        nbytes;
+    unsigned char   *data;
+} read_args_t;
+
+static int step_read(pic32_session_t *s, const void *arg)
+{
+    const read_args_t *r = arg;
+    unsigned offset, len, block [READ_BYTES/4];
+
+    if ((s->target->adapter->flags & AD_READ) == 0)
+        return PIC32_ERR_UNSUPPORTED;
+    if (r->addr & 3)
+        return PIC32_ERR_ARGS;
+
+    s->ndone = 0;
+    s->ntotal = r->nbytes;
+    target_use_executive(s->target);
+    for (offset=0; offset<r->nbytes; offset+=len) {
+        len = r->nbytes - offset;
+        if (len > READ_BYTES)
+            len = READ_BYTES;
+        target_read_block(s->target, r->addr + offset, (len + 3) / 4, block);
+        memcpy(r->data + offset, block, len);
+        advance(s, len);
+    }
+    return PIC32_OK;
+}
+
+int pic32_read(pic32_session_t *s, unsigned addr, unsigned nbytes, void *data)
+{
+    read_args_t r;
+
+    r.addr = addr;
+    r.nbytes = nbytes;
+    r.data = data;
+    return session_run(s, step_read, &r);
+}
+
+const char *pic32_strerror(int error)
+{
+    switch (error) {
+    case PIC32_OK:              return _("Success");
+    case PIC32_ERR_NOMEM:       return _("Out of memory");
+    case PIC32_ERR_NO_TARGET:   return _("Target not found");
+    case PIC32_ERR_UNSUPPORTED: return _("Operation not supported by adapter");
+    case PIC32_ERR_FILE:        return _("Cannot read file");
+    case PIC32_ERR_FORMAT:      return _("Bad file format");
+    case PIC32_ERR_ADAPTER:     return _("Adapter failure");
+    case PIC32_ERR_VERIFY:      return _("Verification failed");
+    case PIC32_ERR_ARGS:        return _("Bad arguments");
+    }
+    return _("Unknown error");
+}
@@ -0,0 +1,1079 @@
+/*
+ * Simulated PIC32 target, behind the MPSSE engine of FT2232H.
+ * Models the TAP state machine, the MTAP and EJTAG TAP controllers,
+ * serial execution of instructions through PRACC, the PE loader,
+ * and the command set of the programming executive. Time is simulated:
+ * every TCK cycle, round trip of the probe and flash operation takes
+ * its configured latency, so the timing is repeatable on any host.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "target.h"
+#include "pic32.h"
+#include "console.h"
+#include "crc16.h"
+#include "report.h"
+
+#define RAM_BYTES       (64 * 1024)     /* Data memory */
+#define FIFO_SIZE       1024            /* PE responses */
+#define CMD_WORDS       (2 + 2048/4)    /* Longest PE command: a row of MZ */
+#define FLASH_BASE      0x1d000000
+#define BOOT_BASE       0x1fc00000
+#define BMXDMSZ         0x1f882040      /* Size of data memory */
+#define DMSEG_FASTDATA  0xff200000      /* FASTDATA area of dmseg */
+#define LOADER_ADDR     0x00000800      /* Physical address of PE loader */
+
+#define REPLY_BYTES     (64 * 1024)     /* Captured data, not read yet */
+#define SYSRST_PIN      0x0200          /* ADBUS/ACBUS bit of /SYSRST */
+
+/*
+ * States of the TAP controller.
+ */
+enum {
+    TAP_RESET, TAP_IDLE,
+    TAP_SELECT_DR, TAP_CAPTURE_DR, TAP_SHIFT_DR, TAP_EXIT1_DR,
+    TAP_PAUSE_DR, TAP_EXIT2_DR, TAP_UPDATE_DR,
+    TAP_SELECT_IR, TAP_CAPTURE_IR, TAP_SHIFT_IR, TAP_EXIT1_IR,
+    TAP_PAUSE_IR, TAP_EXIT2_IR, TAP_UPDATE_IR,
+};
+
+/*
+ * Next state of the TAP controller, for TMS 0 and 1.
+ */
+static const unsigned char tap_next[16][2] = {
+    [TAP_RESET]      = { TAP_IDLE,       TAP_RESET      },
+    [TAP_IDLE]       = { TAP_IDLE,       TAP_SELECT_DR  },
+    [TAP_SELECT_DR]  = { TAP_CAPTURE_DR, TAP_SELECT_IR  },
+    [TAP_CAPTURE_DR] = { TAP_SHIFT_DR,   TAP_EXIT1_DR   },
+    [TAP_SHIFT_DR]   = { TAP_SHIFT_DR,   TAP_EXIT1_DR   },
+    [TAP_EXIT1_DR]   = { TAP_PAUSE_DR,   TAP_UPDATE_DR  },
+    [TAP_PAUSE_DR]   = { TAP_PAUSE_DR,   TAP_EXIT2_DR   },
+    [TAP_EXIT2_DR]   = { TAP_SHIFT_DR,   TAP_UPDATE_DR  },
+    [TAP_UPDATE_DR]  = { TAP_IDLE,       TAP_SELECT_DR  },
+    [TAP_SELECT_IR]  = { TAP_CAPTURE_IR, TAP_RESET      },
+    [TAP_CAPTURE_IR] = { TAP_SHIFT_IR,   TAP_EXIT1_IR   },
+    [TAP_SHIFT_IR]   = { TAP_SHIFT_IR,   TAP_EXIT1_IR   },
+    [TAP_EXIT1_IR]   = { TAP_PAUSE_IR,   TAP_UPDATE_IR  },
+    [TAP_PAUSE_IR]   = { TAP_PAUSE_IR,   TAP_EXIT2_IR   },
+    [TAP_EXIT2_IR]   = { TAP_SHIFT_IR,   TAP_UPDATE_IR  },
+    [TAP_UPDATE_IR]  = { TAP_IDLE,       TAP_SELECT_DR  },
+};
+
+/*
+ * State of the processor.
+ */
+enum {
+    CPU_RUN,                            /* Running user code */
+    CPU_RESET,                          /* Reset is active */
+    CPU_DEBUG,                          /* Serial execution mode */
+    CPU_LOADER,                         /* Running PE loader */
+    CPU_PE,                             /* Running the executive */
+};
+
+/*
+ * Default chip for every family.
+ */
+static const struct {
+    const char *family;
+    const char *chip;
+} family_chip[] = {
+    { "mx1",    "MX250F128B"    },
+    { "xlp",    "MX174F256B"    },
+    { "mx3",    "MX795F512L"    },
+    { "mz",     "MZ2048ECH144"  },
+    { 0 },
+};
+
+struct _sim_t {
+    const variant_t *variant;
+    const family_t  *family;
+    unsigned char   *flash;
+    unsigned        flash_bytes;
+    unsigned char   *boot;
+    unsigned        boot_bytes;
+    unsigned char   ram [RAM_BYTES];
+
+    /* Latencies and faults. */
+    unsigned        maxtck_khz;         /* TDO is unreliable above */
+    unsigned        ber;                /* One of ber bits of TDO is wrong */
+    unsigned        rtt_usec;           /* Round trip of the probe */
+    unsigned        row_usec;           /* Program a row */
+    unsigned        word_usec;          /* Program a word or a quad word */
+    unsigned        page_usec;          /* Erase a page */
+    unsigned        erase_msec;         /* Erase the chip */
+    unsigned        crc_nsec;           /* Checksum a byte */
+    unsigned        fetch_nsec;         /* CPU fetches next instruction */
+    unsigned        fastdata_nsec;      /* PE takes next FASTDATA word */
+    unsigned        pace;               /* Keep wall clock behind */
+
+    /* Simulated time, nsec. */
+    unsigned long long now;
+    unsigned long long wall_start;
+    unsigned long long busy_until;      /* PE completes the last command */
+    unsigned long long erase_until;     /* Chip erase completes */
+    unsigned long long fetch_until;     /* Next instruction is requested */
+    unsigned long long fastdata_until;  /* Next FASTDATA word is taken */
+    unsigned long long ncycles;         /* TCK cycles */
+    unsigned long   nflush;             /* Round trips */
+    unsigned long   nrejected;          /* FASTDATA words not taken */
+    unsigned long   nflipped;           /* TDO bits corrupted */
+
+    /* MPSSE engine. */
+    unsigned        tck_khz;            /* JTAG clock, set by divisor */
+    unsigned long long tck_rem;         /* Time of cycles, below 1 nsec */
+    unsigned        master_khz;         /* Clock before divisor, halved */
+    unsigned        pins;               /* Output of GPIO pins */
+    unsigned char   reply [REPLY_BYTES];
+    unsigned        reply_len;
+    unsigned        reply_pos;
+    int             written;            /* Commands since the last read */
+    unsigned long long seed;            /* Generator of TDO errors */
+
+    /* JTAG port. */
+    int             tap;                /* State of TAP controller */
+    unsigned        ir_in;
+    unsigned        ir_nbits;
+    unsigned long long dr_in;
+    unsigned        dr_nbits;
+    struct {
+        unsigned    byte, bit;          /* Place in reply */
+        unsigned    k;                  /* Bit of the shift */
+    } tdo [64];
+    unsigned        ntdo;
+
+    /* TAP controllers. */
+    int             mtap;               /* MTAP is selected, else ETAP */
+    unsigned        ir;
+
+    /* MTAP. */
+    int             sysrst;             /* /SYSRST pin is active */
+    int             mchp_rst;           /* Reset by MCHP_ASSERT_RST */
+    int             flash_enabled;
+    int             ejtagboot;          /* Enter debug mode on reset */
+
+    /* Processor. */
+    int             cpu;
+    unsigned        gpr [32];
+    unsigned        data_reg;
+    unsigned        fastdata;           /* Written by sw to dmseg */
+    int             jump_pending;
+    unsigned        jump_addr;
+
+    /* PE loader. */
+    unsigned        ld_step;
+    unsigned        ld_base;            /* Address of the PE */
+    unsigned        ld_nwords;          /* Size of the PE */
+    unsigned        ld_addr;
+    unsigned        ld_count;
+
+    /* Executive: current command and queue of responses. */
+    unsigned        cmd [CMD_WORDS];
+    unsigned        ncmd;
+    unsigned        fifo [FIFO_SIZE];
+    unsigned long long fifo_ready [FIFO_SIZE];
+    unsigned        fifo_head;
+    unsigned        fifo_count;
+};
+
+static void cycles(sim_t *s, unsigned n)
+{
+    s->ncycles += n;
+    s->tck_rem += n * 1000000ULL;
+    s->now += s->tck_rem / s->tck_khz;
+    s->tck_rem %= s->tck_khz;
+}
+
+static int in_reset(sim_t *s)
+{
+    return s->sysrst || s->mchp_rst;
+}
+
+/*
+ * Reset of the processor: the executive is lost.
+ */
+static void cpu_reset(sim_t *s)
+{
+    s->cpu = CPU_RESET;
+    s->ncmd = 0;
+    s->fifo_count = 0;
+    s->jump_pending = 0;
+}
+
+/*
+ * Release of reset: with EJTAGBOOT, the processor stops
+ * in debug mode at the first fetch.
+ */
+static void cpu_start(sim_t *s)
+{
+    s->cpu = s->ejtagboot ? CPU_DEBUG : CPU_RUN;
+    memset(s->gpr, 0, sizeof(s->gpr));
+}
+
+/*
+ * Get a pointer to memory, or 0 when outside of RAM and flash.
+ */
+static unsigned char *mem(sim_t *s, unsigned addr, unsigned nbytes)
+{
+    addr &= 0x1fffffff;
+    if (addr + nbytes <= RAM_BYTES)
+        return s->ram + addr;
+    if (addr >= FLASH_BASE && addr + nbytes <= FLASH_BASE + s->flash_bytes)
+        return s->flash + addr - FLASH_BASE;
+    if (addr >= BOOT_BASE && addr + nbytes <= BOOT_BASE + s->boot_bytes)
+        return s->boot + addr - BOOT_BASE;
+    return 0;
+}
+
+static unsigned load_word(sim_t *s, unsigned addr)
+{
+    unsigned char *p;
+    unsigned word;
+
+    if ((addr & ~0xfffff) == DMSEG_FASTDATA)
+        return s->fastdata;
+    if ((addr & 0x1fffffff) == BMXDMSZ)
+        return RAM_BYTES;
+    p = mem(s, addr, 4);
+    if (! p)
+        return 0;
+    memcpy(&word, p, 4);
+    return word;
+}
+
+static void store_word(sim_t *s, unsigned addr, unsigned word)
+{
+    if ((addr & ~0xfffff) == DMSEG_FASTDATA) {
+        s->fastdata = word;
+        return;
+    }
+    /* Only RAM is writable by CPU; stores to registers are ignored. */
+    if ((addr & 0x1fffffff) + 4 <= RAM_BYTES)
+        memcpy(s->ram + (addr & 0x1fffffff), &word, 4);
+}
+
+/*
+ * Jump of the processor, from serial execution mode.
+ * Only a jump to the PE loader is supported.
+ */
+static void cpu_jump(sim_t *s, unsigned addr)
+{
+    unsigned i, word;
+
+    if ((addr & 0x1fffffff) != LOADER_ADDR) {
+        fprintf(stderr, "sim: jump to %08x is not supported\n", addr);
+        exit(-1);
+    }
+    for (i=0; i<PIC32_PE_LOADER_LEN; i+=2) {
+        memcpy(&word, s->ram + LOADER_ADDR + i*2, 4);
+        if (word != (pic32_pe_loader[i] << 16 | pic32_pe_loader[i+1])) {
+            fprintf(stderr, "sim: PE loader is corrupted at %08x\n",
+                0xa0000000 + LOADER_ADDR + i*2);
+            exit(-1);
+        }
+    }
+    s->cpu = CPU_LOADER;
+    s->ld_step = 0;
+}
+
+/*
+ * Execute an instruction, given by the probe.
+ */
+static void cpu_execute(sim_t *s, unsigned insn)
+{
+    unsigned rs = (insn >> 21) & 31;
+    unsigned rt = (insn >> 16) & 31;
+    unsigned imm = insn & 0xffff;
+    unsigned addr = s->gpr[rs] + (signed short) imm;
+    int jump = s->jump_pending;
+
+    s->jump_pending = 0;
+    switch (insn >> 26) {
+    case 0x00:
+        if (insn == 0)                  /* nop */
+            break;
+        if ((insn & 0x1fffff) == 0x08) {        /* jr */
+            s->jump_pending = 1;
+            s->jump_addr = s->gpr[rs];
+            break;
+        }
+        goto unsupported;
+    case 0x09:                          /* addiu */
+        s->gpr[rt] = s->gpr[rs] + (signed short) imm;
+        break;
+    case 0x0d:                          /* ori */
+        s->gpr[rt] = s->gpr[rs] | imm;
+        break;
+    case 0x0f:                          /* lui */
+        s->gpr[rt] = imm << 16;
+        break;
+    case 0x23:                          /* lw */
+        s->gpr[rt] = load_word(s, addr);
+        break;
+    case 0x2b:                          /* sw */
+        store_word(s, addr, s->gpr[rt]);
+        break;
+    default:
+unsupported:
+        fprintf(stderr, "sim: unsupported instruction %08x\n", insn);
+        exit(-1);
+    }
+    s->gpr[0] = 0;
+
+    /* Jump after the delay slot. */
+    if (jump)
+        cpu_jump(s, s->jump_addr);
+}
+
+/*
+ * Queue a response of the executive, available at the given time.
+ */
+static void respond(sim_t *s, unsigned word, unsigned long long ready)
+{
+    unsigned i;
+
+    if (s->fifo_count >= FIFO_SIZE) {
+        fprintf(stderr, "sim: too many unread PE responses\n");
+        exit(-1);
+    }
+    i = (s->fifo_head + s->fifo_count++) % FIFO_SIZE;
+    s->fifo[i] = word;
+    s->fifo_ready[i] = ready;
+}
+
+/*
+ * Program flash memory: bits can only be cleared.
+ * Return 0 when the address is invalid.
+ */
+static int program(sim_t *s, unsigned addr, const unsigned *data, unsigned nwords)
+{
+    unsigned char *p = mem(s, addr, nwords * 4);
+    unsigned i, word;
+
+    if (! p || p == s->ram + (addr & 0x1fffffff))
+        return 0;
+    for (i=0; i<nwords; i++, p+=4) {
+        memcpy(&word, p, 4);
+        if (debug_level > 1 && (word & data[i]) != data[i])
+            fprintf(stderr, "sim: program %08x over %08x at %08x\n",
+                data[i], word, addr + i*4);
+        word &= data[i];
+        memcpy(p, &word, 4);
+    }
+    return 1;
+}
+
+static void erase_chip(sim_t *s)
+{
+    memset(s->flash, 0xff, s->flash_bytes);
+    memset(s->boot, 0xff, s->boot_bytes);
+}
+
+/*
+ * Number of words in the PE command, including the header.
+ */
+static unsigned command_words(sim_t *s, unsigned header)
+{
+    switch (header >> 16) {
+    case PE_ROW_PROGRAM:        return 2 + s->family->bytes_per_row / 4;
+    case PE_READ:               return 2;
+    case PE_WORD_PROGRAM:       return 3;
+    case PE_QUAD_WORD_PROGRAM:  return 6;
+    case PE_PAGE_ERASE:         return 2;
+    case PE_BLANK_CHECK:        return 3;
+    case PE_GET_CRC:            return 3;
+    }
+    return 1;
+}
+
+/*
+ * Execute a command of the programming executive.
+ * Commands run one after another; responses become
+ * available when the command completes.
+ */
+static void pe_execute(sim_t *s)
+{
+    unsigned op = s->cmd[0] >> 16;
+    unsigned operand = s->cmd[0] & 0xffff;
+    unsigned addr = s->cmd[1];
+    unsigned long long cost = 0;
+    unsigned status = 0, i, nbytes;
+    unsigned char *p;
+
+    switch (op) {
+    case PE_ROW_PROGRAM:
+        if (addr % s->family->bytes_per_row != 0 ||
+            ! program(s, addr, s->cmd + 2, s->family->bytes_per_row / 4))
+            status = 2;
+        cost = s->row_usec * 1000ULL;
+        break;
+    case PE_READ:
+        if (! mem(s, addr, operand * 4))
+            status = 2;
+        break;
+    case PE_WORD_PROGRAM:
+        if (! program(s, addr, s->cmd + 2, 1))
+            status = 2;
+        cost = s->word_usec * 1000ULL;
+        break;
+    case PE_QUAD_WORD_PROGRAM:
+        if (addr % 16 != 0 || ! program(s, addr, s->cmd + 2, 4))
+            status = 2;
+        cost = s->word_usec * 1000ULL;
+        break;
+    case PE_CHIP_ERASE:
+        erase_chip(s);
+        cost = s->erase_msec * 1000000ULL;
+        break;
+    case PE_PAGE_ERASE:
+        nbytes = operand * s->family->bytes_per_page;
+        p = mem(s, addr, nbytes);
+        if (addr % s->family->bytes_per_page != 0 || ! p || p == s->ram + (addr & 0x1fffffff))
+            status = 2;
+        else
+            memset(p, 0xff, nbytes);
+        cost = operand * s->page_usec * 1000ULL;
+        break;
+    case PE_BLANK_CHECK:
+        nbytes = s->cmd[2];
+        p = mem(s, addr, nbytes);
+        if (! p) {
+            status = 2;
+            break;
+        }
+        for (i=0; i<nbytes; i++) {
+            if (p[i] != 0xff) {
+                status = 1;
+                break;
+            }
+        }
+        /* Comparing words is several times faster than the checksum. */
+        cost = (unsigned long long) nbytes * s->crc_nsec / 8;
+        break;
+    case PE_EXEC_VERSION:
+        status = s->family->pe_version;
+        break;
+    case PE_GET_CRC:
+        nbytes = s->cmd[2];
+        if (! mem(s, addr, nbytes))
+            status = 2;
+        cost = (unsigned long long) nbytes * s->crc_nsec;
+        break;
+    case PE_GET_DEVICEID:
+        break;
+    default:
+        status = 3;                     /* Not supported */
+        break;
+    }
+    if (s->busy_until < s->now)
+        s->busy_until = s->now;
+    s->busy_until += cost;
+
+    if (debug_level > 1)
+        fprintf(stderr, "sim: PE command %08x at %08x, status %u, %llu usec\n",
+            s->cmd[0], addr, status, cost / 1000);
+    respond(s, op << 16 | status, s->busy_until);
+    if (status == 2)
+        return;
+    switch (op) {
+    case PE_READ:
+        p = mem(s, addr, operand * 4);
+        for (i=0; i<operand; i++) {
+            unsigned word;
+            memcpy(&word, p + i*4, 4);
+            respond(s, word, s->busy_until);
+        }
+        break;
+    case PE_GET_CRC:
+        respond(s, crc16(CRC16_PE_SEED, mem(s, addr, s->cmd[2]), s->cmd[2]),
+            s->busy_until);
+        break;
+    case PE_GET_DEVICEID:
+        respond(s, s->variant->devid, s->busy_until);
+        break;
+    }
+}
+
+/*
+ * Word of FASTDATA, received by the PE loader.
+ */
+static void loader_word(sim_t *s, unsigned word)
+{
+    const family_t *f = s->family;
+
+    switch (s->ld_step) {
+    case 0:                             /* Address of the PE */
+        s->ld_base = word;
+        s->ld_addr = word;
+        s->ld_step++;
+        break;
+    case 1:                             /* Number of words */
+        s->ld_nwords = word;
+        s->ld_count = word;
+        s->ld_step++;
+        if (s->ld_count == 0 || ! mem(s, s->ld_addr, s->ld_count * 4)) {
+            /* Words were lost: the loader hangs until reset. */
+            if (debug_level > 0)
+                fprintf(stderr, "sim: bad PE location %08x, %u words\n",
+                    s->ld_addr, s->ld_count);
+            s->ld_step = 5;
+        }
+        break;
+    case 2:                             /* Code of the PE */
+        store_word(s, s->ld_addr, word);
+        s->ld_addr += 4;
+        if (--s->ld_count == 0)
+            s->ld_step++;
+        break;
+    case 3:                             /* Jump to the PE */
+        if (word == 0)
+            s->ld_step++;
+        break;
+    case 4:
+        if (word != 0xDEAD0000)
+            break;
+        if (s->ld_nwords != f->pe_nwords ||
+            memcmp(mem(s, s->ld_base, s->ld_nwords * 4), f->pe_code,
+                f->pe_nwords * 4) != 0) {
+            fprintf(stderr, "sim: PE image does not match %s family\n", f->name);
+            exit(-1);
+        }
+        s->cpu = CPU_PE;
+        s->ncmd = 0;
+        break;
+    }
+}
+
+/*
+ * Word of FASTDATA, received by the executive.
+ */
+static void pe_word(sim_t *s, unsigned word)
+{
+    s->cmd[s->ncmd++] = word;
+    if (s->ncmd < command_words(s, s->cmd[0]))
+        return;
+    pe_execute(s);
+    s->ncmd = 0;
+}
+
+/*
+ * Is a processor access pending?
+ */
+static int pracc(sim_t *s)
+{
+    switch (s->cpu) {
+    case CPU_DEBUG:
+        return s->now >= s->fetch_until;
+    case CPU_PE:
+        if (s->fifo_count > 0)
+            return s->fifo_ready[s->fifo_head] <= s->now;
+        break;
+    }
+
+    /* The probe would wait forever. */
+    fprintf(stderr, "sim: no processor access will ever happen (%s)\n",
+        s->cpu == CPU_PE ? "no PE response expected" : "not in debug mode");
+    exit(-1);
+    return 0;
+}
+
+static unsigned mtap_command(sim_t *s, unsigned cmd)
+{
+    unsigned status = MCHP_STATUS_CPS | MCHP_STATUS_CFGRDY;
+
+    switch (cmd) {
+    case MCHP_ASSERT_RST:
+        if (! in_reset(s))
+            cpu_reset(s);
+        s->mchp_rst = 1;
+        break;
+    case MCHP_DEASSERT_RST:
+        s->mchp_rst = 0;
+        if (! in_reset(s) && s->cpu == CPU_RESET)
+            cpu_start(s);
+        break;
+    case MCHP_ERASE:
+        erase_chip(s);
+        s->erase_until = s->now + s->erase_msec * 1000000ULL;
+
+        /* Chip erase resets the processor. */
+        cpu_reset(s);
+        if (! in_reset(s))
+            cpu_start(s);
+        break;
+    case MCHP_FLASH_ENABLE:
+        s->flash_enabled = 1;
+        break;
+    case MCHP_FLASH_DISABLE:
+        s->flash_enabled = 0;
+        break;
+    }
+    if (s->flash_enabled)
+        status |= MCHP_STATUS_FAEN;
+    if (in_reset(s))
+        status |= MCHP_STATUS_DEVRST;
+    if (s->now < s->erase_until)
+        status |= MCHP_STATUS_FCBUSY;
+    return status;
+}
+
+static void tap_reset(sim_t *s)
+{
+    s->ir = s->mtap ? MTAP_IDCODE : ETAP_IDCODE;
+}
+
+static void shift_ir(sim_t *s, unsigned ir)
+{
+    switch (ir) {
+    case TAP_SW_MTAP:
+        s->mtap = 1;
+        break;
+    case TAP_SW_ETAP:
+        s->mtap = 0;
+        break;
+    case ETAP_EJTAGBOOT:
+        if (! s->mtap)
+            s->ejtagboot = 1;
+        break;
+    case ETAP_NORMALBOOT:
+        if (! s->mtap)
+            s->ejtagboot = 0;
+        break;
+    }
+    s->ir = ir;
+}
+
+/*
+ * Is the next word of FASTDATA taken by the PE loader or the PE?
+ * The PE reads no FASTDATA, while it executes a command
+ * or has responses, which the probe has not read yet.
+ */
+static int fastdata_ready(sim_t *s)
+{
+    switch (s->cpu) {
+    case CPU_PE:
+        if (s->now < s->busy_until || s->fifo_count > 0)
+            return 0;
+        /* fall through */
+    case CPU_LOADER:
+        return s->now >= s->fastdata_until;
+    }
+    return 0;
+}
+
+/*
+ * Data register is updated: return the value captured before the shift.
+ */
+static unsigned long long shift_dr(sim_t *s, unsigned nbits, unsigned long long data)
+{
+    unsigned long long captured = 0;
+    unsigned ctl;
+
+    if (s->ir == MTAP_IDCODE || (! s->mtap && s->ir == ETAP_IDCODE))
+        return s->variant->devid;
+    if (s->mtap) {
+        if (s->ir == MTAP_COMMAND)
+            return mtap_command(s, data & 0xff);
+        return 0;
+    }
+    switch (s->ir) {
+    case ETAP_CONTROL:
+        if (in_reset(s) || s->cpu == CPU_RESET)
+            return CONTROL_PRRST | CONTROL_PERRST;
+        ctl = CONTROL_PROBEN | CONTROL_DM;
+        if (pracc(s))
+            ctl |= CONTROL_PRACC;
+        if ((ctl & CONTROL_PRACC) && ! (data & CONTROL_PRACC)) {
+            /* Probe completes the processor access. */
+            if (s->cpu == CPU_DEBUG) {
+                cpu_execute(s, s->data_reg);
+                s->fetch_until = s->now + s->fetch_nsec;
+            }
+            else if (s->cpu == CPU_PE) {
+                s->fifo_head = (s->fifo_head + 1) % FIFO_SIZE;
+                s->fifo_count--;
+            }
+        }
+        return ctl;
+    case ETAP_DATA:
+        if (s->cpu == CPU_PE && s->fifo_count > 0)
+            captured = s->fifo[s->fifo_head];
+        else
+            captured = s->data_reg;
+        s->data_reg = data;
+        return captured;
+    case ETAP_FASTDATA:
+        /* Data is shifted after the PrAcc bit,
+         * which is set when the word is accepted. */
+        captured = (unsigned long long) s->fastdata << 1;
+        if (! fastdata_ready(s)) {
+            if (s->cpu == CPU_LOADER || s->cpu == CPU_PE)
+                s->nrejected++;
+            return captured;
+        }
+        s->fastdata_until = s->now + s->fastdata_nsec;
+        if (s->cpu == CPU_LOADER)
+            loader_word(s, data >> 1);
+        else
+            pe_word(s, data >> 1);
+        return captured | 1;
+    }
+    return 0;
+}
+
+static void set_sysrst(sim_t *s, int active)
+{
+    if (active && ! in_reset(s))
+        cpu_reset(s);
+    s->sysrst = active;
+    if (! in_reset(s) && s->cpu == CPU_RESET)
+        cpu_start(s);
+}
+
+/*
+ * Deliver captured data to the host: one round trip of the probe.
+ * With pacing enabled, wait until the wall clock
+ * reaches the simulated time.
+ */
+static void round_trip(sim_t *s)
+{
+    unsigned long long wall;
+
+    s->now += s->rtt_usec * 1000ULL;
+    s->nflush++;
+    if (! s->pace)
+        return;
+    wall = report_clock() - s->wall_start;
+    if (wall < s->now)
+        usleep((s->now - wall) / 1000);
+}
+
+/*
+ * Above the max clock, one of ber bits of TDO is wrong.
+ */
+static int tdo_error(sim_t *s)
+{
+    if (s->maxtck_khz == 0 || s->tck_khz <= s->maxtck_khz)
+        return 0;
+    s->seed = s->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    if ((s->seed >> 33) % s->ber != 0)
+        return 0;
+    s->nflipped++;
+    return 1;
+}
+
+/*
+ * One cycle of TCK. When tdo_byte is not negative, TDO is placed
+ * into the given bit of reply. Data registers are shifted as a whole,
+ * so the bits of TDO are placed, when the shift is completed.
+ */
+static void clock_tck(sim_t *s, int tms, int tdi, int tdo_byte, int tdo_bit)
+{
+    unsigned long long captured;
+    int next = tap_next[s->tap][tms];
+    unsigned i, bit;
+
+    cycles(s, 1);
+    switch (s->tap) {
+    case TAP_SHIFT_DR:
+        if (tdo_byte >= 0 && s->ntdo < 64) {
+            s->tdo[s->ntdo].byte = tdo_byte;
+            s->tdo[s->ntdo].bit = tdo_bit;
+            s->tdo[s->ntdo].k = s->dr_nbits;
+            s->ntdo++;
+        }
+        if (s->dr_nbits < 64)
+            s->dr_in |= (unsigned long long) tdi << s->dr_nbits;
+        s->dr_nbits++;
+        if (next != TAP_SHIFT_DR) {
+            captured = shift_dr(s, (s->dr_nbits < 64) ? s->dr_nbits : 64, s->dr_in);
+            for (i=0; i<s->ntdo; i++) {
+                bit = (s->tdo[i].k < 64) ? (captured >> s->tdo[i].k) & 1 : 0;
+                if (bit ^ tdo_error(s))
+                    s->reply[s->tdo[i].byte] |= 1 << s->tdo[i].bit;
+            }
+        }
+        break;
+    case TAP_SHIFT_IR:
+        if (s->ir_nbits < 32)
+            s->ir_in |= tdi << s->ir_nbits;
+        s->ir_nbits++;
+        if (next != TAP_SHIFT_IR)
+            shift_ir(s, s->ir_in & 31);
+        break;
+    }
+    switch (next) {
+    case TAP_RESET:
+        if (s->tap != TAP_RESET)
+            tap_reset(s);
+        break;
+    case TAP_CAPTURE_DR:
+        s->dr_in = 0;
+        s->dr_nbits = 0;
+        s->ntdo = 0;
+        break;
+    case TAP_CAPTURE_IR:
+        s->ir_in = 0;
+        s->ir_nbits = 0;
+        break;
+    }
+    s->tap = next;
+}
+
+/*
+ * Clock a few bits, LSB first. When read is set, TDO is placed
+ * into a new byte of reply, shifted in from the top.
+ * TDI is given by the bits, or fixed when tdi is not negative.
+ */
+static void clock_bits(sim_t *s, unsigned nbits, unsigned tms_bits,
+    unsigned tdi_bits, int tdi, int read)
+{
+    int byte = -1;
+    unsigned i;
+
+    if (read) {
+        if (s->reply_len >= REPLY_BYTES) {
+            fprintf(stderr, "sim: too much data, not read by the host\n");
+            exit(-1);
+        }
+        byte = s->reply_len++;
+        s->reply[byte] = 0;
+    }
+    for (i=0; i<nbits; i++)
+        clock_tck(s, (tms_bits >> i) & 1,
+            (tdi >= 0) ? tdi : (tdi_bits >> i) & 1, byte, 8 - nbits + i);
+}
+
+void sim_mpsse_write(sim_t *s, const unsigned char *data, int nbytes)
+{
+    const unsigned char *end = data + nbytes;
+    unsigned op, len, i;
+
+    s->written = 1;
+    while (data < end) {
+        op = *data++;
+        switch (op) {
+        case 0x4b:                      /* TMS bits, no read */
+        case 0x6b:                      /* TMS bits with read */
+            clock_bits(s, data[0] + 1, data[1] & 0x7f, 0, data[1] >> 7, op == 0x6b);
+            data += 2;
+            break;
+        case 0x19:                      /* TDI bytes, no read */
+        case 0x39:                      /* TDI bytes with read */
+            len = (data[0] | data[1] << 8) + 1;
+            data += 2;
+            for (i=0; i<len; i++)
+                clock_bits(s, 8, 0, data[i], -1, op == 0x39);
+            data += len;
+            break;
+        case 0x1b:                      /* TDI bits, no read */
+        case 0x3b:                      /* TDI bits with read */
+            clock_bits(s, data[0] + 1, 0, data[1], -1, op == 0x3b);
+            data += 2;
+            break;
+        case 0x80:                      /* Set low byte of pins */
+            s->pins = (s->pins & 0xff00) | data[0];
+            set_sysrst(s, (s->pins & SYSRST_PIN) != 0);
+            data += 2;
+            break;
+        case 0x82:                      /* Set high byte of pins */
+            s->pins = (s->pins & 0x00ff) | data[0] << 8;
+            set_sysrst(s, (s->pins & SYSRST_PIN) != 0);
+            data += 2;
+            break;
+        case 0x86:                      /* Set TCK divisor */
+            s->tck_khz = s->master_khz / ((data[0] | data[1] << 8) + 1);
+            data += 2;
+            break;
+        case 0x8a:                      /* Disable clock divide by 5 */
+            s->master_khz = 30000;
+            break;
+        case 0x8b:                      /* Enable clock divide by 5 */
+            s->master_khz = 6000;
+            break;
+        case 0x84:                      /* Loopback on */
+        case 0x85:                      /* Loopback off */
+        case 0x87:                      /* Send immediate */
+        case 0x8d:                      /* Disable 3-phase clocking */
+        case 0x97:                      /* Disable adaptive clocking */
+            break;
+        default:
+            fprintf(stderr, "sim: unsupported MPSSE command %02x\n", op);
+            exit(-1);
+        }
+    }
+}
+
+int sim_mpsse_read(sim_t *s, unsigned char *data, int nbytes, int max_packet)
+{
+    int n = 0, len;
+
+    if (s->written) {
+        round_trip(s);
+        s->written = 0;
+    }
+    while (nbytes - n >= 2) {
+        /* Modem status and line status. */
+        data[n++] = 0x32;
+        data[n++] = 0x60;
+        len = max_packet - 2;
+        if (len > nbytes - n)
+            len = nbytes - n;
+        if (len > s->reply_len - s->reply_pos)
+            len = s->reply_len - s->reply_pos;
+        memcpy(data + n, s->reply + s->reply_pos, len);
+        s->reply_pos += len;
+        n += len;
+
+        /* Short packet ends the transfer. */
+        if (len < max_packet - 2)
+            break;
+    }
+    if (s->reply_pos == s->reply_len)
+        s->reply_pos = s->reply_len = 0;
+    return n;
+}
+
+void sim_delay(sim_t *s, unsigned msec)
+{
+    s->now += msec * 1000000ULL;
+}
+
+void sim_print_stats(sim_t *s)
+{
+    conprintf("    Simulated: %llu msec, %llu TCK cycles, %lu round trips\n",
+        s->now / 1000000, s->ncycles, s->nflush);
+    if (s->nrejected > 0 || s->nflipped > 0)
+        conprintf("    Simulated: %lu FASTDATA words rejected, %lu TDO bits corrupted\n",
+            s->nrejected, s->nflipped);
+}
+
+/*
+ * Parse the configuration: chip or family name,
+ * and a list of latencies.
+ */
+sim_t *sim_open(const char *config)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } param[] = {
+        { "maxtck", offsetof(sim_t, maxtck_khz) },
+        { "ber",    offsetof(sim_t, ber)        },
+        { "rtt",    offsetof(sim_t, rtt_usec)   },
+        { "row",    offsetof(sim_t, row_usec)   },
+        { "word",   offsetof(sim_t, word_usec)  },
+        { "page",   offsetof(sim_t, page_usec)  },
+        { "erase",  offsetof(sim_t, erase_msec) },
+        { "crc",    offsetof(sim_t, crc_nsec)   },
+        { "fetch",  offsetof(sim_t, fetch_nsec) },
+        { "fastdata", offsetof(sim_t, fastdata_nsec) },
+        { "pace",   offsetof(sim_t, pace)       },
+        { 0 },
+    };
+    char name [64], *p, *value;
+    sim_t *s;
+    int i;
+
+    s = calloc(1, sizeof(sim_t));
+    if (! s) {
+        fprintf(stderr, "sim: out of memory\n");
+        return 0;
+    }
+    s->rtt_usec = 1000;
+    s->row_usec = 2000;
+    s->word_usec = 40;
+    s->page_usec = 20000;
+    s->erase_msec = 80;
+    s->crc_nsec = 50;
+    s->ber = 16;
+    s->pace = 1;
+
+    /* Chip or family name. */
+    i = strcspn(config, ",");
+    if (i >= sizeof(name))
+        i = sizeof(name) - 1;
+    memcpy(name, config, i);
+    name[i] = 0;
+    config += i;
+    for (i=0; family_chip[i].family; i++) {
+        if (strcasecmp(name, family_chip[i].family) == 0) {
+            strcpy(name, family_chip[i].chip);
+            break;
+        }
+    }
+    s->variant = target_find_variant(name);
+    if (! s->variant || s->variant->family->pe_nwords == 0) {
+        fprintf(stderr, "sim: %s: unknown chip\n", name);
+        free(s);
+        return 0;
+    }
+    s->family = s->variant->family;
+
+    /* Latencies and faults. */
+    while (*config == ',') {
+        config++;
+        i = strcspn(config, ",");
+        if (i >= sizeof(name))
+            i = sizeof(name) - 1;
+        memcpy(name, config, i);
+        name[i] = 0;
+        config += i;
+
+        value = strchr(name, '=');
+        if (value)
+            *value++ = 0;
+        for (i=0; param[i].name; i++)
+            if (strcasecmp(name, param[i].name) == 0)
+                break;
+        if (! param[i].name || ! value) {
+            fprintf(stderr, "sim: %s: unknown parameter\n", name);
+            free(s);
+            return 0;
+        }
+        *(unsigned*) ((char*) s + param[i].offset) = strtoul(value, &p, 0);
+        if (p == value || *p) {
+            fprintf(stderr, "sim: %s: bad value %s\n", name, value);
+            free(s);
+            return 0;
+        }
+    }
+    s->flash_bytes = s->variant->flash_kbytes * 1024;
+    s->boot_bytes = s->family->boot_kbytes * 1024;
+    s->flash = malloc(s->flash_bytes);
+    s->boot = malloc(s->boot_bytes);
+    if (! s->flash || ! s->boot) {
+        fprintf(stderr, "sim: out of memory\n");
+        sim_close(s);
+        return 0;
+    }
+    if (s->ber == 0)
+        s->ber = 1;
+    erase_chip(s);
+    s->mtap = 1;
+    s->ir = MTAP_IDCODE;
+    s->tap = TAP_RESET;
+    s->cpu = CPU_RUN;
+    s->master_khz = 6000;
+    s->tck_khz = s->master_khz;
+    s->seed = 1;
+    s->wall_start = report_clock();
+    return s;
+}
+
+void sim_close(sim_t *s)
+{
+    free(s->flash);
+    free(s->boot);
+    free(s);
+}
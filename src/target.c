@@ -13,6 +13,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -21,6 +22,10 @@
 #include "localize.h"
 #include "pic32.h"
 #include "console.h"
+#include "crc16.h"
+#include "report.h"
+#include "trace.h"
+#include "transport.h"
 
 #include "config.h"
 
@@ -34,24 +39,31 @@ extern word_mask_func_t word_mask_mx3;
 extern word_mask_func_t word_mask_xlp;
 extern word_mask_func_t word_mask_mz;
 
-extern unsigned long open_retries;
+/*
+ * Settings, shared by all targets.
+ */
+int debug_level;
+int quiet;
+unsigned long open_retries = 1;         /* Attempts to find the adapter */
+unsigned long open_delay = 100;         /* Delay before bootloader commands, msec */
+int alternate_speed = 115200;           /* Baud rate after STK500 handshake */
 
 /*
  * PIC32 families.
  */
-                    /*-Boot-Devcfg--Row---Print------Code--------Nwords-Version-*/
+                    /*-Boot-Devcfg--Row---Page---Print------Code--------Nwords-Version-*/
 static const
 family_t family_mx1 = { "mx1",
-                        3,  0x0bf0, 128,  print_mx1, word_mask_mx1, pic32_pemx1, 422,  0x0301 };
+                        3,  0x0bf0, 128,  1024,  print_mx1, word_mask_mx1, pic32_pemx1, 422,  0x0301 };
 static const
 family_t family_xlp = { "xlp",
-                        12, 0x2ff0, 512,  print_xlp, word_mask_xlp, pic32_pemx3, 1044, 0x0201 };
+                        12, 0x2ff0, 512,  4096,  print_xlp, word_mask_xlp, pic32_pemx3, 1044, 0x0201 };
 static const
 family_t family_mx3 = { "mx3",
-                        12, 0x2ff0, 512,  print_mx3, word_mask_mx3, pic32_pemx3, 1044, 0x0201 };
+                        12, 0x2ff0, 512,  4096,  print_mx3, word_mask_mx3, pic32_pemx3, 1044, 0x0201 };
 static const
 family_t family_mz  = { "mz",
-                        80, 0xffc0, 2048, print_mz,  word_mask_mz,  pic32_pemz,  1052, 0x0502 };
+                        80, 0xffc0, 2048, 16384, print_mz,  word_mask_mz,  pic32_pemz,  1052, 0x0502 };
 /*
  * This one is a special one for the bootloader. We have no idea what we're
  * programming, so set the values to the maximum out of all the others.
@@ -59,7 +71,7 @@ family_t family_mz  = { "mz",
  */
 static const
 family_t family_bl  = { "bootloader",
-                        80, 0,      1024, 0,         0,           0,    0      };
+                        80, 0,      1024, 0,     0,         0,           0,    0      };
 
 /*
  * Table of PIC32 chip variants.
@@ -349,6 +361,8 @@ static variant_t pic32_tab[TABSZ] = {
     {0}
 };
 
+static int configured;                  /* Table is updated from pic32prog.conf */
+
 /*
  * Table of supported serial protocols.
  */
@@ -364,6 +378,9 @@ static const struct {
 #endif
 #ifdef ENABLE_BITBANG
     { "ascii",      adapter_open_bitbang        },
+#endif
+#ifdef ENABLE_MPSSE
+    { "sim",        adapter_open_mpsse_sim      },
 #endif
     { 0 },
 };
@@ -548,9 +565,9 @@ static int is_usb_device(const char *port_name)
 }
 
 /*
- * Connect to JTAG adapter.
+ * Allocate an empty target, to be connected by target_connect().
  */
-target_t *target_open(const char *port_name, int baud_rate)
+target_t *target_alloc(void)
 {
     target_t *t;
 
@@ -560,32 +577,60 @@ target_t *target_open(const char *port_name, int baud_rate)
         exit(-1);
     }
     t->cpu_name = "Unknown";
+    return t;
+}
+
+/*
+ * Connect to JTAG adapter.
+ */
+target_t *target_open(const char *port_name, int baud_rate)
+{
+    target_t *t = target_alloc();
+
+    target_connect(t, port_name, baud_rate);
+    return t;
+}
+
+/*
+ * Find the adapter and identify the target.
+ * The adapter is kept in t->adapter as soon as it is open,
+ * so the caller is able to close it after a fatal error.
+ */
+void target_connect(target_t *t, const char *port_name, int baud_rate)
+{
+    unsigned long retries;
 
     /* Update pic2_tab[] array from the pic32prog.conf file. */
-    target_configure();
+    if (! configured) {
+        target_configure();
+        configured = 1;
+    }
 
     /* Find adapter. */
-    if (open_retries == 0) open_retries = 1;
+    retries = open_retries;
+    if (retries == 0) retries = 1;
 
-    if (open_retries > 1) {
+    if (retries > 1) {
         conprintf("\n*** Enter programming mode now. ***\n\n");
         fflush(stdout);
     }
 
-    while(open_retries > 0) {
+    report_begin(PHASE_OPEN);
+    while(retries > 0) {
         if (is_usb_device(port_name)) {
-            t->adapter = open_usb_adapter(port_name, open_retries == 1);
+            t->adapter = open_usb_adapter(port_name, retries == 1);
         } else {
             t->adapter = open_serial_adapter(port_name, baud_rate);
         }
 
         if (t->adapter) break;
 
-        open_retries--;
-        if (open_retries > 0) {
+        retries--;
+        if (retries > 0) {
             usleep(500000);
         }
     }
+    report_end(PHASE_OPEN);
     if (! t->adapter) {
         fprintf(stderr, "\n");
         fprintf(stderr, _("No target found.\n"));
@@ -593,11 +638,17 @@ target_t *target_open(const char *port_name, int baud_rate)
     }
 
     /* Check CPU identifier. */
+    report_begin(PHASE_IDCODE);
+    trace_begin("adapter", "get_idcode", 0, 0);
     t->cpuid = t->adapter->get_idcode(t->adapter);
+    trace_end();
+    report_io(4);
+    report_end(PHASE_IDCODE);
     if (t->cpuid == 0) {
         /* Device not responding. */
         fprintf(stderr, _("Unknown CPUID=%08x.\n"), t->cpuid);
         t->adapter->close(t->adapter, 0);
+        t->adapter = 0;
         exit(1);
     }
 
@@ -607,6 +658,7 @@ target_t *target_open(const char *port_name, int baud_rate)
             /* Device not detected. */
             fprintf(stderr, _("Unknown CPUID=%08x.\n"), t->cpuid);
             t->adapter->close(t->adapter, 0);
+            t->adapter = 0;
             exit(1);
         }
     }
@@ -620,7 +672,8 @@ target_t *target_open(const char *port_name, int baud_rate)
         t->boot_bytes = t->adapter->boot_nbytes;
     }
     t->adapter->family_name = t->family->name;
-    return t;
+    t->adapter = trace_adapter(t->adapter);
+    report_target(t->cpu_name, t->cpuid);
 }
 
 /*
@@ -629,6 +682,8 @@ target_t *target_open(const char *port_name, int baud_rate)
 void target_close(target_t *t, int power_on)
 {
     t->adapter->close(t->adapter, power_on);
+    if (transport_stats)
+        transport_print_stats();
 }
 
 const char *target_cpu_name(target_t *t)
@@ -661,6 +716,29 @@ unsigned target_block_size(target_t *t)
     return t->family->bytes_per_row;
 }
 
+unsigned target_page_size(target_t *t)
+{
+    return t->family->bytes_per_page;
+}
+
+/*
+ * Find the family by name.
+ * Return 0 when not found.
+ */
+const family_t *target_find_family(const char *name)
+{
+    static const family_t *family_tab[] = {
+        &family_mx1, &family_xlp, &family_mx3, &family_mz, 0
+    };
+    int i;
+
+    for (i=0; family_tab[i]; i++) {
+        if (strcasecmp(name, family_tab[i]->name) == 0)
+            return family_tab[i];
+    }
+    return 0;
+}
+
 /*
  * Add an entry to the pic32_tab[] array.
  */
@@ -690,14 +768,39 @@ void target_add_variant(char *name, unsigned id,
     }
 }
 
+/*
+ * Find a chip variant by name.
+ */
+const variant_t *target_find_variant(const char *name)
+{
+    int i;
+
+    if (! configured) {
+        target_configure();
+        configured = 1;
+    }
+    for (i=0; pic32_tab[i].devid; i++) {
+        if (strcasecmp(name, pic32_tab[i].name) == 0)
+            return &pic32_tab[i];
+    }
+    return 0;
+}
+
 /*
  * Use PE for reading/writing/erasing memory.
  */
 void target_use_executive(target_t *t)
 {
-    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0)
+    if (t->pe_loaded)
+        return;
+    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0) {
+        report_begin(PHASE_PE_LOAD);
         t->adapter->load_executive(t->adapter, t->family->pe_code,
             t->family->pe_nwords, t->family->pe_version);
+        report_io(t->family->pe_nwords * 4);
+        report_end(PHASE_PE_LOAD);
+    }
+    t->pe_loaded = 1;
 }
 
 /*
@@ -754,6 +857,7 @@ void target_read_block(target_t *t, unsigned addr,
         if (n > 256)
             n = 256;
         t->adapter->read_data(t->adapter, addr, n, data);
+        report_io(n * 4);
         addr += n<<2;
         data += n;
         nwords -= n;
@@ -761,43 +865,183 @@ void target_read_block(target_t *t, unsigned addr,
     //fprintf(stderr, "    done (addr = %x)\n", addr);
 }
 
+/*
+ * Verify data by reading it back and comparing word by word,
+ * whatever checks the adapter is able to do by itself.
+ */
+void target_readback_block(target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned i, n, word, expected, block[256];
+
+    while (nwords > 0) {
+        n = nwords;
+        if (n > 256)
+            n = 256;
+        target_read_block(t, addr, n, block);
+        for (i=0; i<n; i++) {
+            expected = t->family->word_mask(addr + (i<<2), data[i]);
+            word = block [i];
+            if (word != expected) {
+                conprintf(_("\nerror at address %08X: file=%08X, mem=%08X\n"),
+                    addr + i*4, expected, word);
+                exit(1);
+            }
+        }
+        addr += n<<2;
+        data += n;
+        nwords -= n;
+    }
+}
+
 /*
  * Verify data.
  */
 void target_verify_block(target_t *t, unsigned addr,
     unsigned nwords, unsigned *data)
 {
-    unsigned i, word, expected, block[512];
-
     //fprintf(stderr, "%s: addr=%08x, nwords=%u, data=%08x...\n", __func__, addr, nwords, data[0]);
     if (t->adapter->verify_data != 0) {
         t->adapter->verify_data(t->adapter, virt_to_phys(addr), nwords, data);
+        report_io(nwords * 4);
         return;
     }
+    target_readback_block(t, addr, nwords, data);
+}
 
-    t->adapter->read_data(t->adapter, addr, nwords, block);
-    for (i=0; i<nwords; i++) {
-        expected = data [i];
-        expected = t->family->word_mask(addr + (i<<2), expected);
-        word = block [i];
-        if (word != expected) {
-            conprintf(_("\nerror at address %08X: file=%08X, mem=%08X\n"),
-                addr + i*4, expected, word);
-            exit(1);
+/*
+ * Verify data, using a precomputed checksum when the adapter
+ * is able to calculate checksums of flash memory.
+ */
+void target_verify_block_crc(target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data, unsigned crc)
+{
+    unsigned phys = virt_to_phys(addr);
+    unsigned devcfg = 0x1fc00000 + t->family->devcfg_offset;
+    unsigned flash_crc;
+
+    if (! t->adapter->get_crc ||
+        (phys <= devcfg && phys + nwords*4 > devcfg)) {
+        /* Configuration words may be masked on read. */
+        target_verify_block(t, addr, nwords, data);
+        return;
+    }
+
+    flash_crc = t->adapter->get_crc(t->adapter, phys, nwords * 4);
+    report_io(0);
+    if (flash_crc != crc) {
+        conprintf(_("\nchecksum failed at address %08X: file=%04X, mem=%04X\n"),
+            addr, crc, flash_crc);
+        exit(1);
+    }
+}
+
+/*
+ * Get checksum of flash memory, computed by the programming executive.
+ * Return -1 when the adapter is not able to compute checksums.
+ */
+int target_get_crc(target_t *t, unsigned addr, unsigned nbytes)
+{
+    if (! t->adapter->get_crc)
+        return -1;
+    report_io(0);
+    return t->adapter->get_crc(t->adapter, virt_to_phys(addr), nbytes);
+}
+
+/*
+ * Compare a page of flash memory with the given data.
+ * Return 1 when the contents match.
+ */
+int target_compare_page(target_t *t, unsigned addr, unsigned *data)
+{
+    unsigned nbytes = t->family->bytes_per_page;
+    unsigned phys = virt_to_phys(addr);
+    unsigned devcfg = 0x1fc00000 + t->family->devcfg_offset;
+    unsigned i, nwords = nbytes / 4;
+
+    if (phys <= devcfg && phys + nbytes > devcfg) {
+        /* Configuration words may be masked on read. */
+        unsigned block [nwords];
+
+        target_read_block(t, addr, nwords, block);
+        for (i=0; i<nwords; i++) {
+            if (block[i] != t->family->word_mask(addr + (i<<2), data[i]))
+                return 0;
         }
+        return 1;
     }
+    return t->adapter->get_crc(t->adapter, phys, nbytes) ==
+        crc16(CRC16_PE_SEED, (unsigned char*) data, nbytes);
+}
+
+/*
+ * Erase one page of flash memory.
+ */
+void target_erase_page(target_t *t, unsigned addr)
+{
+    t->adapter->erase_page(t->adapter, virt_to_phys(addr));
+    report_io(0);
+}
+
+/*
+ * Can we erase and reprogram separate pages of flash memory?
+ */
+int target_can_erase_page(target_t *t)
+{
+    return t->adapter->erase_page != 0 && t->adapter->get_crc != 0 &&
+        t->family->bytes_per_page != 0;
+}
+
+/*
+ * Check that flash and boot memory are blank.
+ * Executive is loaded for the check.
+ */
+static int target_is_blank(target_t *t)
+{
+    target_use_executive(t);
+    report_io(0);
+    if (! t->adapter->blank_check(t->adapter, t->flash_addr, t->flash_bytes))
+        return 0;
+    report_io(0);
+    if (t->boot_bytes > 0 &&
+        ! t->adapter->blank_check(t->adapter, 0x1fc00000, t->boot_bytes))
+        return 0;
+    return 1;
 }
 
 /*
  * Erase all Flash memory.
+ * With blank_check set, the erase is skipped when the chip is blank.
+ * Return 1 when the chip was erased, 0 when skipped.
  */
-int target_erase(target_t *t)
+int target_erase(target_t *t, int blank_check)
 {
+    struct timeval t0, t1;
+    unsigned msec;
+
+    if (blank_check && t->adapter->blank_check &&
+        t->adapter->load_executive && t->family->pe_nwords != 0) {
+        gettimeofday(&t0, 0);
+        conprintf(_("  Blank check: "));
+        fflush(stdout);
+        if (target_is_blank(t)) {
+            gettimeofday(&t1, 0);
+            msec = (t1.tv_sec - t0.tv_sec) * 1000 +
+                (t1.tv_usec - t0.tv_usec) / 1000;
+            conprintf(_("blank, erase skipped, checked in %u msec\n"), msec);
+            return 0;
+        }
+        conprintf(_("not blank\n"));
+    }
     if (t->adapter->erase_chip) {
         conprintf(_("        Erase: "));
         fflush(stdout);
         t->adapter->erase_chip(t->adapter);
+        report_io(0);
         conprintf(_("done\n"));
+
+        /* Chip erase resets the processor: executive is lost. */
+        t->pe_loaded = 0;
     }
     return 1;
 }
@@ -828,8 +1072,10 @@ void target_program_block(target_t *t, unsigned addr,
             unsigned n = nwords;
             if (n > words_per_row)
                 n = words_per_row;
-	    if (! target_test_empty_block(data, words_per_row))
+	    if (! target_test_empty_block(data, words_per_row)) {
                 t->adapter->program_row(t->adapter, addr, data, words_per_row);
+                report_io(words_per_row * 4);
+            }
             addr += n<<2;
             data += n;
             nwords -= n;
@@ -840,12 +1086,63 @@ void target_program_block(target_t *t, unsigned addr,
         if (n > 256)
             n = 256;
         t->adapter->program_block(t->adapter, addr, data);
+        report_io(n * 4);
         addr += n<<2;
         data += n;
         nwords -= n;
     }
 }
 
+/*
+ * Queue a request to the adapter. The address is converted
+ * from virtual to physical in place.
+ * Adapters without a queue execute the request immediately.
+ * Empty rows are not programmed, like in target_program_block().
+ */
+void target_submit(target_t *t, adapter_req_t *req)
+{
+    req->addr = virt_to_phys(req->addr);
+    if (req->op == AQ_PROGRAM_ROW &&
+        target_test_empty_block(req->data, req->nwords)) {
+        if (req->done)
+            req->done(req);
+        return;
+    }
+    report_io(req->op == AQ_PROGRAM_ROW ? req->nwords * 4 : 0);
+    if (t->adapter->submit) {
+        t->adapter->submit(t->adapter, req);
+        return;
+    }
+    switch (req->op) {
+    case AQ_PROGRAM_ROW:
+        t->adapter->program_row(t->adapter, req->addr, req->data, req->nwords);
+        break;
+    case AQ_GET_CRC:
+        req->result = t->adapter->get_crc(t->adapter, req->addr, req->nwords * 4);
+        break;
+    }
+    if (req->done)
+        req->done(req);
+}
+
+/*
+ * Wait for completion of all queued requests.
+ */
+void target_sync(target_t *t)
+{
+    if (t->adapter->sync)
+        t->adapter->sync(t->adapter);
+}
+
+/*
+ * Can we queue rows for programming and verification?
+ */
+int target_can_queue(target_t *t)
+{
+    return t->adapter->program_row != 0 && t->adapter->program_block == 0 &&
+        t->adapter->get_crc != 0 && t->adapter->block_override == 0;
+}
+
 /*
  * Program the configuration registers.
  */
@@ -862,6 +1159,7 @@ void target_program_devcfg(target_t *t, unsigned devcfg0,
         /* Since pic32mz, the programming executive */
         t->adapter->program_quad_word(t->adapter, addr, devcfg3,
             devcfg2, devcfg1, devcfg0);
+        report_io(16);
         return;
     }
 
@@ -869,4 +1167,5 @@ void target_program_devcfg(target_t *t, unsigned devcfg0,
     t->adapter->program_word(t->adapter, addr + 4, devcfg2);
     t->adapter->program_word(t->adapter, addr + 8, devcfg1);
     t->adapter->program_word(t->adapter, addr + 12, devcfg0);
+    report_io(16);
 }
@@ -0,0 +1,300 @@
+/*
+ * Trace of adapter operations in Chrome trace event format.
+ * The file opens in chrome://tracing or Perfetto UI.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "report.h"
+#include "localize.h"
+
+/*
+ * Adapter with traced calls.
+ */
+typedef struct {
+    adapter_t       adapter;            /* Common part */
+    adapter_t       *inner;             /* Adapter being traced */
+} trace_adapter_t;
+
+static FILE *trace_fd;
+static unsigned long long trace_start;  /* Time of the first event */
+static int trace_pid;
+static int trace_nevents;
+
+static void trace_close(void)
+{
+    if (! trace_fd)
+        return;
+    fprintf(trace_fd, "\n]\n");
+    fclose(trace_fd);
+    trace_fd = 0;
+}
+
+void trace_open(const char *filename)
+{
+    trace_fd = fopen(filename, "w");
+    if (! trace_fd) {
+        perror(filename);
+        exit(1);
+    }
+    fprintf(trace_fd, "[\n");
+    trace_start = report_clock();
+    trace_pid = getpid();
+    atexit(trace_close);
+}
+
+/*
+ * Write the common part of an event.
+ */
+static void put_event(int phase)
+{
+    unsigned long long nsec = report_clock() - trace_start;
+
+    /* Timestamps are in microseconds. */
+    fprintf(trace_fd, "%s{\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":1",
+        trace_nevents++ ? ",\n" : "", phase, nsec / 1000,
+        (unsigned) (nsec % 1000), trace_pid);
+}
+
+void trace_begin(const char *category, const char *name,
+    unsigned addr, unsigned nbytes)
+{
+    if (! trace_fd)
+        return;
+    put_event('B');
+    fprintf(trace_fd, ",\"cat\":\"%s\",\"name\":\"%s\",\"args\":{", category, name);
+    if (addr)
+        fprintf(trace_fd, "\"addr\":\"%08x\"%s", addr, nbytes ? "," : "");
+    if (nbytes)
+        fprintf(trace_fd, "\"nbytes\":%u", nbytes);
+    fprintf(trace_fd, "}}");
+}
+
+void trace_end(void)
+{
+    if (! trace_fd)
+        return;
+    put_event('E');
+    fprintf(trace_fd, "}");
+}
+
+static inline adapter_t *inner(adapter_t *adapter)
+{
+    return ((trace_adapter_t*) adapter)->inner;
+}
+
+static void traced_close(adapter_t *adapter, int power_on)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "close", 0, 0);
+    a->close(a, power_on);
+    trace_end();
+    free(adapter);
+}
+
+static unsigned traced_get_idcode(adapter_t *adapter)
+{
+    adapter_t *a = inner(adapter);
+    unsigned idcode;
+
+    trace_begin("adapter", "get_idcode", 0, 0);
+    idcode = a->get_idcode(a);
+    trace_end();
+    return idcode;
+}
+
+static void traced_load_executive(adapter_t *adapter,
+    const unsigned *pe, unsigned nwords, unsigned pe_version)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "load_executive", 0, nwords * 4);
+    a->load_executive(a, pe, nwords, pe_version);
+    trace_end();
+}
+
+static void traced_read_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "read_data", addr, nwords * 4);
+    a->read_data(a, addr, nwords, data);
+    trace_end();
+}
+
+static void traced_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "verify_data", addr, nwords * 4);
+    a->verify_data(a, addr, nwords, data);
+    trace_end();
+}
+
+static unsigned traced_get_crc(adapter_t *adapter, unsigned addr, unsigned nbytes)
+{
+    adapter_t *a = inner(adapter);
+    unsigned crc;
+
+    trace_begin("adapter", "get_crc", addr, nbytes);
+    crc = a->get_crc(a, addr, nbytes);
+    trace_end();
+    return crc;
+}
+
+static void traced_program_block(adapter_t *adapter, unsigned addr, unsigned *data)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "program_block", addr, 0);
+    a->program_block(a, addr, data);
+    trace_end();
+}
+
+static void traced_program_quad_word(adapter_t *adapter, unsigned addr,
+    unsigned word0, unsigned word1, unsigned word2, unsigned word3)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "program_quad_word", addr, 16);
+    a->program_quad_word(a, addr, word0, word1, word2, word3);
+    trace_end();
+}
+
+static void traced_program_row(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned words_per_row)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "program_row", addr, words_per_row * 4);
+    a->program_row(a, addr, data, words_per_row);
+    trace_end();
+}
+
+static void traced_program_word(adapter_t *adapter, unsigned addr, unsigned word)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "program_word", addr, 4);
+    a->program_word(a, addr, word);
+    trace_end();
+}
+
+static unsigned traced_read_word(adapter_t *adapter, unsigned addr)
+{
+    adapter_t *a = inner(adapter);
+    unsigned word;
+
+    trace_begin("adapter", "read_word", addr, 4);
+    word = a->read_word(a, addr);
+    trace_end();
+    return word;
+}
+
+static void traced_erase_chip(adapter_t *adapter)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "erase_chip", 0, 0);
+    a->erase_chip(a);
+    trace_end();
+}
+
+static void traced_erase_page(adapter_t *adapter, unsigned addr)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "erase_page", addr, 0);
+    a->erase_page(a, addr);
+    trace_end();
+}
+
+static int traced_blank_check(adapter_t *adapter, unsigned addr, unsigned nbytes)
+{
+    adapter_t *a = inner(adapter);
+    int blank;
+
+    trace_begin("adapter", "blank_check", addr, nbytes);
+    blank = a->blank_check(a, addr, nbytes);
+    trace_end();
+    return blank;
+}
+
+static void traced_submit(adapter_t *adapter, adapter_req_t *req)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", (req->op == AQ_PROGRAM_ROW) ?
+        "submit_program_row" : "submit_get_crc", req->addr, req->nwords * 4);
+    a->submit(a, req);
+    trace_end();
+}
+
+static void traced_sync(adapter_t *adapter)
+{
+    adapter_t *a = inner(adapter);
+
+    trace_begin("adapter", "sync", 0, 0);
+    a->sync(a);
+    trace_end();
+}
+
+adapter_t *trace_adapter(adapter_t *a)
+{
+    trace_adapter_t *t;
+
+    if (! trace_fd)
+        return a;
+    t = calloc(1, sizeof(trace_adapter_t));
+    if (! t) {
+        fprintf(stderr, _("Out of memory\n"));
+        exit(-1);
+    }
+    t->inner = a;
+    t->adapter = *a;
+
+    /* Methods, missing in the adapter, stay empty. */
+    t->adapter.close = traced_close;
+    t->adapter.get_idcode = traced_get_idcode;
+    if (a->load_executive)
+        t->adapter.load_executive = traced_load_executive;
+    if (a->read_data)
+        t->adapter.read_data = traced_read_data;
+    if (a->verify_data)
+        t->adapter.verify_data = traced_verify_data;
+    if (a->get_crc)
+        t->adapter.get_crc = traced_get_crc;
+    if (a->program_block)
+        t->adapter.program_block = traced_program_block;
+    if (a->program_quad_word)
+        t->adapter.program_quad_word = traced_program_quad_word;
+    if (a->program_row)
+        t->adapter.program_row = traced_program_row;
+    if (a->program_word)
+        t->adapter.program_word = traced_program_word;
+    if (a->read_word)
+        t->adapter.read_word = traced_read_word;
+    if (a->erase_chip)
+        t->adapter.erase_chip = traced_erase_chip;
+    if (a->erase_page)
+        t->adapter.erase_page = traced_erase_page;
+    if (a->blank_check)
+        t->adapter.blank_check = traced_blank_check;
+    if (a->submit)
+        t->adapter.submit = traced_submit;
+    if (a->sync)
+        t->adapter.sync = traced_sync;
+    return &t->adapter;
+}
@@ -0,0 +1,154 @@
+/*
+ * Transfers of adapters: tracing and statistics.
+ *
+ * Copyright (C) 2015-2017 Majenko Technologies
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "transport.h"
+#include "trace.h"
+#include "report.h"
+#include "console.h"
+#include "localize.h"
+
+#define NBUCKETS        10              /* Buckets of latency histogram */
+
+typedef struct {
+    unsigned long   nwrites;
+    unsigned long   nreads;
+    unsigned long long wbytes;          /* Bytes sent on the wire */
+    unsigned long long rbytes;          /* Bytes received */
+    unsigned long   ntimeouts;
+    unsigned long   nerrors;
+    unsigned long   nretries;
+    unsigned long   nrounds;            /* Round trips */
+    unsigned long long round_nsec;      /* Total time of round trips */
+    unsigned long long round_max;
+    unsigned long   hist [NBUCKETS];    /* Round trips by latency */
+    unsigned long long write_start;     /* Start of unanswered write, or 0 */
+} transport_stat_t;
+
+int transport_stats;
+
+static transport_stat_t stat [NTRANSPORTS];
+static unsigned long long payload;      /* User data bytes */
+static unsigned long long xfer_start;   /* Start of current transfer */
+
+static const char *transfer_name [NTRANSPORTS][2] = {
+    { "bulk_write",   "bulk_read" },
+    { "hid_write",    "hid_read" },
+    { "serial_write", "serial_read" },
+};
+
+static const char *transport_name [NTRANSPORTS] = {
+    "USB bulk", "USB HID", "serial",
+};
+
+/* Upper limits of histogram buckets, in microseconds. */
+static const unsigned bucket_usec [NBUCKETS-1] = {
+    100, 300, 1000, 3000, 10000, 30000, 100000, 300000, 1000000,
+};
+
+static const char *bucket_name [NBUCKETS] = {
+    "<100u", "<300u", "<1m", "<3m", "<10m", "<30m", "<100m", "<300m", "<1s", ">=1s",
+};
+
+void transport_begin(int type, int is_read, unsigned nbytes)
+{
+    trace_begin("transport", transfer_name[type][is_read], 0, nbytes);
+    if (! transport_stats)
+        return;
+    xfer_start = report_clock();
+    if (! is_read && stat[type].write_start == 0)
+        stat[type].write_start = xfer_start;
+}
+
+void transport_end(int type, int is_read, const unsigned char *data, int result)
+{
+    transport_stat_t *s = &stat[type];
+    unsigned long long nsec;
+    int i;
+
+    trace_end();
+    capture_transfer(type, is_read, data, result);
+    if (! transport_stats)
+        return;
+
+    if (result < 0) {
+        s->nerrors++;
+        return;
+    }
+    if (! is_read) {
+        s->nwrites++;
+        s->wbytes += result;
+        return;
+    }
+    s->nreads++;
+    s->rbytes += result;
+    if (result == 0) {
+        s->ntimeouts++;
+        return;
+    }
+    if (s->write_start == 0)
+        return;
+
+    /* Reply received: round trip is complete. */
+    nsec = report_clock() - s->write_start;
+    s->write_start = 0;
+    s->nrounds++;
+    s->round_nsec += nsec;
+    if (nsec > s->round_max)
+        s->round_max = nsec;
+    for (i=0; i<NBUCKETS-1; i++)
+        if (nsec < bucket_usec[i] * 1000ULL)
+            break;
+    s->hist[i]++;
+}
+
+void transport_retry(int type)
+{
+    if (transport_stats)
+        stat[type].nretries++;
+}
+
+void transport_payload(unsigned nbytes)
+{
+    if (transport_stats)
+        payload += nbytes;
+}
+
+void transport_print_stats(void)
+{
+    transport_stat_t *s;
+    unsigned long long wire;
+    int type, i;
+
+    for (type=0; type<NTRANSPORTS; type++) {
+        s = &stat[type];
+        if (s->nwrites == 0 && s->nreads == 0)
+            continue;
+        wire = s->wbytes + s->rbytes;
+        conprintf(_("    Transport: %s\n"), transport_name[type]);
+        conprintf(_("    Transfers: %lu writes, %lu reads, %lu retries, %lu timeouts, %lu errors\n"),
+            s->nwrites, s->nreads, s->nretries, s->ntimeouts, s->nerrors);
+        conprintf(_("   Wire bytes: %llu sent, %llu received, payload %llu bytes"),
+            s->wbytes, s->rbytes, payload);
+        if (wire > 0)
+            conprintf(_(", efficiency %llu%%"), payload * 100 / wire);
+        conprintf("\n");
+        if (s->nrounds == 0)
+            continue;
+        conprintf(_("  Round trips: %lu, average %llu usec, max %llu usec\n"),
+            s->nrounds, s->round_nsec / s->nrounds / 1000, s->round_max / 1000);
+        conprintf(_("      Latency:"));
+        for (i=0; i<NBUCKETS; i++)
+            if (s->hist[i] > 0)
+                conprintf(" %s:%lu", bucket_name[i], s->hist[i]);
+        conprintf("\n");
+    }
+}